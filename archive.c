@@ -0,0 +1,354 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* An archive stores each tracklog once as objects/XX/YYYY..., named by the
+ * SHA-256 of its contents, and the usual file names are hard links to the
+ * objects, or symbolic links if the archive is on another file system.  A
+ * tracklog is hashed and kept in memory as it arrives so that one that is
+ * already archived is never written at all.  Objects are made read only
+ * because changing one through any of its names would change them all. */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "tini.h"
+
+#define ARCHIVE_OBJECTS "objects"
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_t *sha256, const unsigned char *p)
+{
+    uint32_t w[64];
+    int i;
+    for (i = 0; i < 16; ++i, p += 4)
+	w[i] = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+    for (; i < 64; ++i) {
+	uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+	uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+	w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = sha256->h[0], b = sha256->h[1], c = sha256->h[2], d = sha256->h[3];
+    uint32_t e = sha256->h[4], f = sha256->h[5], g = sha256->h[6], h = sha256->h[7];
+    for (i = 0; i < 64; ++i) {
+	uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+	uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+	h = g;
+	g = f;
+	f = e;
+	e = d + t1;
+	d = c;
+	c = b;
+	b = a;
+	a = t1 + t2;
+    }
+    sha256->h[0] += a;
+    sha256->h[1] += b;
+    sha256->h[2] += c;
+    sha256->h[3] += d;
+    sha256->h[4] += e;
+    sha256->h[5] += f;
+    sha256->h[6] += g;
+    sha256->h[7] += h;
+}
+
+void sha256_init(sha256_t *sha256)
+{
+    static const uint32_t h[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(sha256->h, h, sizeof h);
+    sha256->len = 0;
+}
+
+void sha256_update(sha256_t *sha256, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    unsigned int used = sha256->len % 64;
+    sha256->len += len;
+    if (used) {
+	unsigned int n = 64 - used < len ? 64 - used : len;
+	memcpy(sha256->block + used, p, n);
+	p += n;
+	len -= n;
+	if (used + n < 64)
+	    return;
+	sha256_block(sha256, sha256->block);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+	sha256_block(sha256, p);
+    memcpy(sha256->block, p, len);
+}
+
+/* writes the digest as SHA256_HEX_LEN hexadecimal digits and a NUL */
+void sha256_final(sha256_t *sha256, char *hex)
+{
+    uint64_t bits = 8 * sha256->len;
+    unsigned int used = sha256->len % 64;
+    sha256->block[used++] = 0x80;
+    if (used > 56) {
+	memset(sha256->block + used, 0, 64 - used);
+	sha256_block(sha256, sha256->block);
+	used = 0;
+    }
+    memset(sha256->block + used, 0, 56 - used);
+    int i;
+    for (i = 0; i < 8; ++i)
+	sha256->block[56 + i] = bits >> (56 - 8 * i);
+    sha256_block(sha256, sha256->block);
+    for (i = 0; i < 32; ++i)
+	sprintf(hex + 2 * i, "%02x", (sha256->h[i / 4] >> (24 - 8 * (i % 4))) & 0xff);
+}
+
+archive_object_t *archive_object_new(void)
+{
+    archive_object_t *object = alloc(sizeof(archive_object_t));
+    sha256_init(&object->sha256);
+    return object;
+}
+
+void archive_object_delete(archive_object_t *object)
+{
+    if (object) {
+	free(object->buf);
+	free(object);
+    }
+}
+
+void archive_object_write(archive_object_t *object, const char *buf, size_t len)
+{
+    sha256_update(&object->sha256, buf, len);
+    if (object->len + len > object->capacity) {
+	while (object->len + len > object->capacity)
+	    object->capacity = object->capacity ? 2 * object->capacity : 65536;
+	object->buf = realloc(object->buf, object->capacity);
+	if (!object->buf)
+	    DIE("realloc", errno);
+    }
+    memcpy(object->buf + object->len, buf, len);
+    object->len += len;
+}
+
+/* writes the object under a temporary name and links it into place, so
+ * that an object is either complete or absent.  Returns 0 if an identical
+ * object was already there. */
+static int archive_object_store(archive_object_t *object, const char *archive, const char *path, sync_policy_t sync_policy)
+{
+    char tmp[1024];
+    if (snprintf(tmp, sizeof tmp, "%s/tmp-XXXXXX", archive) >= (int) sizeof tmp) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+	return -1;
+    size_t offset = 0;
+    while (offset < object->len) {
+	ssize_t rc = write(fd, object->buf + offset, object->len - offset);
+	if (rc == -1 && errno == EINTR)
+	    continue;
+	if (rc == -1)
+	    goto error;
+	offset += rc;
+    }
+    if (fchmod(fd, 0444) == -1)
+	goto error;
+    if (sync_policy == sync_policy_file && fdatasync(fd) == -1)
+	goto error;
+    if (close(fd) == -1) {
+	fd = -1;
+	goto error;
+    }
+    fd = -1;
+    int rc = link(tmp, path);
+    if (rc == -1 && errno != EEXIST)
+	goto error;
+    unlink(tmp);
+    return rc == 0;
+error:
+    {
+	int _errno = errno;
+	if (fd != -1)
+	    close(fd);
+	unlink(tmp);
+	errno = _errno;
+	return -1;
+    }
+}
+
+/* stores object in archive, unless it is already there, and makes temp a
+ * link to it for manifest_publish to move into place.  Returns 1 if the
+ * object is new, 0 if it was a duplicate and -1 with errno set on failure. */
+int archive_object_link(archive_object_t *object, const char *archive, const char *temp, sync_policy_t sync_policy)
+{
+    char hex[SHA256_HEX_LEN + 1];
+    sha256_final(&object->sha256, hex);
+    char path[1024];
+    if (snprintf(path, sizeof path, "%s/%s/%.2s", archive, ARCHIVE_OBJECTS, hex) >= (int) sizeof path - SHA256_HEX_LEN) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    if (mkdir(path, 0777) == -1 && errno != EEXIST)
+	return -1;
+    strcat(path, "/");
+    strcat(path, hex + 2);
+    int new = 0;
+    struct stat st;
+    if (stat(path, &st) == -1) {
+	if (errno != ENOENT)
+	    return -1;
+	new = archive_object_store(object, archive, path, sync_policy);
+	if (new == -1)
+	    return -1;
+    }
+    int rc = unlink(temp);
+    if (rc == 0 || errno == ENOENT) {
+	rc = link(path, temp);
+	if (rc == -1 && (errno == EXDEV || errno == EPERM || errno == EMLINK))
+	    rc = symlink(path, temp);
+    }
+    return rc == -1 ? -1 : new;
+}
+
+/* creates the archive directory if needed and returns its absolute path,
+ * which symbolic links into it need, or 0 with errno set */
+char *archive_open(const char *archive)
+{
+    if (mkdir(archive, 0777) == -1 && errno != EEXIST)
+	return 0;
+    char *path = realpath(archive, 0);
+    if (!path)
+	return 0;
+    char objects[1024];
+    if (snprintf(objects, sizeof objects, "%s/%s", path, ARCHIVE_OBJECTS) >= (int) sizeof objects) {
+	free(path);
+	errno = ENAMETOOLONG;
+	return 0;
+    }
+    if (mkdir(objects, 0777) == -1 && errno != EEXIST) {
+	int _errno = errno;
+	free(path);
+	errno = _errno;
+	return 0;
+    }
+    return path;
+}
+
+/* returns 0 if the file at path hashes to the name hex, -1 with errno set
+ * if it cannot be read */
+static int archive_verify_object(const char *path, const char *hex, char *buf, size_t size, off_t *bytes)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+	return -1;
+    sha256_t sha256;
+    sha256_init(&sha256);
+    while (1) {
+	ssize_t rc = read(fd, buf, size);
+	if (rc == -1 && errno == EINTR)
+	    continue;
+	if (rc == -1) {
+	    int _errno = errno;
+	    close(fd);
+	    errno = _errno;
+	    return -1;
+	}
+	if (rc == 0)
+	    break;
+	sha256_update(&sha256, buf, rc);
+	*bytes += rc;
+    }
+    close(fd);
+    char actual[SHA256_HEX_LEN + 1];
+    sha256_final(&sha256, actual);
+    return strcmp(actual, hex) ? 1 : 0;
+}
+
+/* rehashes every object, reports those that do not match their names and
+ * returns the number of bad objects */
+int archive_verify(const char *archive)
+{
+    char objects[1024];
+    if (snprintf(objects, sizeof objects, "%s/%s", archive, ARCHIVE_OBJECTS) >= (int) sizeof objects)
+	DIE("snprintf", ENAMETOOLONG);
+    DIR *dir = opendir(objects);
+    if (!dir)
+	error("opendir: %s: %s", objects, strerror(errno));
+    char *buf = alloc(65536);
+    int count = 0, bad = 0;
+    off_t bytes = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+	if (strlen(dirent->d_name) != 2 || dirent->d_name[0] == '.')
+	    continue;
+	char subdirectory[1024];
+	if (snprintf(subdirectory, sizeof subdirectory, "%s/%s", objects, dirent->d_name) >= (int) sizeof subdirectory)
+	    DIE("snprintf", ENAMETOOLONG);
+	DIR *subdir = opendir(subdirectory);
+	if (!subdir) {
+	    fprintf(stderr, "%s: opendir: %s: %s\n", program_name, subdirectory, strerror(errno));
+	    ++bad;
+	    continue;
+	}
+	struct dirent *subdirent;
+	while ((subdirent = readdir(subdir))) {
+	    if (subdirent->d_name[0] == '.')
+		continue;
+	    char path[1024];
+	    if (snprintf(path, sizeof path, "%s/%s", subdirectory, subdirent->d_name) >= (int) sizeof path)
+		DIE("snprintf", ENAMETOOLONG);
+	    char hex[SHA256_HEX_LEN + 1];
+	    memcpy(hex, dirent->d_name, 2);
+	    strncpy(hex + 2, subdirent->d_name, SHA256_HEX_LEN - 2);
+	    hex[SHA256_HEX_LEN] = '\0';
+	    ++count;
+	    int rc = strlen(subdirent->d_name) != SHA256_HEX_LEN - 2 ? 1 : archive_verify_object(path, hex, buf, 65536, &bytes);
+	    if (rc == -1)
+		fprintf(stderr, "%s: %s: %s\n", program_name, path, strerror(errno));
+	    else if (rc == 1)
+		fprintf(stderr, "%s: %s: checksum mismatch\n", program_name, path);
+	    if (rc)
+		++bad;
+	}
+	closedir(subdir);
+    }
+    closedir(dir);
+    free(buf);
+    printf("--- \n");
+    printf("objects: %d\n", count);
+    printf("bytes: %lld\n", (long long) bytes);
+    printf("bad: %d\n", bad);
+    return bad;
+}
@@ -0,0 +1,351 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* A capture records every byte read from and written to the devices as
+ * binary records with a monotonic timestamp.  Records are appended to one
+ * of two memory buffers under a mutex and a flusher thread writes out the
+ * other, so the download never waits for the disk.  If the flusher falls
+ * so far behind that both buffers are full, records are dropped and a drop
+ * record says how many bytes were lost. */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libtini.h"
+
+#ifndef CAPTURE_BUFSIZE
+#define CAPTURE_BUFSIZE (1 << 20)
+#endif
+
+#define CAPTURE_FLUSH_MS 100
+
+struct _capture_t {
+    const tini_hooks_t *hooks;
+    const char *filename;
+    int fd;
+    char *buf[2];
+    unsigned int len[2];
+    int active;
+    int devicec;
+    long dropped;
+    long dropped_total;
+    int failed;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+};
+
+/* a failed write stops the capture but not the download, capture_delete
+ * returns the error */
+static void capture_flush(capture_t *capture, const char *buf, unsigned int len)
+{
+    while (len && !capture->failed) {
+	ssize_t n = write(capture->fd, buf, len);
+	if (n == -1) {
+	    if (errno == EINTR)
+		continue;
+	    tini_log(capture->hooks, capture->filename, "write: %s", strerror(errno));
+	    capture->failed = errno;
+	    break;
+	}
+	buf += n;
+	len -= n;
+    }
+}
+
+static void *capture_thread(void *arg)
+{
+    capture_t *capture = arg;
+    pthread_mutex_lock(&capture->mutex);
+    while (1) {
+	/* batch small records into fewer writes */
+	if (capture->len[capture->active] < CAPTURE_BUFSIZE / 2 && !capture->stop) {
+	    struct timespec ts;
+	    if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
+		TINI_ABORT("clock_gettime", errno);
+	    ts.tv_nsec += CAPTURE_FLUSH_MS * 1000000L;
+	    if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_nsec -= 1000000000L;
+		++ts.tv_sec;
+	    }
+	    pthread_cond_timedwait(&capture->cond, &capture->mutex, &ts);
+	}
+	int flushing = capture->active;
+	unsigned int len = capture->len[flushing];
+	if (!len && capture->stop)
+	    break;
+	capture->active = !flushing;
+	pthread_mutex_unlock(&capture->mutex);
+	capture_flush(capture, capture->buf[flushing], len);
+	pthread_mutex_lock(&capture->mutex);
+	capture->len[flushing] = 0;
+    }
+    pthread_mutex_unlock(&capture->mutex);
+    return 0;
+}
+
+static void capture_free(capture_t *capture)
+{
+    tini_free(capture->hooks, capture->buf[0]);
+    tini_free(capture->hooks, capture->buf[1]);
+    tini_free(capture->hooks, capture);
+}
+
+/* returns 0 with errno set on failure */
+capture_t *capture_new(const tini_hooks_t *hooks, const char *filename)
+{
+    capture_t *capture = tini_alloc(hooks, sizeof(capture_t));
+    if (!capture)
+	return 0;
+    capture->hooks = hooks;
+    capture->filename = filename;
+    capture->buf[0] = tini_alloc(hooks, CAPTURE_BUFSIZE);
+    capture->buf[1] = tini_alloc(hooks, CAPTURE_BUFSIZE);
+    if (!capture->buf[0] || !capture->buf[1]) {
+	capture_free(capture);
+	errno = ENOMEM;
+	return 0;
+    }
+    capture->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (capture->fd == -1) {
+	int _errno = errno;
+	capture_free(capture);
+	errno = _errno;
+	return 0;
+    }
+    capture_flush(capture, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC));
+    pthread_mutex_init(&capture->mutex, 0);
+    pthread_cond_init(&capture->cond, 0);
+    int rc = pthread_create(&capture->thread, 0, capture_thread, capture);
+    if (rc) {
+	close(capture->fd);
+	pthread_cond_destroy(&capture->cond);
+	pthread_mutex_destroy(&capture->mutex);
+	capture_free(capture);
+	errno = rc;
+	return 0;
+    }
+    return capture;
+}
+
+/* returns -1 with errno set if a write or the close failed */
+int capture_delete(capture_t *capture)
+{
+    if (!capture)
+	return 0;
+    pthread_mutex_lock(&capture->mutex);
+    capture->stop = 1;
+    pthread_cond_signal(&capture->cond);
+    pthread_mutex_unlock(&capture->mutex);
+    int rc = pthread_join(capture->thread, 0);
+    if (rc)
+	TINI_ABORT("pthread_join", rc);
+    if (capture->dropped_total)
+	tini_log(capture->hooks, capture->filename, "%ld bytes dropped", capture->dropped_total);
+    int error = capture->failed;
+    if (close(capture->fd) == -1 && !error)
+	error = errno;
+    pthread_cond_destroy(&capture->cond);
+    pthread_mutex_destroy(&capture->mutex);
+    capture_free(capture);
+    errno = error;
+    return error ? -1 : 0;
+}
+
+/* call with the mutex held, returns 0 if the record does not fit */
+static int capture_append(capture_t *capture, int device, int type, const char *p1, unsigned int len1, const char *p2, unsigned int len2)
+{
+    capture_record_t record;
+    record.nsec = now_nsec();
+    record.len = len1 + len2;
+    record.device = device;
+    record.type = type;
+    record.reserved = 0;
+    unsigned int *len = capture->len + capture->active;
+    if (*len + sizeof record + record.len > CAPTURE_BUFSIZE)
+	return 0;
+    char *p = capture->buf[capture->active] + *len;
+    memcpy(p, &record, sizeof record);
+    memcpy(p + sizeof record, p1, len1);
+    memcpy(p + sizeof record + len1, p2, len2);
+    *len += sizeof record + record.len;
+    if (*len >= CAPTURE_BUFSIZE / 2)
+	pthread_cond_signal(&capture->cond);
+    return 1;
+}
+
+/* records data in two pieces, as it comes out of a ring */
+void capture_add(capture_t *capture, int device, int type, const char *p1, unsigned int len1, const char *p2, unsigned int len2)
+{
+    pthread_mutex_lock(&capture->mutex);
+    if (capture->dropped) {
+	uint32_t dropped = capture->dropped;
+	if (capture_append(capture, device, CAPTURE_DROP, (const char *) &dropped, sizeof dropped, 0, 0))
+	    capture->dropped = 0;
+    }
+    if (capture->dropped || !capture_append(capture, device, type, p1, len1, p2, len2)) {
+	capture->dropped += len1 + len2;
+	capture->dropped_total += len1 + len2;
+    }
+    pthread_mutex_unlock(&capture->mutex);
+}
+
+/* returns the number that identifies the device in later records */
+int capture_device(capture_t *capture, const char *name)
+{
+    pthread_mutex_lock(&capture->mutex);
+    int device = capture->devicec++;
+    pthread_mutex_unlock(&capture->mutex);
+    capture_add(capture, device, CAPTURE_DEVICE, name, strlen(name), 0, 0);
+    return device;
+}
+
+typedef struct {
+    const char *name;
+    int name_len;
+    char *line;
+    int len;
+    int capacity;
+} dump_device_t;
+
+/* writes a capture in the format of the -l log, returns 0 if it is not a
+ * capture and -1 with errno set on failure.  As in the log, a partial line
+ * is discarded when its response is cut short by an XON, a new command or
+ * lost bytes.  Unlike the log there is no summary of each session. */
+int capture_dump(const tini_hooks_t *hooks, const char *filename, FILE *file)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+	return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+	int _errno = errno;
+	close(fd);
+	errno = _errno;
+	return -1;
+    }
+    size_t size = st.st_size;
+    if (size < strlen(CAPTURE_MAGIC)) {
+	close(fd);
+	return 0;
+    }
+    const char *buf = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int _errno = errno;
+    close(fd);
+    if (buf == MAP_FAILED) {
+	errno = _errno;
+	return -1;
+    }
+    if (memcmp(buf, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC))) {
+	munmap((void *) buf, size);
+	return 0;
+    }
+    int result = 1;
+    dump_device_t *devicev = 0;
+    int devicec = 0, i;
+    const char *p = buf + strlen(CAPTURE_MAGIC), *end = buf + size;
+    while (p + sizeof(capture_record_t) <= end) {
+	capture_record_t record;
+	memcpy(&record, p, sizeof record);
+	p += sizeof record;
+	if (record.len > (size_t) (end - p)) {
+	    tini_log(hooks, filename, "truncated record");
+	    break;
+	}
+	if (record.device >= devicec) {
+	    dump_device_t *grown = tini_realloc(hooks, devicev, (record.device + 1) * sizeof(dump_device_t));
+	    if (!grown) {
+		result = -1;
+		break;
+	    }
+	    devicev = grown;
+	    memset(devicev + devicec, 0, (record.device + 1 - devicec) * sizeof(dump_device_t));
+	    devicec = record.device + 1;
+	}
+	dump_device_t *device = devicev + record.device;
+	const char *q;
+	switch (record.type) {
+	    case CAPTURE_DEVICE:
+		device->name = p;
+		device->name_len = record.len;
+		break;
+	    case CAPTURE_WRITE:
+		/* flytec_puts_nmea sends the terminating NUL too */
+		fprintf(file, "> %.*s", (int) strnlen(p, record.len), p);
+		device->len = 0;
+		break;
+	    case CAPTURE_READ:
+		for (q = p; q != p + record.len; ++q) {
+		    if (*q == XOFF || *q == XON) {
+			device->len = 0;
+			continue;
+		    }
+		    if (device->len == device->capacity) {
+			int capacity = device->capacity ? 2 * device->capacity : 128;
+			char *line = tini_realloc(hooks, device->line, capacity);
+			if (!line) {
+			    result = -1;
+			    break;
+			}
+			device->line = line;
+			device->capacity = capacity;
+		    }
+		    device->line[device->len++] = *q;
+		    if (*q == '\n') {
+			fprintf(file, "< %.*s", device->len, device->line);
+			device->len = 0;
+		    }
+		}
+		break;
+	    case CAPTURE_DROP:
+		if (record.len == sizeof(uint32_t)) {
+		    uint32_t dropped;
+		    memcpy(&dropped, p, sizeof dropped);
+		    fprintf(file, "# %u bytes dropped\n", dropped);
+		}
+		/* the lost bytes may belong to any device */
+		for (i = 0; i < devicec; ++i)
+		    devicev[i].len = 0;
+		break;
+	    case CAPTURE_ERROR:
+		fprintf(file, "# %.*s: %.*s\n", device->name_len, device->name, (int) record.len, p);
+		device->len = 0;
+		break;
+	    default:
+		break;
+	}
+	if (result == -1)
+	    break;
+	p += record.len;
+    }
+    for (i = 0; i < devicec; ++i)
+	tini_free(hooks, devicev[i].line);
+    tini_free(hooks, devicev);
+    munmap((void *) buf, size);
+    if (result == -1)
+	errno = ENOMEM;
+    return result;
+}
@@ -0,0 +1,201 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* Compares the B record decoders on a synthetic tracklog: the match_*
+ * parser, the fixed offset decoder and the SWAR columnar decoder.  All
+ * three must produce the same columns. */
+
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "tini.h"
+
+const char *program_name = 0;
+
+void error(const char *message, ...)
+{
+    fprintf(stderr, "%s: ", program_name);
+    va_list ap;
+    va_start(ap, message);
+    vfprintf(stderr, message, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+void die(const char *file, int line, const char *function, const char *message, int _errno)
+{
+    if (_errno)
+	error("%s:%d: %s: %s: %s", file, line, function, message, strerror(_errno));
+    else
+	error("%s:%d: %s: %s", file, line, function, message);
+}
+
+void *alloc(int size)
+{
+    void *p = malloc(size);
+    if (!p)
+	DIE("malloc", errno);
+    memset(p, 0, size);
+    return p;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+	DIE("clock_gettime", errno);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a random walk like flytecsim's, with some fixes in the southern and
+ * western hemispheres and below sea level */
+static char *igc_new(int records, size_t *len)
+{
+    char *buf = alloc(64 * (records + 2));
+    char *p = buf;
+    p += sprintf(p, "AXSM001 DECODEBENCH\r\nHFDTE310508\r\n");
+    int time = 10 * 3600, lat = 46 * 60000 + 30000, lon = 7 * 60000 + 45000, altitude = 1500;
+    int i;
+    for (i = 0; i < records; ++i) {
+	int south = (i / 1000) % 4 == 1, west = (i / 1000) % 4 == 2, low = (i / 1000) % 4 == 3;
+	int la = lat, lo = lon, alt = low ? -altitude % 1000 : altitude;
+	p += sprintf(p, "B%02d%02d%02d%02d%05d%c%03d%05d%c%c%05d%05d\r\n", (time / 3600) % 24, (time / 60) % 60, time % 60, la / 60000, la % 60000, south ? 'S' : 'N', lo / 60000, lo % 60000, west ? 'W' : 'E', i % 100 ? 'A' : 'V', alt, alt + 50);
+	++time;
+	lat += rand() % 21 - 10;
+	lon += rand() % 21 - 10;
+	altitude += rand() % 7 - 3;
+	if (altitude < 100)
+	    altitude = 100;
+    }
+    p += sprintf(p, "GDECODEBENCH\r\n");
+    *len = p - buf;
+    return buf;
+}
+
+static void decode_match(track_columns_t *columns, const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+    while (p != end) {
+	const char *next = (const char *) memchr(p, '\n', end - p) + 1;
+	b_record_t b;
+	if (*p == 'B' && b_record_parse(&b, p))
+	    track_columns_append(columns, &b);
+	p = next;
+    }
+}
+
+static void decode_fixed(track_columns_t *columns, const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+    while (p != end) {
+	const char *next = (const char *) memchr(p, '\n', end - p) + 1;
+	b_record_t b;
+	if (*p == 'B' && b_record_decode(&b, p, next - p))
+	    track_columns_append(columns, &b);
+	p = next;
+    }
+}
+
+static void decode_swar(track_columns_t *columns, const char *buf, size_t len)
+{
+    track_columns_decode(columns, buf, len);
+}
+
+static int columns_equal(const track_columns_t *a, const track_columns_t *b)
+{
+    return a->n == b->n
+	&& !memcmp(a->time, b->time, a->n * sizeof(int))
+	&& !memcmp(a->lat, b->lat, a->n * sizeof(int))
+	&& !memcmp(a->lon, b->lon, a->n * sizeof(int))
+	&& !memcmp(a->pressure_altitude, b->pressure_altitude, a->n * sizeof(int))
+	&& !memcmp(a->gnss_altitude, b->gnss_altitude, a->n * sizeof(int))
+	&& !memcmp(a->validity, b->validity, a->n);
+}
+
+int main(int argc, char *argv[])
+{
+    program_name = strrchr(argv[0], '/');
+    program_name = program_name ? program_name + 1 : argv[0];
+
+    int records = 100000, repeat = 20;
+    int c;
+    while ((c = getopt(argc, argv, "n:r:")) != -1) {
+	switch (c) {
+	    case 'n':
+		records = atoi(optarg);
+		break;
+	    case 'r':
+		repeat = atoi(optarg);
+		break;
+	    default:
+		error("usage: %s [-n records] [-r repeat]", program_name);
+	}
+    }
+    if (records < 1 || repeat < 1)
+	error("invalid arguments");
+
+    size_t len;
+    char *buf = igc_new(records, &len);
+    static const struct {
+	const char *name;
+	void (*decode)(track_columns_t *, const char *, size_t);
+    } decoders[] = {
+	{ "match", decode_match },
+	{ "fixed", decode_fixed },
+	{ "swar", decode_swar },
+    };
+    track_columns_t *reference = 0;
+    printf("--- \n");
+    printf("records: %d\n", records);
+    printf("bytes: %lu\n", (unsigned long) len);
+    printf("decoders:\n");
+    unsigned int i;
+    for (i = 0; i < sizeof decoders / sizeof decoders[0]; ++i) {
+	track_columns_t *columns = track_columns_new(0);
+	if (!columns)
+	    DIE("track_columns_new", errno);
+	double best = 0;
+	int r;
+	for (r = 0; r < repeat; ++r) {
+	    columns->n = 0;
+	    double start = now();
+	    decoders[i].decode(columns, buf, len);
+	    double elapsed = now() - start;
+	    if (r == 0 || elapsed < best)
+		best = elapsed;
+	}
+	if (columns->n != records)
+	    error("%s: decoded %d of %d records", decoders[i].name, columns->n, records);
+	if (!reference)
+	    reference = columns;
+	else if (!columns_equal(reference, columns))
+	    error("%s: columns differ from %s", decoders[i].name, decoders[0].name);
+	printf("- name: %s\n", decoders[i].name);
+	printf("  ns_per_record: %.1f\n", 1e9 * best / records);
+	printf("  mb_per_sec: %.0f\n", len / best / 1e6);
+	if (columns != reference)
+	    track_columns_delete(columns);
+    }
+    track_columns_delete(reference);
+    free(buf);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,272 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* GPX and KML are written as the IGC lines arrive, one point per B record,
+ * so an export never holds more than one block of output however long the
+ * tracklog is.  The caller writes out buf whenever len reaches
+ * EXPORT_BLOCK.  KML gets a LineString because a gx:Track would need all
+ * the times before all the coordinates.  The date comes from the HFDTE
+ * record and advances when the time of day wraps past midnight. */
+
+#include "tini.h"
+
+#define EXPORT_POINT_MAX 192
+
+static const char *const gpx_header =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<gpx version=\"1.1\" creator=\"tini\" xmlns=\"http://www.topografix.com/GPX/1/1\">\n"
+    "<trk>\n"
+    "<trkseg>\n";
+static const char *const gpx_footer =
+    "</trkseg>\n"
+    "</trk>\n"
+    "</gpx>\n";
+static const char *const kml_header =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n"
+    "<Placemark>\n"
+    "<LineString>\n"
+    "<altitudeMode>absolute</altitudeMode>\n"
+    "<coordinates>\n";
+static const char *const kml_footer =
+    "</coordinates>\n"
+    "</LineString>\n"
+    "</Placemark>\n"
+    "</kml>\n";
+
+static void export_reserve(export_encoder_t *export, int len)
+{
+    if (export->len + len <= export->capacity)
+	return;
+    while (export->len + len > export->capacity)
+	export->capacity = export->capacity ? 2 * export->capacity : EXPORT_BLOCK + EXPORT_POINT_MAX;
+    export->buf = realloc(export->buf, export->capacity);
+    if (!export->buf)
+	DIE("realloc", errno);
+}
+
+static void export_append(export_encoder_t *export, const char *s)
+{
+    int len = strlen(s);
+    export_reserve(export, len);
+    memcpy(export->buf + export->len, s, len);
+    export->len += len;
+}
+
+export_encoder_t *export_encoder_new(track_format_t format)
+{
+    export_encoder_t *export = alloc(sizeof(export_encoder_t));
+    export->format = format;
+    export->midnight = -1;
+    export_append(export, format == track_format_kml ? kml_header : gpx_header);
+    return export;
+}
+
+void export_encoder_delete(export_encoder_t *export)
+{
+    if (export) {
+	free(export->buf);
+	free(export);
+    }
+}
+
+    static inline char *
+put_int(char *p, int value)
+{
+    char digits[12];
+    unsigned int u = value < 0 ? -(unsigned int) value : (unsigned int) value;
+    int n = 0;
+    do {
+	digits[n++] = '0' + u % 10;
+	u /= 10;
+    } while (u);
+    if (value < 0)
+	*p++ = '-';
+    while (n)
+	*p++ = digits[--n];
+    return p;
+}
+
+/* writes thousandths of a minute as degrees with six decimals */
+    static inline char *
+put_degrees(char *p, int value)
+{
+    unsigned int u = value < 0 ? -(unsigned int) value : (unsigned int) value;
+    unsigned int microdegrees = (1000U * u + 30) / 60;
+    if (value < 0)
+	*p++ = '-';
+    p = put_int(p, microdegrees / 1000000);
+    *p++ = '.';
+    return put_digits(p, 6, microdegrees % 1000000);
+}
+
+static void export_set_date(export_encoder_t *export)
+{
+    struct tm tm;
+    if (!gmtime_r(&export->midnight, &tm))
+	DIE("gmtime_r", errno);
+    char *p = export->date;
+    p = put_digits(p, 4, tm.tm_year + 1900);
+    *p++ = '-';
+    p = put_digits(p, 2, tm.tm_mon + 1);
+    *p++ = '-';
+    p = put_digits(p, 2, tm.tm_mday);
+}
+
+/* accepts both HFDTEDDMMYY and HFDTEDATE:DDMMYY */
+static void export_hfdte(export_encoder_t *export, const char *line, int len)
+{
+    if (len >= 10 && !memcmp(line + 5, "DATE:", 5)) {
+	line += 5;
+	len -= 5;
+    }
+    if (len < 11)
+	return;
+    int i;
+    for (i = 5; i < 11; ++i)
+	if (line[i] < '0' || '9' < line[i])
+	    return;
+    struct tm tm;
+    memset(&tm, 0, sizeof tm);
+    tm.tm_mday = 10 * (line[5] - '0') + line[6] - '0';
+    tm.tm_mon = 10 * (line[7] - '0') + line[8] - '0' - 1;
+    tm.tm_year = 10 * (line[9] - '0') + line[10] - '0' + 100;
+    time_t midnight = tini_timegm(&tm);
+    if (midnight == (time_t) -1)
+	return;
+    export->midnight = midnight;
+    export->time = 0;
+    export_set_date(export);
+}
+
+/* any line that is not a B record */
+void export_line(export_encoder_t *export, const char *line, int len)
+{
+    if (len >= 5 && !memcmp(line, "HFDTE", 5))
+	export_hfdte(export, line, len);
+}
+
+void export_b(export_encoder_t *export, const b_record_t *b)
+{
+    if (export->midnight != -1 && b->time < export->time - 43200) {
+	export->midnight += 86400;
+	export_set_date(export);
+    }
+    export->time = b->time;
+    int altitude = b_record_altitude(b);
+    export_reserve(export, EXPORT_POINT_MAX);
+    char *p = export->buf + export->len;
+    if (export->format == track_format_kml) {
+	p = put_degrees(p, b->lon);
+	*p++ = ',';
+	p = put_degrees(p, b->lat);
+	*p++ = ',';
+	p = put_int(p, altitude);
+	*p++ = '\n';
+    } else {
+	memcpy(p, "<trkpt lat=\"", 12);
+	p = put_degrees(p + 12, b->lat);
+	memcpy(p, "\" lon=\"", 7);
+	p = put_degrees(p + 7, b->lon);
+	memcpy(p, "\"><ele>", 7);
+	p = put_int(p + 7, altitude);
+	memcpy(p, "</ele>", 6);
+	p += 6;
+	if (export->midnight != -1) {
+	    memcpy(p, "<time>", 6);
+	    memcpy(p + 6, export->date, 10);
+	    p += 16;
+	    *p++ = 'T';
+	    p = put_digits(p, 2, b->time / 3600);
+	    *p++ = ':';
+	    p = put_digits(p, 2, (b->time / 60) % 60);
+	    *p++ = ':';
+	    p = put_digits(p, 2, b->time % 60);
+	    memcpy(p, "Z</time>", 8);
+	    p += 8;
+	}
+	memcpy(p, "</trkpt>\n", 9);
+	p += 9;
+    }
+    export->len = p - export->buf;
+}
+
+/* appends the conversion of one or more complete IGC lines */
+void export_encode(export_encoder_t *export, const char *buf, int len)
+{
+    const char *end = buf + len;
+    while (buf != end) {
+	const char *eol = memchr(buf, '\n', end - buf);
+	const char *next = eol ? eol + 1 : end;
+	b_record_t b;
+	if (*buf == 'B' && b_record_decode(&b, buf, next - buf))
+	    export_b(export, &b);
+	else
+	    export_line(export, buf, next - buf);
+	buf = next;
+    }
+}
+
+/* appends the end of the document */
+void export_finish(export_encoder_t *export)
+{
+    export_append(export, export->format == track_format_kml ? kml_footer : gpx_footer);
+}
+
+typedef struct {
+    export_encoder_t *export;
+    FILE *file;
+} export_file_t;
+
+static void export_file_flush(export_file_t *export_file)
+{
+    export_encoder_t *export = export_file->export;
+    if (fwrite(export->buf, 1, export->len, export_file->file) != (size_t) export->len)
+	DIE("fwrite", errno);
+    export->len = 0;
+}
+
+static void export_file_line(void *data, const char *line, int len)
+{
+    export_file_t *export_file = data;
+    export_line(export_file->export, line, len);
+}
+
+static void export_file_b(void *data, const b_record_t *b)
+{
+    export_file_t *export_file = data;
+    export_b(export_file->export, b);
+    if (export_file->export->len >= EXPORT_BLOCK)
+	export_file_flush(export_file);
+}
+
+/* converts the IGC or tnb file in buf, returns 0 if a tnb file is corrupt */
+int export_track(const char *buf, size_t size, track_format_t format, FILE *file)
+{
+    export_file_t export_file;
+    export_file.export = export_encoder_new(format);
+    export_file.file = file;
+    int rc = track_scan(buf, size, export_file_line, export_file_b, &export_file);
+    export_finish(export_file.export);
+    export_file_flush(&export_file);
+    export_encoder_delete(export_file.export);
+    return rc;
+}
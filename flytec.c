@@ -20,152 +20,597 @@
 */
 
 #include <fcntl.h>
+#include <stdarg.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+#include <sys/ioctl.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <termios.h>
 #include <unistd.h>
 
-#include "tini.h"
+#include "libtini.h"
+
+#ifndef FLYTEC_BUFSIZE
+#define FLYTEC_BUFSIZE 65536
+#endif
 
 static const char base36[36] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
-flytec_t *flytec_new(const char *device, FILE *logfile)
+long now_nsec(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+	TINI_ABORT("clock_gettime", errno);
+    return 1000000000L * ts.tv_sec + ts.tv_nsec;
+}
+
+void histogram_add(histogram_t *histogram, unsigned long value)
+{
+    int bucket = value ? 8 * sizeof(long) - __builtin_clzl(value) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS)
+	bucket = HISTOGRAM_BUCKETS - 1;
+    ++histogram->count[bucket];
+}
+
+/* reads the UART error counters, not all drivers keep them */
+static int uart_counters(int fd, int *counters)
+{
+#ifdef TIOCGICOUNT
+    struct serial_icounter_struct icount;
+    if (ioctl(fd, TIOCGICOUNT, &icount) == -1)
+	return 0;
+    counters[0] = icount.frame;
+    counters[1] = icount.overrun;
+    counters[2] = icount.parity;
+    counters[3] = icount.brk;
+    counters[4] = icount.buf_overrun;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* first guesses by instrument, the Competino is slow to answer and pauses
+ * in the middle of long responses */
+static const flytec_timing_t flytec_timings[] = {
+    { "COMPETINO", 1000, 500 },
+    { "COMPETINO+", 1000, 500 },
+    { "COMPEO", 500, 250 },
+    { "COMPEO+", 500, 250 },
+    { "GALILEO", 500, 250 },
+    { "5020", 250, 250 },
+    { "5030", 250, 250 },
+    { "6020", 250, 250 },
+    { "6030", 250, 250 },
+    { 0, FLYTEC_TIMEOUT_MS, FLYTEC_TIMEOUT_MS }
+};
+
+/* returns the profile for instrument_id, or the default */
+const flytec_timing_t *flytec_timing_find(const char *instrument_id)
+{
+    const flytec_timing_t *timing;
+    for (timing = flytec_timings; timing->instrument_id; ++timing)
+	if (instrument_id && !strcmp(timing->instrument_id, instrument_id))
+	    break;
+    return timing;
+}
+
+/* the smoothed delay plus four deviations, doubled for each timeout since
+ * the last delay seen, called with the lock held */
+static void phase_update(flytec_phase_t *phase)
+{
+    if (phase->fixed)
+	return;
+    long timeout_ms = (phase->srtt_usec + 4 * phase->rttvar_usec + 999) / 1000;
+    if (timeout_ms < phase->floor_ms)
+	timeout_ms = phase->floor_ms;
+    timeout_ms <<= phase->backoff;
+    if (timeout_ms > FLYTEC_TIMEOUT_MAX_MS)
+	timeout_ms = FLYTEC_TIMEOUT_MAX_MS;
+    __atomic_store_n(&phase->timeout_ms, timeout_ms, __ATOMIC_RELAXED);
+}
+
+/* starts phase at ms, which the delays seen can bring down to a quarter
+ * plus whatever the transport holds back */
+static void phase_init(flytec_phase_t *phase, int ms, int batch_ms)
+{
+    pthread_mutex_lock(&phase->lock);
+    phase->floor_ms = (ms / 4 < FLYTEC_TIMEOUT_MIN_MS ? FLYTEC_TIMEOUT_MIN_MS : ms / 4) + batch_ms;
+    if (!phase->samples) {
+	phase->srtt_usec = 1000L * ms / 3;
+	phase->rttvar_usec = phase->srtt_usec / 2;
+    }
+    phase_update(phase);
+    pthread_mutex_unlock(&phase->lock);
+}
+
+static void phase_sample(flytec_phase_t *phase, long usec)
+{
+    pthread_mutex_lock(&phase->lock);
+    if (phase->samples++ == 0) {
+	phase->srtt_usec = usec;
+	phase->rttvar_usec = usec / 2;
+    } else {
+	long delta = usec - phase->srtt_usec;
+	phase->rttvar_usec += ((delta < 0 ? -delta : delta) - phase->rttvar_usec) / 4;
+	phase->srtt_usec += delta / 8;
+    }
+    phase->backoff = 0;
+    phase_update(phase);
+    pthread_mutex_unlock(&phase->lock);
+}
+
+/* fixes the first byte and inter-byte timeouts to the ones that are not 0 */
+void flytec_set_timing(flytec_t *flytec, int first_byte_ms, int inter_byte_ms)
+{
+    if (first_byte_ms) {
+	pthread_mutex_lock(&flytec->first_byte.lock);
+	flytec->first_byte.fixed = 1;
+	__atomic_store_n(&flytec->first_byte.timeout_ms, first_byte_ms, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&flytec->first_byte.lock);
+    }
+    if (inter_byte_ms) {
+	pthread_mutex_lock(&flytec->inter_byte.lock);
+	flytec->inter_byte.fixed = 1;
+	__atomic_store_n(&flytec->inter_byte.timeout_ms, inter_byte_ms, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&flytec->inter_byte.lock);
+    }
+}
+
+/* the timeout for the next read */
+int flytec_timeout_ms(flytec_t *flytec)
+{
+    flytec_phase_t *phase = __atomic_load_n(&flytec->awaiting_first_byte, __ATOMIC_RELAXED) ? &flytec->first_byte : &flytec->inter_byte;
+    return __atomic_load_n(&phase->timeout_ms, __ATOMIC_RELAXED);
+}
+
+/* backs off the timeout that just expired */
+void flytec_timed_out(flytec_t *flytec)
+{
+    flytec_phase_t *phase = __atomic_load_n(&flytec->awaiting_first_byte, __ATOMIC_RELAXED) ? &flytec->first_byte : &flytec->inter_byte;
+    pthread_mutex_lock(&phase->lock);
+    if (phase->backoff < 4)
+	++phase->backoff;
+    phase_update(phase);
+    pthread_mutex_unlock(&phase->lock);
+}
+
+/* called by whichever thread reads the device */
+void flytec_count_read(flytec_t *flytec, int n)
+{
+    long now = now_nsec();
+    /* the acquire pairs with flytec_command_begin's release, so command_nsec
+     * is the start of the command whose first byte this is */
+    int first_byte = __atomic_exchange_n(&flytec->awaiting_first_byte, 0, __ATOMIC_ACQUIRE);
+    long command_nsec = __atomic_load_n(&flytec->command_nsec, __ATOMIC_RELAXED);
+    if (first_byte)
+	phase_sample(&flytec->first_byte, (now - command_nsec) / 1000);
+    else if (flytec->last_read_nsec > command_nsec)
+	phase_sample(&flytec->inter_byte, (now - flytec->last_read_nsec) / 1000);
+    ++flytec->reads;
+    __atomic_fetch_add(&flytec->bytes, n, __ATOMIC_RELAXED);
+    histogram_add(&flytec->read_sizes, n);
+    if (flytec->last_read_nsec)
+	histogram_add(&flytec->read_gaps, (now - flytec->last_read_nsec) / 1000);
+    flytec->last_read_nsec = now;
+    if (flytec->capture) {
+	/* the n bytes just read end at the ring's head, perhaps wrapped */
+	ring_t *ring = flytec->ring;
+	unsigned int offset = (ring->head - n) & (ring->size - 1);
+	unsigned int len = (unsigned int) n < ring->size - offset ? (unsigned int) n : ring->size - offset;
+	capture_add(flytec->capture, flytec->capture_device, CAPTURE_READ, ring->buf + offset, len, ring->buf, n - len);
+    }
+}
+
+void flytec_set_capture(flytec_t *flytec, capture_t *capture)
+{
+    flytec->capture = capture;
+    if (capture)
+	flytec->capture_device = capture_device(capture, flytec->device);
+}
+
+static void flytec_command_begin(flytec_t *flytec, const char *command)
+{
+    flytec_command_end(flytec);
+    __atomic_store_n(&flytec->command_nsec, now_nsec(), __ATOMIC_RELAXED);
+    __atomic_store_n(&flytec->awaiting_first_byte, 1, __ATOMIC_RELEASE);
+    if (flytec->commandc % 64 == 0) {
+	/* the statistics are not worth failing the command for */
+	command_stats_t *commandv = tini_realloc(flytec->hooks, flytec->commandv, (flytec->commandc + 64) * sizeof(command_stats_t));
+	if (!commandv)
+	    return;
+	flytec->commandv = commandv;
+    }
+    command_stats_t *stats = flytec->commandv + flytec->commandc;
+    memset(stats, 0, sizeof(command_stats_t));
+    /* PBRSNP, and PBRTL, have an empty argument list */
+    int len = strlen(command);
+    if (len && command[len - 1] == ',')
+	--len;
+    snprintf(stats->command, sizeof stats->command, "%.*s", len, command);
+    flytec->command_open = 1;
+    flytec->command_bytes = __atomic_load_n(&flytec->bytes, __ATOMIC_RELAXED);
+    flytec->command_lines = flytec->lines;
+}
+
+/* called when the XON that ends a response arrives */
+void flytec_command_end(flytec_t *flytec)
+{
+    if (!flytec->command_open)
+	return;
+    command_stats_t *stats = flytec->commandv + flytec->commandc++;
+    stats->nsec = now_nsec() - flytec->command_nsec;
+    stats->bytes = __atomic_load_n(&flytec->bytes, __ATOMIC_RELAXED) - flytec->command_bytes;
+    stats->lines = flytec->lines - flytec->command_lines;
+    flytec->command_open = 0;
+}
+
+static void histogram_print(FILE *file, const char *name, const char *unit, const histogram_t *histogram)
+{
+    fprintf(file, "%s:\n", name);
+    int i;
+    for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+	if (!histogram->count[i])
+	    continue;
+	unsigned long min = i ? 1UL << (i - 1) : 0, max = i ? (1UL << i) - 1 : 0;
+	fprintf(file, "- %s: \"%lu-%lu\"\n", unit, min, max);
+	fprintf(file, "  count: %ld\n", histogram->count[i]);
+    }
+}
+
+static void flytec_stats_print(flytec_t *flytec, FILE *file)
 {
-    flytec_t *flytec = alloc(sizeof(flytec_t));
+    fprintf(file, "--- \n");
+    fprintf(file, "device: \"%s\"\n", flytec->device);
+    fprintf(file, "elapsed_sec: %.3f\n", (now_nsec() - flytec->open_nsec) / 1e9);
+    fprintf(file, "bytes: %ld\n", flytec->bytes);
+    fprintf(file, "lines: %ld\n", flytec->lines);
+    fprintf(file, "reads: %ld\n", flytec->reads);
+    fprintf(file, "selects: %ld\n", flytec->selects);
+    fprintf(file, "reader_io_uring: %s\n", flytec->reader_uring ? "true" : "false");
+    fprintf(file, "write_blocked_sec: %.3f\n", flytec->write_nsec / 1e9);
+    fprintf(file, "close_blocked_sec: %.3f\n", flytec->close_nsec / 1e9);
+    fprintf(file, "errors: %ld\n", flytec->errors);
+    fprintf(file, "retries: %ld\n", flytec->retries);
+    fprintf(file, "recoveries: %ld\n", flytec->recoveries);
+    fprintf(file, "abandoned: %ld\n", flytec->abandoned);
+    fprintf(file, "first_byte_timeout_ms: %d\n", flytec->first_byte.timeout_ms);
+    fprintf(file, "first_byte_delay_ms: %.3f\n", flytec->first_byte.srtt_usec / 1e3);
+    fprintf(file, "inter_byte_timeout_ms: %d\n", flytec->inter_byte.timeout_ms);
+    fprintf(file, "inter_byte_delay_ms: %.3f\n", flytec->inter_byte.srtt_usec / 1e3);
+    fprintf(file, "commands:\n");
+    int i;
+    for (i = 0; i < flytec->commandc; ++i) {
+	const command_stats_t *stats = flytec->commandv + i;
+	fprintf(file, "- command: \"%s\"\n", stats->command);
+	fprintf(file, "  wall_sec: %.3f\n", stats->nsec / 1e9);
+	fprintf(file, "  bytes: %ld\n", stats->bytes);
+	fprintf(file, "  lines: %ld\n", stats->lines);
+    }
+    histogram_print(file, "read_sizes", "bytes", &flytec->read_sizes);
+    histogram_print(file, "read_gaps", "usec", &flytec->read_gaps);
+    int uart[5];
+    if (flytec->uart_supported && uart_counters(flytec->fd, uart)) {
+	fprintf(file, "uart:\n");
+	fprintf(file, "  frame: %d\n", uart[0] - flytec->uart[0]);
+	fprintf(file, "  overrun: %d\n", uart[1] - flytec->uart[1]);
+	fprintf(file, "  parity: %d\n", uart[2] - flytec->uart[2]);
+	fprintf(file, "  break: %d\n", uart[3] - flytec->uart[3]);
+	fprintf(file, "  buffer_overrun: %d\n", uart[4] - flytec->uart[4]);
+    } else {
+	fprintf(file, "uart: ~\n");
+    }
+}
+
+
+/* returns 0 with errno set on failure */
+flytec_t *flytec_open(const char *device, FILE *logfile, const tini_hooks_t *hooks)
+{
+    flytec_t *flytec = tini_alloc(hooks, sizeof(flytec_t));
+    if (!flytec)
+	return 0;
     flytec->device = device;
-    flytec->fd = open(flytec->device, O_NOCTTY | O_NONBLOCK | O_RDWR);
-    if (flytec->fd == -1)
-	error("open: %s: %s", flytec->device, strerror(errno));
-    if (tcflush(flytec->fd, TCIOFLUSH) == -1)
-	error("tcflush: %s: %s", flytec->device, strerror(errno));
-    struct termios termios;
-    memset(&termios, 0, sizeof termios);
-    termios.c_iflag = IGNPAR;
-    termios.c_cflag = CLOCAL | CREAD | CS8;
-    cfsetispeed(&termios, B57600);
-    cfsetospeed(&termios, B57600);
-    if (tcsetattr(flytec->fd, TCSANOW, &termios) == -1)
-	error("tcsetattr: %s: %s", flytec->device, strerror(errno));
+    flytec->hooks = hooks;
+    if (transport_open(flytec, device) == -1) {
+	int _errno = errno;
+	tini_free(hooks, flytec);
+	errno = _errno;
+	return 0;
+    }
+    flytec->ring = ring_new(hooks, FLYTEC_BUFSIZE);
+    if (!flytec->ring) {
+	flytec->transport->close(flytec);
+	tini_free(hooks, flytec);
+	errno = ENOMEM;
+	return 0;
+    }
     flytec->logfile = logfile;
+    flytec->open_nsec = now_nsec();
+    pthread_mutex_init(&flytec->first_byte.lock, 0);
+    pthread_mutex_init(&flytec->inter_byte.lock, 0);
+    phase_init(&flytec->first_byte, flytec->transport->timeout_ms, flytec->transport->batch_ms);
+    phase_init(&flytec->inter_byte, flytec->transport->timeout_ms, flytec->transport->batch_ms);
+    flytec->uart_supported = uart_counters(flytec->fd, flytec->uart);
     return flytec;
 }
 
 void flytec_delete(flytec_t *flytec)
 {
     if (flytec) {
+	flytec_reader_stop(flytec);
 	snp_delete(flytec->snp);
 	if (flytec->trackv) {
 	    track_t **track;
 	    for (track = flytec->trackv; *track; ++track)
 		track_delete(*track);
-	    free(flytec->trackv);
+	    tini_free(flytec->hooks, flytec->trackv);
 	}
-	if (close(flytec->fd) == -1)
-	    DIE("close", errno);
-	free(flytec->pilot_name);
-	free(flytec);
+	flytec_command_end(flytec);
+	if (flytec->statsfile)
+	    flytec_stats_print(flytec, flytec->statsfile);
+	flytec->transport->close(flytec);
+	if (flytec->logfile)
+	    fprintf(flytec->logfile, "# %s: %ld bytes, %ld reads, %ld selects, %u bytes high water, %ld reader stalls, %ld retries, %ld abandoned\n", flytec->device, flytec->bytes, flytec->reads, flytec->selects, flytec->ring->high, flytec->reader_stalls, flytec->retries, flytec->abandoned);
+	ring_delete(flytec->ring);
+	pthread_mutex_destroy(&flytec->first_byte.lock);
+	pthread_mutex_destroy(&flytec->inter_byte.lock);
+	tini_free(flytec->hooks, flytec->commandv);
+	tini_free(flytec->hooks, flytec->pilot_name);
+	tini_free(flytec->hooks, flytec);
     }
 }
 
-static void flytec_read(flytec_t *flytec)
+/* writes error_message to the log and the capture */
+void flytec_log_error(flytec_t *flytec)
+{
+    if (flytec->logfile)
+	fprintf(flytec->logfile, "# %s: %s\n", flytec->device, flytec->error_message);
+    if (flytec->capture)
+	capture_add(flytec->capture, flytec->capture_device, CAPTURE_ERROR, flytec->error_message, strlen(flytec->error_message), 0, 0);
+}
+
+/* records an error for the caller to return, always returns -1 with errno
+ * set */
+static int flytec_fail(flytec_t *flytec, int error, const char *message, ...) __attribute__ ((format(printf, 3, 4)));
+
+static int flytec_fail(flytec_t *flytec, int error, const char *message, ...)
+{
+    va_list ap;
+    va_start(ap, message);
+    vsnprintf(flytec->error_message, sizeof flytec->error_message, message, ap);
+    va_end(ap);
+    flytec->error = error;
+    ++flytec->errors;
+    errno = error;
+    return -1;
+}
+
+/* a protocol error, which flytec_retry recovers from */
+#define flytec_error(flytec, ...) flytec_fail((flytec), EPROTO, __VA_ARGS__)
+
+/* reads whatever arrives within the timeout, returns 1 if anything did, 0
+ * on timeout and -1 with errno set on failure */
+static int flytec_wait(flytec_t *flytec)
 {
+    if (flytec->reader) {
+	/* a partial line may already be in the ring */
+	int rc = flytec_reader_wait(flytec, RING_USED(flytec->ring), flytec_timeout_ms(flytec));
+	if (rc == -1)
+	    return flytec_fail(flytec, errno, "read: %s", errno == ENODEV ? "device disconnected" : strerror(errno));
+	return rc;
+    }
     fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(flytec->fd, &readfds);
     int rc;
     do {
+	FD_ZERO(&readfds);
+	FD_SET(flytec->fd, &readfds);
+	int timeout_ms = flytec_timeout_ms(flytec);
 	struct timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 250 * 1000;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
 	rc = select(flytec->fd + 1, &readfds, 0, 0, &timeout);
+	++flytec->selects;
     } while (rc == -1 && errno == EINTR);
     if (rc == -1)
-	DIE("select", errno);
+	return flytec_fail(flytec, errno, "select: %s", strerror(errno));
     else if (rc == 0)
-	error("%s: timeout waiting for data", flytec->device);
-    else if (!FD_ISSET(flytec->fd, &readfds))
-	DIE("select", 0);
-    int n;
-    do {
-	n = read(flytec->fd, flytec->buf, sizeof flytec->buf);
-    } while (n == -1 && errno == EINTR);
+	return 0;
+    int n = flytec->transport->read(flytec);
     if (n == -1)
-	DIE("read", errno);
+	return flytec_fail(flytec, errno, "read: %s", strerror(errno));
     else if (n == 0)
-	DIE("read", 0);
-    flytec->next = flytec->buf;
-    flytec->end = flytec->buf + n;
+	return flytec_fail(flytec, ENODEV, "read: device disconnected");
+    flytec_count_read(flytec, n);
+    return 1;
+}
+
+/* returns -1 with errno set if nothing arrived within the timeout */
+static int flytec_read(flytec_t *flytec)
+{
+    int rc = flytec_wait(flytec);
+    if (rc == 0) {
+	flytec_timed_out(flytec);
+	return flytec_fail(flytec, ETIMEDOUT, "timeout waiting for data");
+    }
+    return rc == -1 ? -1 : 0;
 }
 
-int flytec_getc(flytec_t *flytec)
+/* runs command and returns 0, or ends the command and returns -1 with
+ * errno set if it failed */
+static int flytec_try(flytec_t *flytec, int (*command)(flytec_t *, void *), void *data)
 {
-    if (flytec->next == flytec->end)
-	flytec_read(flytec);
-    if (flytec->next == flytec->end)
-	return EOF;
-    return *flytec->next++;
+    if (command(flytec, data) == 0)
+	return 0;
+    flytec_command_end(flytec);
+    errno = flytec->error;
+    return -1;
+}
+
+/* discards input up to the XON that ends the current response, or until
+ * the FR has stopped sending */
+static int flytec_drain(flytec_t *flytec, void *data)
+{
+    /* the FR has gone quiet once the gap between reads is over */
+    __atomic_store_n(&flytec->awaiting_first_byte, 0, __ATOMIC_RELAXED);
+    while (1) {
+	while (!RING_EMPTY(flytec->ring)) {
+	    unsigned int len;
+	    const char *p = ring_peek(flytec->ring, &len);
+	    const char *xon = memchr(p, XON, len);
+	    ring_consume(flytec->ring, xon ? xon - p + 1 : len);
+	    if (xon)
+		return 0;
+	}
+	int rc = flytec_wait(flytec);
+	if (rc != 1)
+	    return rc;
+    }
+}
+
+/* runs command until it returns 0, resynchronising with the FR and backing
+ * off after each timeout or protocol error.  reset, if not null, undoes the
+ * effects of a failed attempt.  Other errors, such as the device going
+ * away, are not retried.  Returns -1 with errno set if the command was
+ * abandoned. */
+int flytec_retry(flytec_t *flytec, int (*command)(flytec_t *, void *), void (*reset)(flytec_t *, void *), void *data)
+{
+    int attempt;
+    for (attempt = 0; ; ++attempt) {
+	if (command(flytec, data) == 0) {
+	    if (attempt)
+		++flytec->recoveries;
+	    return 0;
+	}
+	if (reset)
+	    reset(flytec, data);
+	flytec_log_error(flytec);
+	if (flytec->error != ETIMEDOUT && flytec->error != EPROTO)
+	    break;
+	char error_message[sizeof flytec->error_message];
+	memcpy(error_message, flytec->error_message, sizeof error_message);
+	if (flytec_try(flytec, flytec_drain, 0) == -1)
+	    break;
+	memcpy(flytec->error_message, error_message, sizeof error_message);
+	if (attempt == FLYTEC_RETRIES)
+	    break;
+	tini_log(flytec->hooks, flytec->device, "%s, retrying", flytec->error_message);
+	int ms = FLYTEC_BACKOFF_MS << attempt;
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+	    ;
+	++flytec->retries;
+    }
+    ++flytec->abandoned;
+    errno = flytec->error;
+    return -1;
+}
+
+/* stores the next character in c, returns -1 with errno set on failure */
+static int flytec_getc(flytec_t *flytec, char *c)
+{
+    if (RING_EMPTY(flytec->ring) && flytec_read(flytec) == -1)
+	return -1;
+    unsigned int len;
+    const char *p = ring_peek(flytec->ring, &len);
+    *c = *p;
+    ring_consume(flytec->ring, 1);
+    return 0;
 }
 
-void flytec_expectc(flytec_t *flytec, char c)
+static int flytec_expectc(flytec_t *flytec, char c)
 {
-    if (flytec_getc(flytec) != c)
-	error("%s: unexpected character", flytec->device);
+    char got;
+    if (flytec_getc(flytec, &got) == -1)
+	return -1;
+    if (got != c)
+	return flytec_error(flytec, "unexpected character");
+    if (c == XON)
+	flytec_command_end(flytec);
+    return 0;
 }
 
-void flytec_puts_nmea(flytec_t *flytec, char *s)
+/* formats s as an NMEA sentence followed by a NUL and logs it as sent,
+ * returns its length or -1 with errno set if it does not fit in size */
+int flytec_format_nmea(flytec_t *flytec, const char *s, char *buf, int size)
 {
     int checksum = 0;
-    char *p;
+    const char *p;
     for (p = s; *p; ++p)
 	checksum ^= (unsigned char) *p;
     int len = strlen(s) + 7;
-    char *buf = alloc(len);
+    if (len > size) {
+	errno = EINVAL;
+	return -1;
+    }
     if (snprintf(buf, len, "$%s*%02X\r\n", s, checksum) != len - 1)
-	DIE("snprintf", 0);
+	TINI_ABORT("snprintf", 0);
     if (flytec->logfile)
 	fprintf(flytec->logfile, "> %s", buf);
-    int rc;
-    do {
-	rc = write(flytec->fd, buf, len);
-    } while (rc == -1 && errno == EINTR);
-    if (rc == -1)
-	DIE("write", errno);
-    free(buf);
+    if (flytec->capture)
+	capture_add(flytec->capture, flytec->capture_device, CAPTURE_WRITE, buf, len, 0, 0);
+    flytec_command_begin(flytec, s);
+    return len;
 }
 
-char *flytec_gets(flytec_t *flytec, char *buf, int size)
+/* returns -1 with errno set if the command could not be sent */
+int flytec_puts_nmea(flytec_t *flytec, const char *s)
 {
-    if (flytec->next == flytec->end)
-	flytec_read(flytec);
-    if (*flytec->next == XON)
+    char buf[FLYTEC_LINE_MAX];
+    int len = flytec_format_nmea(flytec, s, buf, sizeof buf);
+    if (len == -1)
+	return -1;
+    return flytec->transport->write(flytec, buf, len) == -1 ? -1 : 0;
+}
+
+static int flytec_command(flytec_t *flytec, const char *s)
+{
+    if (flytec_puts_nmea(flytec, s) == -1)
+	return flytec_fail(flytec, errno, "write: %s", strerror(errno));
+    return flytec_expectc(flytec, XOFF);
+}
+
+/* reads a line into buf, returns 1, 0 at the XON that ends the response
+ * or -1 with errno set on failure */
+static int flytec_gets(flytec_t *flytec, char *buf, int size)
+{
+    if (RING_EMPTY(flytec->ring) && flytec_read(flytec) == -1)
+	return -1;
+    unsigned int len;
+    const char *p = ring_peek(flytec->ring, &len);
+    if (*p == XON)
 	return 0;
-    int len = size;
-    char *p = buf;
+    int n = 0;
     while (1) {
-	if (--len <= 0)
-	    DIE(__FUNCTION__, 0);
-	if ((*p++ = *flytec->next++) == '\n') {
-	    *p = '\0';
+	const char *eol = memchr(p, '\n', len);
+	if (eol)
+	    len = eol - p + 1;
+	if (n + (int) len >= size)
+	    return flytec_error(flytec, "line too long");
+	memcpy(buf + n, p, len);
+	n += len;
+	ring_consume(flytec->ring, len);
+	if (eol) {
+	    buf[n] = '\0';
+	    ++flytec->lines;
 	    if (flytec->logfile)
 		fprintf(flytec->logfile, "< %s", buf);
-	    return buf;
+	    return 1;
 	}
-	if (flytec->next == flytec->end)
-	    flytec_read(flytec);
+	if (RING_EMPTY(flytec->ring) && flytec_read(flytec) == -1)
+	    return -1;
+	p = ring_peek(flytec->ring, &len);
     }
 }
 
-char *flytec_gets_nmea(flytec_t *flytec, char *buf, int size)
+int nmea_decode(char *buf)
 {
-    buf = flytec_gets(flytec, buf, size);
-    if (!buf)
-	return 0;
     int len = strlen(buf);
     if (len < 6)
-	goto _error;
+	return 0;
     if (buf[0] != '$' || buf[len - 5] != '*' || buf[len - 2] != '\r' || buf[len - 1] != '\n')
-	goto _error;
+	return 0;
     int checksum = 0;
     char *p;
     for (p = buf + 1; p != buf + len - 5; ++p)
@@ -177,50 +622,211 @@ char *flytec_gets_nmea(flytec_t *flytec, char *buf, int size)
     else if ('A' <= xdigit && xdigit <= 'F')
 	result = (xdigit - 'A' + 0xa) << 4;
     else
-	goto _error;
+	return 0;
     xdigit = buf[len - 3];
     if ('0' <= xdigit && xdigit <= '9')
 	result += xdigit - '0';
     else if ('A' <= xdigit && xdigit <= 'F')
 	result += xdigit - 'A' + 0xa;
     else
-	goto _error;
+	return 0;
     if (checksum != result)
-	goto _error;
+	return 0;
     memmove(buf, buf + 1, len - 5);
     buf[len - 6] = '\0';
-    return buf;
-_error:
-    error("%s: invalid NMEA response", flytec->device);
+    return 1;
+}
+
+static int flytec_gets_nmea(flytec_t *flytec, char *buf, int size)
+{
+    int rc = flytec_gets(flytec, buf, size);
+    if (rc == 1 && !nmea_decode(buf))
+	return flytec_error(flytec, "invalid NMEA response");
+    return rc;
+}
+
+static const char *last_eol(const char *p, unsigned int len)
+{
+    const char *q;
+    for (q = p + len; q != p; --q)
+	if (q[-1] == '\n')
+	    return q - 1;
+    return 0;
+}
+
+/* deliver runs of complete lines straight from the ring buffer, only a
+ * line that wraps around the end of the ring is copied */
+static int flytec_lines(flytec_t *flytec, void (*callback)(void *, const char *, int), void *data)
+{
+    while (1) {
+	if (RING_EMPTY(flytec->ring) && flytec_read(flytec) == -1)
+	    return -1;
+	unsigned int len;
+	const char *p = ring_peek(flytec->ring, &len);
+	if (*p == XON)
+	    return 0;
+	const char *eol = last_eol(p, len);
+	if (eol) {
+	    len = eol - p + 1;
+	    const char *line;
+	    for (line = p; (line = memchr(line, '\n', p + len - line)); ++line)
+		++flytec->lines;
+	    if (flytec->logfile) {
+		const char *line = p;
+		while (line != p + len) {
+		    const char *next = (const char *) memchr(line, '\n', p + len - line) + 1;
+		    fprintf(flytec->logfile, "< %.*s", (int) (next - line), line);
+		    line = next;
+		}
+	    }
+	    callback(data, p, len);
+	    ring_consume(flytec->ring, len);
+	} else if (len < RING_USED(flytec->ring)) {
+	    char line[FLYTEC_LINE_MAX];
+	    if (flytec_gets(flytec, line, sizeof line) == -1)
+		return -1;
+	    callback(data, line, strlen(line));
+	} else if (len == flytec->ring->size) {
+	    return flytec_error(flytec, "line too long");
+	} else if (flytec_read(flytec) == -1) {
+	    return -1;
+	}
+    }
+}
+
+typedef struct {
+    flytec_t *flytec;
+    void (*callback)(void *, const char *);
+    void *data;
+    /* set once a line could not be delivered, the rest are dropped */
+    int failed;
+} flytec_lines_data_t;
+
+/* the batch is followed by at least one writable byte, either the next
+ * line, free space in the ring or its slack byte, so each line can be NUL
+ * terminated in place.  Once a reader thread shares the ring that free
+ * space is the reader's, so each line is copied instead. */
+static void flytec_lines_callback(void *data, const char *buf, int len)
+{
+    flytec_lines_data_t *lines_data = data;
+    int shared = lines_data->flytec->ring->shared;
+    char *line = (char *) buf;
+    char *end = line + len;
+    while (line != end && !lines_data->failed) {
+	char *next = (char *) memchr(line, '\n', end - line) + 1;
+	if (shared) {
+	    char copy[FLYTEC_LINE_MAX];
+	    if (next - line >= (int) sizeof copy) {
+		flytec_error(lines_data->flytec, "line too long");
+		lines_data->failed = 1;
+		break;
+	    }
+	    memcpy(copy, line, next - line);
+	    copy[next - line] = '\0';
+	    lines_data->callback(lines_data->data, copy);
+	} else {
+	    char c = *next;
+	    *next = '\0';
+	    lines_data->callback(lines_data->data, line);
+	    *next = c;
+	}
+	line = next;
+    }
+}
+
+typedef struct {
+    const char *command;
+    void (*callback)(void *, const char *, int);
+    void *data;
+} flytec_lines_command_t;
+
+static int lines_command(flytec_t *flytec, void *data)
+{
+    flytec_lines_command_t *lines_command = data;
+    if (flytec_command(flytec, lines_command->command) == -1)
+	return -1;
+    if (flytec_lines(flytec, lines_command->callback, lines_command->data) == -1)
+	return -1;
+    return flytec_expectc(flytec, XON);
+}
+
+/* returns the result of a flytec_lines_callback command, -1 with errno set
+ * if a line could not be delivered */
+static int lines_result(flytec_lines_data_t *lines_data, int rc)
+{
+    if (rc == 0 && lines_data->failed) {
+	errno = lines_data->flytec->error;
+	return -1;
+    }
+    return rc;
+}
+
+/* returns -1 with errno set on failure */
+int flytec_pbrigc_lines(flytec_t *flytec, void (*callback)(void *, const char *, int), void *data)
+{
+    flytec_lines_command_t lines_command_data = { "PBRIGC,", callback, data };
+    return flytec_try(flytec, lines_command, &lines_command_data);
 }
 
-void flytec_pbrigc(flytec_t *flytec, void (*callback)(void *, const char *), void *data)
+int flytec_pbrigc(flytec_t *flytec, void (*callback)(void *, const char *), void *data)
 {
-    flytec_puts_nmea(flytec, "PBRIGC,");
-    flytec_expectc(flytec, XOFF);
+    flytec_lines_data_t lines_data = { flytec, callback, data, 0 };
+    return lines_result(&lines_data, flytec_pbrigc_lines(flytec, flytec_lines_callback, &lines_data));
+}
+
+static int pbrsnp_command(flytec_t *flytec, void *data)
+{
+    snp_t **snp = data;
+    if (flytec_command(flytec, "PBRSNP,") == -1)
+	return -1;
     char line[128];
-    while (flytec_gets(flytec, line, sizeof line))
-	callback(data, line);
-    flytec_expectc(flytec, XON);
+    int rc = flytec_gets_nmea(flytec, line, sizeof line);
+    if (rc == -1)
+	return -1;
+    else if (rc == 0)
+	return flytec_error(flytec, "empty response");
+    *snp = snp_new(flytec->hooks, line);
+    if (!*snp && errno == ENOMEM)
+	return flytec_fail(flytec, ENOMEM, "out of memory");
+    else if (!*snp)
+	return flytec_error(flytec, "invalid response");
+    return flytec_expectc(flytec, XON);
 }
 
+static int pbrsnp(flytec_t *flytec, void *data)
+{
+    return flytec_try(flytec, pbrsnp_command, data);
+}
+
+static void pbrsnp_reset(flytec_t *flytec, void *data)
+{
+    snp_t **snp = data;
+    snp_delete(*snp);
+    *snp = 0;
+}
+
+/* returns 0 with errno set on failure */
 snp_t *flytec_pbrsnp(flytec_t *flytec)
 {
     if (flytec->snp)
 	return flytec->snp;
-    flytec_puts_nmea(flytec, "PBRSNP,");
-    flytec_expectc(flytec, XOFF);
-    char line[128];
-    if (!flytec_gets_nmea(flytec, line, sizeof line))
-	DIE("flytec_gets_nmea", 0);
-    flytec->snp = snp_new(line);
-    if (!flytec->snp)
-	error("%s: invalid response", flytec->device);
-    flytec_expectc(flytec, XON);
-    /* determine manufacturer from instrument id */
-    flytec->manufacturer = manufacturer_new(flytec->snp->instrument_id);
+    snp_t *snp = 0;
+    if (flytec_retry(flytec, pbrsnp, pbrsnp_reset, &snp) == -1)
+	return 0;
+    if (flytec_set_snp(flytec, snp) == -1) {
+	snp_delete(snp);
+	snprintf(flytec->error_message, sizeof flytec->error_message, "out of memory");
+	errno = ENOMEM;
+	return 0;
+    }
+    return flytec->snp;
+}
+
+/* returns -1 with errno set if out of memory */
+int flytec_set_snp(flytec_t *flytec, snp_t *snp)
+{
     /* strip leading and trailing spaces from pilot name */
-    char *pilot_name = flytec->snp->pilot_name;
+    char *pilot_name = snp->pilot_name;
     while (*pilot_name == ' ')
 	++pilot_name;
     char *pilot_name_end = pilot_name + 1;
@@ -228,38 +834,121 @@ snp_t *flytec_pbrsnp(flytec_t *flytec)
     for (p = pilot_name; *p; ++p)
 	if (*p != ' ')
 	    pilot_name_end = p + 1;
-    flytec->pilot_name = alloc(pilot_name_end - pilot_name + 1);
-    memcpy(flytec->pilot_name, pilot_name, pilot_name_end - pilot_name);
-    flytec->pilot_name[pilot_name_end - pilot_name] = '\0';
-    flytec->serial_number = flytec->snp->serial_number;
-    return flytec->snp;
+    flytec->pilot_name = tini_strndup(flytec->hooks, pilot_name, pilot_name_end - pilot_name);
+    if (!flytec->pilot_name)
+	return -1;
+    flytec->snp = snp;
+    /* determine manufacturer from instrument id */
+    flytec->manufacturer = manufacturer_new(snp->instrument_id);
+    flytec->serial_number = snp->serial_number;
+    /* a slow network connection is slower than any FR */
+    const flytec_timing_t *timing = flytec_timing_find(snp->instrument_id);
+    const transport_t *transport = flytec->transport;
+    phase_init(&flytec->first_byte, timing->first_byte_ms > transport->timeout_ms ? timing->first_byte_ms : transport->timeout_ms, transport->batch_ms);
+    phase_init(&flytec->inter_byte, timing->inter_byte_ms > transport->timeout_ms ? timing->inter_byte_ms : transport->timeout_ms, transport->batch_ms);
+    return 0;
+}
+
+static int pbrtl_command(flytec_t *flytec, void *data)
+{
+    if (flytec_command(flytec, "PBRTL,") == -1)
+	return -1;
+    char line[128];
+    int rc;
+    while ((rc = flytec_gets_nmea(flytec, line, sizeof line)) == 1) {
+	int added = flytec_add_track(flytec, line);
+	if (added == -1 && errno == ENOMEM)
+	    return flytec_fail(flytec, ENOMEM, "out of memory");
+	else if (added == -1)
+	    return flytec_error(flytec, "invalid response");
+	else if (added == 0)
+	    return flytec_error(flytec, "inconsistent data");
+    }
+    if (rc == -1)
+	return -1;
+    return flytec_expectc(flytec, XON);
+}
+
+static int pbrtl(flytec_t *flytec, void *data)
+{
+    return flytec_try(flytec, pbrtl_command, data);
+}
+
+static void pbrtl_reset(flytec_t *flytec, void *data)
+{
+    flytec_clear_tracks(flytec);
+}
+
+/* forgets the tracklogs of an earlier PBRTL */
+void flytec_clear_tracks(flytec_t *flytec)
+{
+    if (flytec->trackv) {
+	int i;
+	for (i = 0; i < flytec->trackc; ++i)
+	    track_delete(flytec->trackv[i]);
+	tini_free(flytec->hooks, flytec->trackv);
+    }
+    flytec->trackv = 0;
+    flytec->trackc = 0;
+    flytec->trackc_received = 0;
 }
 
+/* returns 0 with errno set on failure */
 track_t **flytec_pbrtl(flytec_t *flytec, const char *manufacturer, igc_filename_format_t filename_format)
 {
     if (flytec->trackv)
 	return flytec->trackv;
-    manufacturer = manufacturer ? manufacturer : flytec->manufacturer;
-    flytec_pbrsnp(flytec);
-    flytec_puts_nmea(flytec, "PBRTL,");
-    flytec_expectc(flytec, XOFF);
-    char line[128];
-    int index = 0;
-    while (flytec_gets_nmea(flytec, line, sizeof line)) {
-	track_t *track = track_new(line);
-	if (!track)
-	    error("%s: invalid response", flytec->device);
-	if (track->index != index++)
-	    error("%s: inconsistent data", flytec->device);
-	if (flytec->trackv) {
-	    if (track->count != flytec->trackc)
-		error("%s: inconsistent data", flytec->device);
-	} else {
-	    flytec->trackc = track->count;
-	    flytec->trackv = alloc((flytec->trackc + 1) * sizeof(track_t *));
+    if (!flytec_pbrsnp(flytec))
+	return 0;
+    if (flytec_retry(flytec, pbrtl, pbrtl_reset, 0) == -1)
+	return 0;
+    if (flytec_set_igc_filenames(flytec, manufacturer, filename_format) == -1) {
+	flytec_clear_tracks(flytec);
+	snprintf(flytec->error_message, sizeof flytec->error_message, "out of memory");
+	errno = ENOMEM;
+	return 0;
+    }
+    return flytec->trackv;
+}
+
+/* returns 1 if the line was added, 0 if it is inconsistent with the
+ * previous lines and -1 with errno set if it is invalid or out of memory */
+int flytec_add_track(flytec_t *flytec, const char *line)
+{
+    track_t *track = track_new(flytec->hooks, line);
+    if (!track)
+	return -1;
+    if (track->index != (flytec->trackv ? flytec->trackc_received : 0)) {
+	track_delete(track);
+	return 0;
+    }
+    if (flytec->trackv) {
+	if (track->count != flytec->trackc) {
+	    track_delete(track);
+	    return 0;
 	}
-	flytec->trackv[track->index] = track;
+    } else {
+	flytec->trackv = tini_alloc(flytec->hooks, (track->count + 1) * sizeof(track_t *));
+	if (!flytec->trackv) {
+	    track_delete(track);
+	    errno = ENOMEM;
+	    return -1;
+	}
+	flytec->trackc = track->count;
+    }
+    if (track->index >= flytec->trackc) {
+	track_delete(track);
+	return 0;
     }
+    flytec->trackv[track->index] = track;
+    ++flytec->trackc_received;
+    return 1;
+}
+
+/* returns -1 with errno set if out of memory */
+int flytec_set_igc_filenames(flytec_t *flytec, const char *manufacturer, igc_filename_format_t filename_format)
+{
+    manufacturer = manufacturer ? manufacturer : flytec->manufacturer;
     if (flytec->trackc) {
 	/* calculate daily flight indexes */
 	int i;
@@ -271,46 +960,62 @@ track_t **flytec_pbrtl(flytec_t *flytec, const char *manufacturer, igc_filename_
 		flytec->trackv[i]->day_index = 1;
 	}
 	/* calculate igc filenames */
-	for (i = 0; i < flytec->trackc; ++i) {
-	    track_t *track = flytec->trackv[i];
-	    char serial_number[4];
-	    int rc;
-	    switch (filename_format) {
-		case igc_filename_format_long:
-		    track->igc_filename = alloc(128);
-		    rc = snprintf(track->igc_filename, 128, "%04d-%02d-%02d-%s-%d-%02d.IGC", DATE_YEAR(track->date) + 1900, DATE_MON(track->date) + 1, DATE_MDAY(track->date), manufacturer, flytec->serial_number, track->day_index);
-		    if (rc < 0 || rc > 128)
-			error("snprintf");
-		    break;
-		case igc_filename_format_short:
-		    track->igc_filename = alloc(16);
-		    serial_number[0] = base36[flytec->serial_number % 36];
-		    serial_number[1] = base36[(flytec->serial_number / 36) % 36];
-		    serial_number[2] = base36[(flytec->serial_number / 36 / 36) % 36];
-		    serial_number[3] = '\0';
-		    rc = snprintf(track->igc_filename, 16, "%c%c%c%c%s%c.IGC", base36[DATE_YEAR(track->date) % 10], base36[DATE_MON(track->date) + 1], base36[DATE_MDAY(track->date)], manufacturer[0], serial_number, base36[track->day_index]);
-		    if (rc < 0 || rc > 16)
-			error("snprintf");
-		    break;
-	    }
-	}
-
+	for (i = 0; i < flytec->trackc; ++i)
+	    if (track_set_igc_filename(flytec->trackv[i], manufacturer, flytec->serial_number, filename_format) == -1)
+		return -1;
     } else {
-	flytec->trackv = alloc(sizeof(track_t *));
+	flytec->trackv = tini_alloc(flytec->hooks, sizeof(track_t *));
+	if (!flytec->trackv)
+	    return -1;
     }
-    flytec_expectc(flytec, XON);
-    return flytec->trackv;
+    return 0;
 }
 
-void flytec_pbrtr(flytec_t *flytec, track_t *track, void (*callback)(void *, const char *), void *data)
+/* returns -1 with errno set if out of memory */
+int track_set_igc_filename(track_t *track, const char *manufacturer, int serial_number, igc_filename_format_t filename_format)
+{
+    char serial[4];
+    char *igc_filename = 0;
+    int rc;
+    switch (filename_format) {
+	case igc_filename_format_long:
+	    igc_filename = tini_alloc(track->hooks, 128);
+	    if (!igc_filename)
+		return -1;
+	    rc = snprintf(igc_filename, 128, "%04d-%02d-%02d-%s-%d-%02d.IGC", DATE_YEAR(track->date) + 1900, DATE_MON(track->date) + 1, DATE_MDAY(track->date), manufacturer, serial_number, track->day_index);
+	    if (rc < 0 || rc > 128)
+		TINI_ABORT("snprintf", 0);
+	    break;
+	case igc_filename_format_short:
+	    igc_filename = tini_alloc(track->hooks, 16);
+	    if (!igc_filename)
+		return -1;
+	    serial[0] = base36[serial_number % 36];
+	    serial[1] = base36[(serial_number / 36) % 36];
+	    serial[2] = base36[(serial_number / 36 / 36) % 36];
+	    serial[3] = '\0';
+	    rc = snprintf(igc_filename, 16, "%c%c%c%c%s%c.IGC", base36[DATE_YEAR(track->date) % 10], base36[DATE_MON(track->date) + 1], base36[DATE_MDAY(track->date)], manufacturer[0], serial, base36[track->day_index]);
+	    if (rc < 0 || rc > 16)
+		TINI_ABORT("snprintf", 0);
+	    break;
+    }
+    tini_free(track->hooks, track->igc_filename);
+    track->igc_filename = igc_filename;
+    return 0;
+}
+
+/* returns -1 with errno set on failure */
+int flytec_pbrtr_lines(flytec_t *flytec, track_t *track, void (*callback)(void *, const char *, int), void *data)
 {
     char buf[9];
     if (snprintf(buf, sizeof buf, "PBRTR,%02d", track->index) != 8)
-	DIE("sprintf", 0);
-    flytec_puts_nmea(flytec, buf);
-    flytec_expectc(flytec, XOFF);
-    char line[1024];
-    while (flytec_gets(flytec, line, sizeof line))
-	callback(data, line);
-    flytec_expectc(flytec, XON);
+	TINI_ABORT("snprintf", 0);
+    flytec_lines_command_t lines_command_data = { buf, callback, data };
+    return flytec_try(flytec, lines_command, &lines_command_data);
+}
+
+int flytec_pbrtr(flytec_t *flytec, track_t *track, void (*callback)(void *, const char *), void *data)
+{
+    flytec_lines_data_t lines_data = { flytec, callback, data, 0 };
+    return lines_result(&lines_data, flytec_pbrtr_lines(flytec, track, flytec_lines_callback, &lines_data));
 }
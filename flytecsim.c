@@ -0,0 +1,601 @@
+/*
+
+   flytecsim - simulate a Flytec or Brauniger flight recorder on a pty
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "tini.h"
+
+/* 57600 baud, 8 data bits, no parity, 1 stop bit */
+#define BYTES_PER_SEC (57600 / 10)
+
+const char *program_name = 0;
+
+void error(const char *message, ...)
+{
+    fprintf(stderr, "%s: ", program_name);
+    va_list ap;
+    va_start(ap, message);
+    vfprintf(stderr, message, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+void die(const char *file, int line, const char *function, const char *message, int _errno)
+{
+    if (_errno)
+	error("%s:%d: %s: %s: %s", file, line, function, message, strerror(_errno));
+    else
+	error("%s:%d: %s: %s", file, line, function, message);
+}
+
+void *alloc(int size)
+{
+    void *p = malloc(size);
+    if (!p)
+	DIE("malloc", errno);
+    memset(p, 0, size);
+    return p;
+}
+
+typedef struct {
+    int status;
+    long user_usec;
+    long system_usec;
+    long syscalls;
+} report_t;
+
+typedef struct {
+    const char *instrument_id;
+    const char *pilot_name;
+    int serial_number;
+    const char *software_version;
+    int trackc;
+    int records;
+    int throttle;
+    int faults;
+    int responses;
+    int master;
+    char in[256];
+    int in_len;
+    char *out;
+    int out_size;
+    int out_start;
+    int out_end;
+    struct timespec throttle_time;
+    long throttle_sent;
+    long bytes;
+    long lines;
+} sim_t;
+
+static double timespec_sub(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void sim_write(sim_t *sim, const char *buf, int len)
+{
+    if (sim->out_start == sim->out_end) {
+	sim->out_start = sim->out_end = 0;
+	if (clock_gettime(CLOCK_MONOTONIC, &sim->throttle_time) == -1)
+	    DIE("clock_gettime", errno);
+	sim->throttle_sent = 0;
+    }
+    if (sim->out_end + len > sim->out_size) {
+	int size = sim->out_size ? sim->out_size : 4096;
+	while (size < sim->out_end + len)
+	    size *= 2;
+	char *out = realloc(sim->out, size);
+	if (!out)
+	    DIE("realloc", errno);
+	sim->out = out;
+	sim->out_size = size;
+    }
+    memcpy(sim->out + sim->out_end, buf, len);
+    sim->out_end += len;
+    int i;
+    for (i = 0; i < len; ++i)
+	if (buf[i] == '\n')
+	    ++sim->lines;
+}
+
+static void sim_putc(sim_t *sim, char c)
+{
+    sim_write(sim, &c, 1);
+}
+
+static void sim_printf(sim_t *sim, const char *format, ...) __attribute__ ((format(printf, 2, 3)));
+
+static void sim_printf(sim_t *sim, const char *format, ...)
+{
+    char buf[128];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(buf, sizeof buf, format, ap);
+    va_end(ap);
+    if (len < 0 || len >= (int) sizeof buf)
+	DIE("vsnprintf", 0);
+    sim_write(sim, buf, len);
+}
+
+static void sim_puts_nmea(sim_t *sim, const char *s)
+{
+    int checksum = 0;
+    const char *p;
+    for (p = s; *p; ++p)
+	checksum ^= (unsigned char) *p;
+    sim_printf(sim, "$%s*%02X\r\n", s, checksum);
+}
+
+static time_t sim_track_time(sim_t *sim, int index)
+{
+    /* tracks are listed most recent first, two flights per day */
+    struct tm tm;
+    memset(&tm, 0, sizeof tm);
+    tm.tm_year = 2008 - 1900;
+    tm.tm_mon = 4;
+    tm.tm_mday = 31;
+    tm.tm_hour = index % 2 ? 10 : 14;
+    time_t time = mktime(&tm);
+    if (time == (time_t) -1)
+	DIE("mktime", errno);
+    return time - 24 * 60 * 60 * (index / 2);
+}
+
+static void sim_pbrsnp(sim_t *sim)
+{
+    char buf[128];
+    if (snprintf(buf, sizeof buf, "PBRSNP,%s,%s,%d,%s", sim->instrument_id, sim->pilot_name, sim->serial_number, sim->software_version) >= (int) sizeof buf)
+	error("instrument identification too long");
+    sim_putc(sim, XOFF);
+    sim_puts_nmea(sim, buf);
+    sim_putc(sim, XON);
+}
+
+static void sim_pbrtl(sim_t *sim)
+{
+    sim_putc(sim, XOFF);
+    int i;
+    for (i = 0; i < sim->trackc; ++i) {
+	time_t time = sim_track_time(sim, i);
+	struct tm tm;
+	gmtime_r(&time, &tm);
+	int duration = sim->records ? sim->records - 1 : 0;
+	char buf[64];
+	snprintf(buf, sizeof buf, "PBRTL,%02d,%02d,%02d.%02d.%02d,%02d:%02d:%02d,%02d:%02d:%02d", sim->trackc, i, tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100, tm.tm_hour, tm.tm_min, tm.tm_sec, duration / 3600, (duration / 60) % 60, duration % 60);
+	sim_puts_nmea(sim, buf);
+    }
+    sim_putc(sim, XON);
+}
+
+static void sim_igc(sim_t *sim, int index)
+{
+    sim_putc(sim, XOFF);
+    if (0 <= index && index < sim->trackc) {
+	time_t time = sim_track_time(sim, index);
+	struct tm tm;
+	gmtime_r(&time, &tm);
+	sim_printf(sim, "AXSM%03d FLYTECSIM\r\n", sim->serial_number % 1000);
+	sim_printf(sim, "HFDTE%02d%02d%02d\r\n", tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+	sim_printf(sim, "HFPLTPILOT:%s\r\n", sim->pilot_name);
+	sim_printf(sim, "HFGTYGLIDERTYPE:\r\n");
+	sim_printf(sim, "HFGIDGLIDERID:\r\n");
+	sim_printf(sim, "HFDTM100GPSDATUM:WGS-1984\r\n");
+	sim_printf(sim, "HFRFWFIRMWAREVERSION:%s\r\n", sim->software_version);
+	sim_printf(sim, "HFFTYFRTYPE:%s\r\n", sim->instrument_id);
+	/* deterministic random walk, positions in thousandths of a minute */
+	unsigned int seed = 2008 + index;
+	int lat = 46 * 60000 + 30000, lon = 7 * 60000 + 45000, alt = 1500;
+	int sec = 60 * (60 * tm.tm_hour + tm.tm_min) + tm.tm_sec;
+	int i;
+	for (i = 0; i < sim->records; ++i) {
+	    int t = (sec + i) % (24 * 60 * 60);
+	    seed = 1103515245 * seed + 12345;
+	    lat += (int) ((seed >> 16) % 21) - 10;
+	    seed = 1103515245 * seed + 12345;
+	    lon += (int) ((seed >> 16) % 21) - 10;
+	    seed = 1103515245 * seed + 12345;
+	    alt += (int) ((seed >> 16) % 7) - 3;
+	    if (alt < 0)
+		alt = 0;
+	    sim_printf(sim, "B%02d%02d%02d%02d%05dN%03d%05dEA%05d%05d\r\n", t / 3600, (t / 60) % 60, t % 60, lat / 60000, lat % 60000, lon / 60000, lon % 60000, alt, alt + 50);
+	}
+	sim_printf(sim, "G%08X%08X\r\n", seed, seed ^ 0x5a5a5a5a);
+    }
+    sim_putc(sim, XON);
+}
+
+static void sim_request(sim_t *sim, const char *line, int len)
+{
+    if (len < 6 || line[0] != '$' || line[len - 5] != '*' || line[len - 2] != '\r')
+	return;
+    int checksum = 0;
+    const char *p;
+    for (p = line + 1; p != line + len - 5; ++p)
+	checksum ^= (unsigned char) *p;
+    char xdigits[3];
+    snprintf(xdigits, sizeof xdigits, "%02X", checksum);
+    if (line[len - 4] != xdigits[0] || line[len - 3] != xdigits[1])
+	return;
+    char request[64];
+    int request_len = len - 6 < (int) sizeof request - 1 ? len - 6 : (int) sizeof request - 1;
+    memcpy(request, line + 1, request_len);
+    request[request_len] = '\0';
+    int index;
+    int start = sim->out_end;
+    if (!strcmp(request, "PBRSNP,"))
+	sim_pbrsnp(sim);
+    else if (!strcmp(request, "PBRTL,"))
+	sim_pbrtl(sim);
+    else if (sscanf(request, "PBRTR,%d", &index) == 1)
+	sim_igc(sim, index);
+    else if (!strcmp(request, "PBRIGC,"))
+	sim_igc(sim, 0);
+    else
+	return;
+    /* a dropout cuts the response off half way, before its XON */
+    if (sim->faults && ++sim->responses % sim->faults == 0)
+	sim->out_end = start + (sim->out_end - start) / 2;
+}
+
+static void sim_read(sim_t *sim)
+{
+    char buf[256];
+    int n = read(sim->master, buf, sizeof buf);
+    if (n == -1) {
+	if (errno == EINTR || errno == EAGAIN || errno == EIO)
+	    return;
+	DIE("read", errno);
+    }
+    int i;
+    for (i = 0; i < n; ++i) {
+	/* tini sends a trailing NUL after each request, resynchronize on $ */
+	if (buf[i] == '$' || sim->in_len == sizeof sim->in)
+	    sim->in_len = 0;
+	sim->in[sim->in_len++] = buf[i];
+	if (buf[i] == '\n') {
+	    sim_request(sim, sim->in, sim->in_len);
+	    sim->in_len = 0;
+	}
+    }
+}
+
+/* returns the number of milliseconds until more output is allowed */
+static int sim_flush(sim_t *sim)
+{
+    int len = sim->out_end - sim->out_start;
+    if (sim->throttle) {
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+	    DIE("clock_gettime", errno);
+	long allowed = (long) (timespec_sub(&now, &sim->throttle_time) * BYTES_PER_SEC) - sim->throttle_sent;
+	if (allowed <= 0)
+	    return 1 + 1000 / BYTES_PER_SEC;
+	if (len > allowed)
+	    len = allowed;
+    }
+    int n = write(sim->master, sim->out + sim->out_start, len);
+    if (n == -1) {
+	if (errno == EINTR || errno == EAGAIN || errno == EIO)
+	    return 0;
+	DIE("write", errno);
+    }
+    sim->out_start += n;
+    sim->throttle_sent += n;
+    sim->bytes += n;
+    return 0;
+}
+
+static int sim_run(sim_t *sim, int report_fd, report_t *report)
+{
+    while (1) {
+	struct pollfd pollfds[2];
+	int nfds = 0;
+	pollfds[nfds].fd = sim->master;
+	pollfds[nfds].events = POLLIN;
+	int timeout = -1;
+	if (sim->out_start != sim->out_end) {
+	    timeout = sim_flush(sim);
+	    if (timeout == 0 && sim->out_start != sim->out_end)
+		pollfds[nfds].events |= POLLOUT;
+	    else if (timeout == 0)
+		timeout = -1;
+	}
+	++nfds;
+	if (report_fd != -1) {
+	    pollfds[nfds].fd = report_fd;
+	    pollfds[nfds].events = POLLIN;
+	    ++nfds;
+	}
+	int rc = poll(pollfds, nfds, timeout);
+	if (rc == -1) {
+	    if (errno == EINTR)
+		continue;
+	    DIE("poll", errno);
+	}
+	if (pollfds[0].revents & POLLIN)
+	    sim_read(sim);
+	if (report_fd != -1 && pollfds[1].revents) {
+	    int n = read(report_fd, report, sizeof *report);
+	    if (n != sizeof *report)
+		error("%s: benchmark failed", program_name);
+	    return 0;
+	}
+    }
+}
+
+static void bench_child(char *argv[], int fds[], int nfds)
+{
+    int i;
+    for (i = 0; i < nfds; ++i)
+	close(fds[i]);
+    /* tracing is best effort, the command still runs if it is not permitted */
+    ptrace(PTRACE_TRACEME, 0, 0, 0);
+    raise(SIGSTOP);
+    execvp(argv[0], argv);
+    fprintf(stderr, "%s: execvp: %s: %s\n", program_name, argv[0], strerror(errno));
+    _exit(127);
+}
+
+static void bench_tracer(char *argv[], int report_fd, int fds[], int nfds)
+{
+    report_t report;
+    memset(&report, 0, sizeof report);
+    pid_t pid = fork();
+    if (pid == -1)
+	DIE("fork", errno);
+    if (pid == 0)
+	bench_child(argv, fds, nfds);
+    int status;
+    if (waitpid(pid, &status, WUNTRACED) == -1)
+	DIE("waitpid", errno);
+    int traced = ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE) != -1;
+    if (traced) {
+	/* threads created by the command are traced too */
+	pid_t tid = pid;
+	int sig = 0;
+	while (1) {
+	    if (ptrace(PTRACE_SYSCALL, tid, 0, sig) == -1 && errno != ESRCH)
+		DIE("ptrace", errno);
+	    tid = waitpid(-1, &status, __WALL);
+	    if (tid == -1)
+		DIE("waitpid", errno);
+	    sig = 0;
+	    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+		if (tid == pid)
+		    break;
+		tid = -1;
+		continue;
+	    }
+	    if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+		++report.syscalls;
+	    else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP)
+		sig = WSTOPSIG(status);
+	}
+	/* each system call stops once on entry and once on exit */
+	report.syscalls /= 2;
+    } else {
+	report.syscalls = -1;
+	kill(pid, SIGCONT);
+	if (waitpid(pid, &status, 0) == -1)
+	    DIE("waitpid", errno);
+    }
+    struct rusage rusage;
+    if (getrusage(RUSAGE_CHILDREN, &rusage) == -1)
+	DIE("getrusage", errno);
+    report.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    report.user_usec = 1000000L * rusage.ru_utime.tv_sec + rusage.ru_utime.tv_usec;
+    report.system_usec = 1000000L * rusage.ru_stime.tv_sec + rusage.ru_stime.tv_usec;
+    if (write(report_fd, &report, sizeof report) != sizeof report)
+	DIE("write", errno);
+    _exit(EXIT_SUCCESS);
+}
+
+static int bench(sim_t *sim, int slave, char *argv[])
+{
+    int report_fds[2];
+    if (pipe(report_fds) == -1)
+	DIE("pipe", errno);
+    struct timespec start;
+    if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+	DIE("clock_gettime", errno);
+    pid_t tracer = fork();
+    if (tracer == -1)
+	DIE("fork", errno);
+    if (tracer == 0) {
+	int fds[] = { sim->master, slave, report_fds[0], report_fds[1] };
+	close(report_fds[0]);
+	bench_tracer(argv, report_fds[1], fds, sizeof fds / sizeof fds[0]);
+    }
+    close(report_fds[1]);
+    report_t report;
+    sim_run(sim, report_fds[0], &report);
+    struct timespec end;
+    if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+	DIE("clock_gettime", errno);
+    if (waitpid(tracer, 0, 0) == -1)
+	DIE("waitpid", errno);
+    double elapsed = timespec_sub(&end, &start);
+    printf("--- \n");
+    printf("command: \"");
+    int i;
+    for (i = 0; argv[i]; ++i)
+	printf("%s%s", i ? " " : "", argv[i]);
+    printf("\"\n");
+    printf("status: %d\n", report.status);
+    printf("tracks: %d\n", sim->trackc);
+    printf("records: %d\n", sim->records);
+    printf("throttle: %s\n", sim->throttle ? "true" : "false");
+    printf("elapsed_sec: %.3f\n", elapsed);
+    printf("bytes: %ld\n", sim->bytes);
+    printf("lines: %ld\n", sim->lines);
+    printf("bytes_per_sec: %.0f\n", sim->bytes / elapsed);
+    printf("lines_per_sec: %.0f\n", sim->lines / elapsed);
+    printf("user_cpu_sec: %.3f\n", report.user_usec / 1e6);
+    printf("system_cpu_sec: %.3f\n", report.system_usec / 1e6);
+    if (report.syscalls >= 0) {
+	printf("syscalls: %ld\n", report.syscalls);
+	printf("syscalls_per_kb: %.2f\n", sim->bytes ? 1024.0 * report.syscalls / sim->bytes : 0.0);
+    } else {
+	printf("syscalls: ~\n");
+	printf("syscalls_per_kb: ~\n");
+    }
+    return report.status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void usage(void)
+{
+    printf("%s - simulate a Flytec or Brauniger flight recorder\n"
+	    "Usage: %s [options] [command [argument ...]]\n"
+	    "Options:\n"
+	    "\t-h, --help\t\tshow some help\n"
+	    "\t-b, --baud\t\tthrottle output to 57600 baud\n"
+	    "\t-f, --faults=N\t\tcut off every Nth response half way\n"
+	    "\t-i, --instrument=ID\tset instrument id (default is COMPEO)\n"
+	    "\t-n, --tracks=COUNT\tnumber of tracklogs (default is 4)\n"
+	    "\t-p, --pilot=NAME\tset pilot name\n"
+	    "\t-r, --records=COUNT\tB records per tracklog (default is 3600)\n"
+	    "\t-s, --serial=NUMBER\tset serial number\n"
+	    "Without a command the pseudo-terminal is printed to stdout and the\n"
+	    "simulator runs until interrupted.  With a command, the command is run\n"
+	    "with TINI_DEVICE set to the pseudo-terminal and a benchmark report is\n"
+	    "printed when it exits.\n",
+	    program_name, program_name);
+}
+
+int main(int argc, char *argv[])
+{
+    program_name = strrchr(argv[0], '/');
+    program_name = program_name ? program_name + 1 : argv[0];
+
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+    sim_t sim;
+    memset(&sim, 0, sizeof sim);
+    sim.instrument_id = "COMPEO";
+    sim.pilot_name = "Simulated Pilot";
+    sim.serial_number = 1234;
+    sim.software_version = "1.20";
+    sim.trackc = 4;
+    sim.records = 3600;
+
+    opterr = 0;
+    while (1) {
+	static struct option options[] = {
+	    { "baud",       no_argument,       0, 'b' },
+	    { "faults",     required_argument, 0, 'f' },
+	    { "help",       no_argument,       0, 'h' },
+	    { "instrument", required_argument, 0, 'i' },
+	    { "tracks",     required_argument, 0, 'n' },
+	    { "pilot",      required_argument, 0, 'p' },
+	    { "records",    required_argument, 0, 'r' },
+	    { "serial",     required_argument, 0, 's' },
+	    { 0,            0,                 0, 0 },
+	};
+	int c = getopt_long(argc, argv, "+:bf:hi:n:p:r:s:", options, 0);
+	if (c == -1)
+	    break;
+	switch (c) {
+	    case 'b':
+		sim.throttle = 1;
+		break;
+	    case 'f':
+		sim.faults = atoi(optarg);
+		if (sim.faults < 0)
+		    error("invalid fault interval '%s'", optarg);
+		break;
+	    case 'h':
+		usage();
+		exit(EXIT_SUCCESS);
+	    case 'i':
+		sim.instrument_id = optarg;
+		break;
+	    case 'n':
+		sim.trackc = atoi(optarg);
+		if (sim.trackc < 0 || sim.trackc > 99)
+		    error("invalid number of tracklogs '%s'", optarg);
+		break;
+	    case 'p':
+		sim.pilot_name = optarg;
+		break;
+	    case 'r':
+		sim.records = atoi(optarg);
+		if (sim.records < 0)
+		    error("invalid number of records '%s'", optarg);
+		break;
+	    case 's':
+		sim.serial_number = atoi(optarg);
+		break;
+	    case ':':
+		error("option '%c' requires an argument", optopt);
+	    case '?':
+		error("invalid option '%c'", optopt);
+	}
+    }
+
+    sim.master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim.master == -1)
+	DIE("posix_openpt", errno);
+    if (grantpt(sim.master) == -1)
+	DIE("grantpt", errno);
+    if (unlockpt(sim.master) == -1)
+	DIE("unlockpt", errno);
+    const char *slave_name = ptsname(sim.master);
+    if (!slave_name)
+	DIE("ptsname", errno);
+    /* keep the slave open so that the master does not hang up between clients */
+    int slave = open(slave_name, O_RDWR | O_NOCTTY);
+    if (slave == -1)
+	error("open: %s: %s", slave_name, strerror(errno));
+    struct termios termios;
+    if (tcgetattr(slave, &termios) == -1)
+	DIE("tcgetattr", errno);
+    cfmakeraw(&termios);
+    if (tcsetattr(slave, TCSANOW, &termios) == -1)
+	DIE("tcsetattr", errno);
+    if (fcntl(sim.master, F_SETFL, O_NONBLOCK) == -1)
+	DIE("fcntl", errno);
+
+    if (optind == argc) {
+	printf("%s\n", slave_name);
+	fflush(stdout);
+	sim_run(&sim, -1, 0);
+	return EXIT_SUCCESS;
+    }
+    setenv("TINI_DEVICE", slave_name, 1);
+    return bench(&sim, slave, argv + optind);
+}
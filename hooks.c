@@ -0,0 +1,89 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#include <stdarg.h>
+
+#include "libtini.h"
+
+static void *default_realloc(void *data, void *ptr, size_t size)
+{
+    if (size)
+	return realloc(ptr, size);
+    free(ptr);
+    return 0;
+}
+
+static const tini_hooks_t default_hooks = { default_realloc, 0, 0 };
+
+/* returns zeroed memory, or 0 with errno set */
+void *tini_alloc(const tini_hooks_t *hooks, size_t size)
+{
+    void *p = tini_realloc(hooks, 0, size);
+    if (p)
+	memset(p, 0, size);
+    return p;
+}
+
+/* leaves ptr alone and returns 0 with errno set on failure */
+void *tini_realloc(const tini_hooks_t *hooks, void *ptr, size_t size)
+{
+    hooks = hooks && hooks->realloc ? hooks : &default_hooks;
+    void *p = hooks->realloc(hooks->data, ptr, size ? size : 1);
+    if (!p)
+	errno = ENOMEM;
+    return p;
+}
+
+void tini_free(const tini_hooks_t *hooks, void *ptr)
+{
+    hooks = hooks && hooks->realloc ? hooks : &default_hooks;
+    if (ptr)
+	hooks->realloc(hooks->data, ptr, 0);
+}
+
+void tini_log(const tini_hooks_t *hooks, const char *source, const char *message, ...)
+{
+    if (!hooks || !hooks->log)
+	return;
+    char buf[256];
+    va_list ap;
+    va_start(ap, message);
+    vsnprintf(buf, sizeof buf, message, ap);
+    va_end(ap);
+    hooks->log(hooks->data, source, buf);
+}
+
+char *tini_strndup(const tini_hooks_t *hooks, const char *s, size_t len)
+{
+    char *p = tini_alloc(hooks, len + 1);
+    if (p)
+	memcpy(p, s, len);
+    return p;
+}
+
+void tini_abort(const char *file, int line, const char *function, const char *message, int _errno)
+{
+    if (_errno)
+	fprintf(stderr, "libtini: %s:%d: %s: %s: %s\n", file, line, function, message, strerror(_errno));
+    else
+	fprintf(stderr, "libtini: %s:%d: %s: %s\n", file, line, function, message);
+    abort();
+}
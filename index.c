@@ -0,0 +1,377 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* The catalog is written in native byte order and read back with mmap, so
+ * a query only touches the pages it needs.  Files whose size and mtime
+ * match the previous catalog are not opened again. */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "tini.h"
+
+typedef struct {
+    const char *directory;
+    const index_entry_t **old;
+    int oldc;
+    index_entry_t *entryv;
+    int entryc;
+    int entry_capacity;
+    int scanned;
+} indexer_t;
+
+typedef struct {
+    index_entry_t *entry;
+    struct tm tm;
+    int header_done;
+    int first;
+    int last;
+} scan_t;
+
+void filter_init(filter_t *filter)
+{
+    filter->since = 0;
+    filter->until = (time_t) INT64_MAX;
+    filter->serial_number = -1;
+    filter->min_duration = 0;
+}
+
+/* returns 1 if a tracklog from serial_number starting at time and lasting
+ * duration seconds passes filter */
+int filter_match(const filter_t *filter, int serial_number, time_t time, int duration)
+{
+    if (filter->serial_number != -1 && serial_number != filter->serial_number)
+	return 0;
+    return filter->since <= time && time <= filter->until && duration >= filter->min_duration;
+}
+
+static char *path_join(const char *directory, const char *filename)
+{
+    char *path = alloc(strlen(directory) + strlen(filename) + 2);
+    sprintf(path, "%s/%s", directory, filename);
+    return path;
+}
+
+/* returns the mapped catalog or 0 if there is none */
+static const index_header_t *index_map(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+	if (errno == ENOENT)
+	    return 0;
+	error("open: %s: %s", path, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+	error("fstat: %s: %s", path, strerror(errno));
+    if ((size_t) st.st_size < sizeof(index_header_t))
+	error("%s: invalid index", path);
+    const index_header_t *header = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (header == MAP_FAILED)
+	error("mmap: %s: %s", path, strerror(errno));
+    close(fd);
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof header->magic) || header->entry_size != sizeof(index_entry_t) || (size_t) st.st_size != sizeof(index_header_t) + header->entryc * (sizeof(index_entry_t) + sizeof(uint32_t)))
+	error("%s: invalid index", path);
+    *size = st.st_size;
+    return header;
+}
+
+static int entry_filename_compare(const void *a, const void *b)
+{
+    return strcmp((*(const index_entry_t *const *) a)->filename, (*(const index_entry_t *const *) b)->filename);
+}
+
+static int entry_compare(const void *a, const void *b)
+{
+    const index_entry_t *ea = a, *eb = b;
+    if (ea->serial_number != eb->serial_number)
+	return ea->serial_number < eb->serial_number ? -1 : 1;
+    if (ea->time != eb->time)
+	return ea->time < eb->time ? -1 : 1;
+    return strcmp(ea->filename, eb->filename);
+}
+
+static int entry_time_compare(const void *a, const void *b)
+{
+    const index_entry_t *ea = *(const index_entry_t *const *) a, *eb = *(const index_entry_t *const *) b;
+    if (ea->time != eb->time)
+	return ea->time < eb->time ? -1 : 1;
+    return entry_compare(ea, eb);
+}
+
+int is_track_filename(const char *filename)
+{
+    static const char *suffixes[] = { ".IGC", ".IGC" TNB_SUFFIX, 0 };
+    int len = strlen(filename);
+    const char **suffix;
+    for (suffix = suffixes; *suffix; ++suffix) {
+	int suffix_len = strlen(*suffix);
+	if (len > suffix_len && strcasecmp(filename + len - suffix_len, *suffix) == 0)
+	    return 1;
+    }
+    return 0;
+}
+
+static void scan_line(void *data, const char *line, int len)
+{
+    scan_t *scan = data;
+    if (scan->header_done || (line[0] != 'A' && line[0] != 'H'))
+	return;
+    char copy[128];
+    if (len >= (int) sizeof copy)
+	return;
+    memcpy(copy, line, len);
+    copy[len] = '\0';
+    if (copy[0] == 'A' && !scan->entry->manufacturer[0] && len >= 4)
+	memcpy(scan->entry->manufacturer, copy + 1, 3);
+    else
+	igc_tm_update(&scan->tm, copy);
+}
+
+static void scan_b_record(void *data, const b_record_t *b)
+{
+    scan_t *scan = data;
+    scan->header_done = 1;
+    if (scan->first == -1)
+	scan->first = b->time;
+    scan->last = b->time;
+    ++scan->entry->b_records;
+}
+
+static void index_scan(index_entry_t *entry, const char *buf, size_t size)
+{
+    scan_t scan;
+    memset(&scan, 0, sizeof scan);
+    scan.entry = entry;
+    scan.first = scan.last = -1;
+    track_scan(buf, size, scan_line, scan_b_record, &scan);
+    if (scan.tm.tm_mday) {
+	entry->date = DATE_NEW(scan.tm);
+	if (scan.first != -1) {
+	    scan.tm.tm_hour = scan.first / 3600;
+	    scan.tm.tm_min = (scan.first / 60) % 60;
+	    scan.tm.tm_sec = scan.first % 60;
+	}
+	time_t time = tini_timegm(&scan.tm);
+	if (time != (time_t) -1)
+	    entry->time = time;
+    }
+    if (scan.first != -1) {
+	/* a flight can cross midnight UTC */
+	entry->duration = scan.last - scan.first;
+	if (entry->duration < 0)
+	    entry->duration += 86400;
+    }
+    entry->end = entry->time + entry->duration;
+}
+
+static void index_file(indexer_t *indexer, int dirfd, const char *name, const char *relative, const struct stat *st)
+{
+    index_entry_t entry;
+    memset(&entry, 0, sizeof entry);
+    if (strlen(relative) >= sizeof entry.filename) {
+	fprintf(stderr, "%s: %s/%s: filename too long, skipped\n", program_name, indexer->directory, relative);
+	return;
+    }
+    strcpy(entry.filename, relative);
+    entry.size = st->st_size;
+    entry.mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    const index_entry_t *key = &entry;
+    const index_entry_t **old = indexer->old ? bsearch(&key, indexer->old, indexer->oldc, sizeof(index_entry_t *), entry_filename_compare) : 0;
+    if (old && (*old)->size == entry.size && (*old)->mtime == entry.mtime) {
+	entry = **old;
+    } else {
+	/* tini's own filenames carry the manufacturer and serial number */
+	char manufacturer[4];
+	int serial_number, n = 0;
+	if (sscanf(name, "%*4d-%*2d-%*2d-%3[A-Za-z0-9]-%d-%*2d%n", manufacturer, &serial_number, &n) == 2 && n && name[n] == '.') {
+	    memcpy(entry.manufacturer, manufacturer, sizeof manufacturer);
+	    entry.serial_number = serial_number;
+	}
+	if (entry.size) {
+	    int fd = openat(dirfd, name, O_RDONLY);
+	    if (fd == -1)
+		error("open: %s/%s: %s", indexer->directory, relative, strerror(errno));
+	    void *buf = mmap(0, entry.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	    if (buf == MAP_FAILED)
+		error("mmap: %s/%s: %s", indexer->directory, relative, strerror(errno));
+	    close(fd);
+	    index_scan(&entry, buf, entry.size);
+	    munmap(buf, entry.size);
+	}
+	++indexer->scanned;
+    }
+    if (indexer->entryc == indexer->entry_capacity) {
+	indexer->entry_capacity = indexer->entry_capacity ? 2 * indexer->entry_capacity : 1024;
+	indexer->entryv = realloc(indexer->entryv, indexer->entry_capacity * sizeof(index_entry_t));
+	if (!indexer->entryv)
+	    DIE("realloc", errno);
+    }
+    indexer->entryv[indexer->entryc++] = entry;
+}
+
+static void index_walk(indexer_t *indexer, const char *relative)
+{
+    char *path = relative ? path_join(indexer->directory, relative) : 0;
+    DIR *dir = opendir(path ? path : indexer->directory);
+    if (!dir)
+	error("opendir: %s: %s", path ? path : indexer->directory, strerror(errno));
+    struct dirent *dirent;
+    while ((errno = 0, dirent = readdir(dir))) {
+	/* skips . and .. and tini's own files */
+	if (dirent->d_name[0] == '.')
+	    continue;
+	char *name = relative ? path_join(relative, dirent->d_name) : dirent->d_name;
+	struct stat st;
+	if (fstatat(dirfd(dir), dirent->d_name, &st, 0) == -1)
+	    error("stat: %s/%s: %s", indexer->directory, name, strerror(errno));
+	if (S_ISDIR(st.st_mode))
+	    index_walk(indexer, name);
+	else if (S_ISREG(st.st_mode) && is_track_filename(dirent->d_name))
+	    index_file(indexer, dirfd(dir), dirent->d_name, name, &st);
+	if (relative)
+	    free(name);
+    }
+    if (errno)
+	error("readdir: %s: %s", path ? path : indexer->directory, strerror(errno));
+    closedir(dir);
+    free(path);
+}
+
+void index_update(const char *directory, int quiet)
+{
+    indexer_t indexer;
+    memset(&indexer, 0, sizeof indexer);
+    indexer.directory = directory;
+    char *path = path_join(directory, INDEX_FILENAME);
+    size_t size = 0;
+    const index_header_t *header = index_map(path, &size);
+    if (header) {
+	const index_entry_t *entries = (const index_entry_t *) (header + 1);
+	indexer.oldc = header->entryc;
+	indexer.old = alloc((indexer.oldc + 1) * sizeof(index_entry_t *));
+	int i;
+	for (i = 0; i < indexer.oldc; ++i)
+	    indexer.old[i] = entries + i;
+	qsort(indexer.old, indexer.oldc, sizeof(index_entry_t *), entry_filename_compare);
+    }
+    index_walk(&indexer, 0);
+    if (header)
+	munmap((void *) header, size);
+    free(indexer.old);
+
+    qsort(indexer.entryv, indexer.entryc, sizeof(index_entry_t), entry_compare);
+    const index_entry_t **by_time = alloc((indexer.entryc + 1) * sizeof(index_entry_t *));
+    uint32_t *order = alloc((indexer.entryc + 1) * sizeof(uint32_t));
+    int i;
+    for (i = 0; i < indexer.entryc; ++i)
+	by_time[i] = indexer.entryv + i;
+    qsort(by_time, indexer.entryc, sizeof(index_entry_t *), entry_time_compare);
+    for (i = 0; i < indexer.entryc; ++i)
+	order[i] = by_time[i] - indexer.entryv;
+    free(by_time);
+
+    index_header_t new_header;
+    memset(&new_header, 0, sizeof new_header);
+    memcpy(new_header.magic, INDEX_MAGIC, sizeof new_header.magic);
+    new_header.entry_size = sizeof(index_entry_t);
+    new_header.entryc = indexer.entryc;
+    /* replace the catalog atomically so a concurrent query sees either */
+    char *tmp_path = alloc(strlen(path) + 5);
+    sprintf(tmp_path, "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "w");
+    if (!file)
+	error("fopen: %s: %s", tmp_path, strerror(errno));
+    if (fwrite(&new_header, sizeof new_header, 1, file) != 1
+	    || fwrite(indexer.entryv, sizeof(index_entry_t), indexer.entryc, file) != (size_t) indexer.entryc
+	    || fwrite(order, sizeof(uint32_t), indexer.entryc, file) != (size_t) indexer.entryc)
+	error("fwrite: %s: %s", tmp_path, strerror(errno));
+    if (fclose(file) == EOF)
+	error("fclose: %s: %s", tmp_path, strerror(errno));
+    if (rename(tmp_path, path) == -1)
+	error("rename: %s: %s", tmp_path, strerror(errno));
+    if (!quiet)
+	fprintf(stderr, "%s: %d tracklog%s indexed, %d scanned\n", program_name, indexer.entryc, indexer.entryc == 1 ? "" : "s", indexer.scanned);
+    free(tmp_path);
+    free(order);
+    free(indexer.entryv);
+    free(path);
+}
+
+/* calls callback for each tracklog that matches filter in order of start
+ * time, returns the number of matches */
+int index_query(const char *directory, const filter_t *filter, void (*callback)(void *, const index_entry_t *), void *data)
+{
+    char *path = path_join(directory, INDEX_FILENAME);
+    size_t size = 0;
+    const index_header_t *header = index_map(path, &size);
+    if (!header)
+	error("%s: no index, run the index command first", path);
+    const index_entry_t *entries = (const index_entry_t *) (header + 1);
+    const uint32_t *order = (const uint32_t *) (entries + header->entryc);
+    int count = 0;
+    int lo = 0, hi = header->entryc;
+    if (filter->serial_number != -1) {
+	/* entries are sorted by serial number then start time */
+	while (lo < hi) {
+	    int mid = (lo + hi) / 2;
+	    const index_entry_t *entry = entries + mid;
+	    if (entry->serial_number < filter->serial_number || (entry->serial_number == filter->serial_number && entry->time < filter->since))
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	for (; lo < (int) header->entryc; ++lo) {
+	    const index_entry_t *entry = entries + lo;
+	    if (entry->serial_number != filter->serial_number || entry->time > filter->until)
+		break;
+	    if (entry->duration >= filter->min_duration) {
+		callback(data, entry);
+		++count;
+	    }
+	}
+    } else {
+	while (lo < hi) {
+	    int mid = (lo + hi) / 2;
+	    if (entries[order[mid]].time < filter->since)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	for (; lo < (int) header->entryc; ++lo) {
+	    const index_entry_t *entry = entries + order[lo];
+	    if (entry->time > filter->until)
+		break;
+	    if (entry->duration >= filter->min_duration) {
+		callback(data, entry);
+		++count;
+	    }
+	}
+    }
+    munmap((void *) header, size);
+    free(path);
+    return count;
+}
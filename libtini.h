@@ -0,0 +1,407 @@
+/*
+
+   tini - download tracklogs from Flytec and Brauniger flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* libtini is the protocol code without the tini command line around it.  It
+ * never exits: functions that can fail return -1 or a null pointer with
+ * errno set, and flytec_t records a description in error_message.  It has
+ * no global state, every object allocates and logs through the hooks it was
+ * created with, so one process can drive many FRs from many threads as
+ * long as each flytec_t is used by one thread at a time.
+ *
+ * TINI_ABORT is kept for bugs in libtini itself: clock_gettime,
+ * pthread_join or snprintf failing, and an io_uring read that cannot be
+ * cancelled and reaped before the ring it reads into is freed. */
+
+#ifndef LIBTINI_H
+#define LIBTINI_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/* for conditions that cannot happen, never for errors at run time */
+#define TINI_ABORT(syscall, _errno) tini_abort(__FILE__, __LINE__, __FUNCTION__, (syscall), (_errno))
+
+#define DATE_NEW(tm) (((tm).tm_year << 9) + ((tm).tm_mon << 5) + (tm).tm_mday)
+#define DATE_YEAR(date) ((date) >> 9)
+#define DATE_MON(date) (((date) >> 5) & 0xf)
+#define DATE_MDAY(date) ((date) & 0x1f)
+
+enum {
+    XON = '\x11',
+    XOFF = '\x13',
+};
+
+/* realloc frees ptr when size is zero, like lua_Alloc, and if null the C
+ * library's realloc is used.  log, if not null, receives messages about
+ * problems that were recovered from, source is a device or file name.  A
+ * null tini_hooks_t pointer means the defaults for both. */
+typedef struct {
+    void *(*realloc)(void *data, void *ptr, size_t size);
+    void (*log)(void *data, const char *source, const char *message);
+    void *data;
+} tini_hooks_t;
+
+void *tini_alloc(const tini_hooks_t *, size_t);
+void *tini_realloc(const tini_hooks_t *, void *, size_t);
+void tini_free(const tini_hooks_t *, void *);
+void tini_log(const tini_hooks_t *, const char *, const char *, ...) __attribute__ ((format(printf, 3, 4)));
+char *tini_strndup(const tini_hooks_t *, const char *, size_t);
+void tini_abort(const char *, int, const char *, const char *, int) __attribute__ ((noreturn));
+
+typedef struct {
+    const tini_hooks_t *hooks;
+    char *buf;
+    unsigned int size;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int high;
+    int shared;
+} ring_t;
+
+#define RING_USED(ring) (__atomic_load_n(&(ring)->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&(ring)->tail, __ATOMIC_ACQUIRE))
+#define RING_EMPTY(ring) (RING_USED(ring) == 0)
+#define RING_FULL(ring) (RING_USED(ring) == (ring)->size)
+
+ring_t *ring_new(const tini_hooks_t *, unsigned int);
+void ring_delete(ring_t *);
+const char *ring_peek(const ring_t *, unsigned int *);
+void ring_consume(ring_t *, unsigned int);
+int ring_space(ring_t *, struct iovec *);
+void ring_produce(ring_t *, unsigned int);
+int ring_read(ring_t *, int);
+unsigned int ring_write(ring_t *, const char *, unsigned int);
+
+typedef struct _uring_t uring_t;
+
+uring_t *uring_new(const tini_hooks_t *, unsigned int);
+void uring_delete(uring_t *);
+int uring_readv(uring_t *, int, const struct iovec *, int, uint64_t);
+int uring_writev(uring_t *, int, const struct iovec *, int, uint64_t);
+int uring_cancel(uring_t *, uint64_t, uint64_t);
+int uring_wait(uring_t *, int, uint64_t *, int *);
+
+typedef struct {
+    const tini_hooks_t *hooks;
+    char *instrument_id;
+    char *pilot_name;
+    int serial_number;
+    char *software_version;
+} snp_t;
+
+snp_t *snp_new(const tini_hooks_t *, const char *);
+void snp_delete(snp_t *);
+
+const char *manufacturer_new(const char *);
+
+typedef struct {
+    const tini_hooks_t *hooks;
+    int count;
+    int index;
+    int date;
+    int day_index;
+    time_t time;
+    int duration;
+    char *igc_filename;
+} track_t;
+
+track_t *track_new(const tini_hooks_t *, const char *);
+void track_delete(track_t *);
+
+/* bucket 0 counts zeros and bucket i values from 2^(i-1) to 2^i - 1 */
+#define HISTOGRAM_BUCKETS 32
+
+typedef struct {
+    long count[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+void histogram_add(histogram_t *, unsigned long);
+
+typedef struct {
+    char command[16];
+    long nsec;
+    long bytes;
+    long lines;
+} command_stats_t;
+
+/* how long to wait for the first byte of a response and between reads
+ * within one */
+typedef struct {
+    const char *instrument_id;
+    int first_byte_ms;
+    int inter_byte_ms;
+} flytec_timing_t;
+
+/* one of those two timeouts, adapted to the delays seen as with TCP's
+ * retransmission timeout unless it is fixed.  The reader thread of -p
+ * samples delays while the consumer backs off after a timeout, so
+ * everything but timeout_ms, which is read atomically, is under lock. */
+typedef struct {
+    pthread_mutex_t lock;
+    int timeout_ms;
+    int floor_ms;
+    int fixed;
+    int backoff;
+    long srtt_usec;
+    long rttvar_usec;
+    long samples;
+} flytec_phase_t;
+
+typedef struct _reader_t reader_t;
+typedef struct _writer_t writer_t;
+typedef struct _replay_t replay_t;
+typedef struct _transport_t transport_t;
+typedef struct _capture_t capture_t;
+
+typedef struct {
+    const char *device;
+    const tini_hooks_t *hooks;
+    const transport_t *transport;
+    void *transport_data;
+    int fd;
+    FILE *logfile;
+    capture_t *capture;
+    int capture_device;
+    snp_t *snp;
+    const char *manufacturer;
+    char *pilot_name;
+    int serial_number;
+    int trackc;
+    int trackc_received;
+    track_t **trackv;
+    ring_t *ring;
+    reader_t *reader;
+    long bytes;
+    long reads;
+    long selects;
+    long reader_stalls;
+    int reader_uring;
+    flytec_phase_t first_byte;
+    flytec_phase_t inter_byte;
+    /* set with a release store once command_nsec is written */
+    int awaiting_first_byte;
+    /* instrumentation, always collected and printed to statsfile */
+    FILE *statsfile;
+    long open_nsec;
+    long lines;
+    /* last_read_nsec, reads and the histograms belong to whichever thread
+     * reads the device and are only printed after flytec_reader_stop */
+    long last_read_nsec;
+    long write_nsec;
+    long close_nsec;
+    histogram_t read_sizes;
+    histogram_t read_gaps;
+    int commandc;
+    int command_open;
+    long command_nsec;
+    long command_bytes;
+    long command_lines;
+    command_stats_t *commandv;
+    int uart_supported;
+    int uart[5];
+    /* the last error */
+    int error;
+    char error_message[128];
+    long errors;
+    long retries;
+    long recoveries;
+    long abandoned;
+} flytec_t;
+
+typedef enum {
+    igc_filename_format_long,
+    igc_filename_format_short
+} igc_filename_format_t;
+
+#define CAPTURE_MAGIC "TINICAP1"
+
+/* records of type CAPTURE_DEVICE name the device that later records with
+ * the same device number belong to */
+typedef enum {
+    CAPTURE_READ = '<',
+    CAPTURE_WRITE = '>',
+    CAPTURE_DEVICE = 'd',
+    CAPTURE_DROP = '!',
+    CAPTURE_ERROR = 'e'
+} capture_type_t;
+
+typedef struct {
+    int64_t nsec;		/* CLOCK_MONOTONIC */
+    uint32_t len;		/* of the data that follows */
+    uint16_t device;
+    uint8_t type;
+    uint8_t reserved;
+} capture_record_t;
+
+capture_t *capture_new(const tini_hooks_t *, const char *);
+int capture_delete(capture_t *);
+void capture_add(capture_t *, int, int, const char *, unsigned int, const char *, unsigned int);
+int capture_device(capture_t *, const char *);
+int capture_dump(const tini_hooks_t *, const char *, FILE *);
+
+#define FLYTEC_TIMEOUT_MS 250
+#define FLYTEC_TIMEOUT_MIN_MS 25
+#define FLYTEC_TIMEOUT_MAX_MS 4000
+#define FLYTEC_LINE_MAX 1024
+
+/* a failed command is tried again up to FLYTEC_RETRIES times, waiting
+ * FLYTEC_BACKOFF_MS before the first retry and twice as long each time */
+#define FLYTEC_RETRIES 4
+#define FLYTEC_BACKOFF_MS 100
+
+/* read returns what ring_read returns, write returns the number of bytes
+ * written, fewer than asked only if the descriptor is non-blocking, and
+ * batch_ms is how long a blocking read may hold back the end of a
+ * response */
+struct _transport_t {
+    const char *scheme;
+    int timeout_ms;
+    int batch_ms;
+    int (*open)(flytec_t *, const char *);
+    int (*read)(flytec_t *);
+    int (*write)(flytec_t *, const char *, int);
+    void (*close)(flytec_t *);
+};
+
+int transport_open(flytec_t *, const char *);
+
+int replay_open(const tini_hooks_t *, const char *, int, replay_t **);
+void replay_close(replay_t *);
+
+long now_nsec(void);
+void flytec_count_read(flytec_t *, int);
+void flytec_set_capture(flytec_t *, capture_t *);
+void flytec_command_end(flytec_t *);
+void flytec_log_error(flytec_t *);
+const flytec_timing_t *flytec_timing_find(const char *);
+void flytec_set_timing(flytec_t *, int, int);
+int flytec_timeout_ms(flytec_t *);
+void flytec_timed_out(flytec_t *);
+flytec_t *flytec_open(const char *, FILE *, const tini_hooks_t *);
+void flytec_delete(flytec_t *);
+int flytec_retry(flytec_t *, int (*)(flytec_t *, void *), void (*)(flytec_t *, void *), void *);
+int flytec_format_nmea(flytec_t *, const char *, char *, int);
+int flytec_puts_nmea(flytec_t *, const char *);
+int nmea_decode(char *);
+int flytec_pbrigc(flytec_t *, void (*)(void *, const char *), void *);
+int flytec_pbrigc_lines(flytec_t *, void (*)(void *, const char *, int), void *);
+snp_t *flytec_pbrsnp(flytec_t *);
+int flytec_set_snp(flytec_t *, snp_t *);
+track_t **flytec_pbrtl(flytec_t *, const char *, igc_filename_format_t);
+int flytec_add_track(flytec_t *, const char *);
+void flytec_clear_tracks(flytec_t *);
+int flytec_set_igc_filenames(flytec_t *, const char *, igc_filename_format_t);
+int track_set_igc_filename(track_t *, const char *, int, igc_filename_format_t);
+int flytec_pbrtr(flytec_t *, track_t *, void (*)(void *, const char *), void *);
+int flytec_pbrtr_lines(flytec_t *, track_t *, void (*)(void *, const char *, int), void *);
+
+int flytec_reader_start(flytec_t *, int);
+void flytec_reader_stop(flytec_t *);
+int flytec_reader_wait(flytec_t *, unsigned int, int);
+writer_t *writer_new(const tini_hooks_t *, unsigned int, int);
+void writer_delete(writer_t *);
+void writer_open(writer_t *, int);
+void writer_write(writer_t *, const char *, int);
+int writer_close(writer_t *, int);
+void writer_stats(const writer_t *, unsigned int *, long *, long *, int *);
+
+/* A machine_t runs the protocol with one FR without doing any I/O, so that
+ * a single thread can drive many FRs from its own event loop.  The caller
+ * writes what machine_output returns, passes everything it reads to
+ * machine_input, and calls machine_expire once machine_deadline, on the
+ * now_nsec clock, has passed.  Events are delivered to the callback, which
+ * may send the next command but must not delete the machine.  The line of
+ * a MACHINE_LINE event is a run of lines in the buffer given to
+ * machine_input when they arrived whole, and is only NUL terminated when
+ * it is a single line the machine had to piece together. */
+typedef enum {
+    MACHINE_XOFF,		/* the response has started */
+    MACHINE_LINE,		/* one or more lines of the response, with CRLFs */
+    MACHINE_SNP,		/* flytec->snp has been set */
+    MACHINE_TRACK,		/* a tracklog has been added to flytec->trackv */
+    MACHINE_COMPLETE,		/* the XON that ends the response */
+    MACHINE_ERROR		/* flytec->error and error_message say why */
+} machine_event_type_t;
+
+typedef struct {
+    machine_event_type_t type;
+    const char *line;
+    int len;
+    const track_t *track;
+} machine_event_t;
+
+typedef struct _machine_t machine_t;
+
+machine_t *machine_new(flytec_t *, void (*)(void *, const machine_event_t *), void *);
+void machine_delete(machine_t *);
+int machine_ready(const machine_t *);
+int machine_command(machine_t *, const char *);
+const char *machine_output(const machine_t *, unsigned int *);
+void machine_written(machine_t *, unsigned int);
+void machine_input(machine_t *, const char *, unsigned int);
+long machine_deadline(const machine_t *);
+void machine_expire(machine_t *, long);
+
+int igc_tm_update(struct tm *, const char *);
+time_t tini_timegm(const struct tm *);
+int time_parse(const char *, int, time_t *);
+int duration_parse(const char *, int *);
+
+typedef struct {
+    int time;			/* seconds since midnight */
+    int lat;			/* thousandths of a minute, negative is south */
+    int lon;			/* thousandths of a minute, negative is west */
+    char validity;
+    int pressure_altitude;
+    int gnss_altitude;
+    const char *extension;
+    int extension_len;
+} b_record_t;
+
+int b_record_parse(b_record_t *, const char *);
+int b_record_decode(b_record_t *, const char *, int);
+int b_record_altitude(const b_record_t *);
+
+/* B records decoded into one array per field */
+typedef struct {
+    const tini_hooks_t *hooks;
+    int n;
+    int capacity;
+    int *time;			/* seconds since midnight */
+    int *lat;			/* millionths of a degree, negative is south */
+    int *lon;			/* millionths of a degree, negative is west */
+    int *pressure_altitude;
+    int *gnss_altitude;
+    char *validity;
+} track_columns_t;
+
+track_columns_t *track_columns_new(const tini_hooks_t *);
+void track_columns_delete(track_columns_t *);
+int track_columns_append(track_columns_t *, const b_record_t *);
+int track_columns_decode(track_columns_t *, const char *, size_t);
+
+#endif
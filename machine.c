@@ -0,0 +1,310 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* The machine is the push style counterpart of the flytec_ commands: it
+ * parses responses a byte at a time as they arrive instead of blocking in
+ * flytec_wait.  After an error it discards input up to the next XON, or
+ * until the FR stops sending, before it accepts another command. */
+
+#include <stdarg.h>
+
+#include "libtini.h"
+
+typedef enum {
+    machine_state_idle,
+    machine_state_xoff,
+    machine_state_response,
+    machine_state_drain
+} machine_state_t;
+
+typedef enum {
+    machine_command_other,
+    machine_command_pbrsnp,
+    machine_command_pbrtl
+} machine_command_t;
+
+struct _machine_t {
+    flytec_t *flytec;
+    void (*callback)(void *, const machine_event_t *);
+    void *data;
+    machine_state_t state;
+    machine_command_t command;
+    long deadline;
+    char output[FLYTEC_LINE_MAX];
+    unsigned int output_len;
+    char line[FLYTEC_LINE_MAX];
+    int line_len;
+};
+
+/* returns 0 with errno set if out of memory */
+machine_t *machine_new(flytec_t *flytec, void (*callback)(void *, const machine_event_t *), void *data)
+{
+    machine_t *machine = tini_alloc(flytec->hooks, sizeof(machine_t));
+    if (!machine)
+	return 0;
+    machine->flytec = flytec;
+    machine->callback = callback;
+    machine->data = data;
+    return machine;
+}
+
+void machine_delete(machine_t *machine)
+{
+    if (machine)
+	tini_free(machine->flytec->hooks, machine);
+}
+
+static void machine_event(machine_t *machine, machine_event_type_t type, const track_t *track)
+{
+    machine_event_t event;
+    event.type = type;
+    event.line = machine->line;
+    event.len = machine->line_len;
+    event.track = track;
+    machine->callback(machine->data, &event);
+}
+
+static void machine_fail(machine_t *machine, int error, const char *message, ...) __attribute__ ((format(printf, 3, 4)));
+
+static void machine_fail(machine_t *machine, int error, const char *message, ...)
+{
+    flytec_t *flytec = machine->flytec;
+    va_list ap;
+    va_start(ap, message);
+    vsnprintf(flytec->error_message, sizeof flytec->error_message, message, ap);
+    va_end(ap);
+    flytec->error = error;
+    ++flytec->errors;
+    flytec_command_end(flytec);
+    flytec_log_error(flytec);
+    machine->state = machine_state_drain;
+    machine->line_len = 0;
+    machine_event(machine, MACHINE_ERROR, 0);
+}
+
+/* returns 1 if a command can be sent */
+int machine_ready(const machine_t *machine)
+{
+    return machine->state == machine_state_idle;
+}
+
+/* queues command, without its $ and checksum, for machine_output.  Returns
+ * -1 with errno set if a response is still expected or it is too long. */
+int machine_command(machine_t *machine, const char *command)
+{
+    if (machine->state != machine_state_idle) {
+	errno = EBUSY;
+	return -1;
+    }
+    int len = flytec_format_nmea(machine->flytec, command, machine->output + machine->output_len, sizeof machine->output - machine->output_len);
+    if (len == -1)
+	return -1;
+    machine->output_len += len;
+    if (!strcmp(command, "PBRSNP,")) {
+	machine->command = machine_command_pbrsnp;
+    } else if (!strcmp(command, "PBRTL,")) {
+	machine->command = machine_command_pbrtl;
+	flytec_clear_tracks(machine->flytec);
+    } else {
+	machine->command = machine_command_other;
+    }
+    machine->state = machine_state_xoff;
+    machine->line_len = 0;
+    machine->deadline = now_nsec() + 1000000L * flytec_timeout_ms(machine->flytec);
+    return 0;
+}
+
+/* returns the bytes waiting to be written, if any */
+const char *machine_output(const machine_t *machine, unsigned int *len)
+{
+    *len = machine->output_len;
+    return machine->output_len ? machine->output : 0;
+}
+
+void machine_written(machine_t *machine, unsigned int len)
+{
+    machine->output_len -= len;
+    memmove(machine->output, machine->output + len, machine->output_len);
+}
+
+static void machine_line(machine_t *machine)
+{
+    flytec_t *flytec = machine->flytec;
+    ++flytec->lines;
+    if (flytec->logfile)
+	fprintf(flytec->logfile, "< %s", machine->line);
+    machine_event(machine, MACHINE_LINE, 0);
+    if (machine->state != machine_state_response || machine->command == machine_command_other)
+	return;
+    if (!nmea_decode(machine->line)) {
+	machine_fail(machine, EPROTO, "invalid NMEA response");
+	return;
+    }
+    if (machine->command == machine_command_pbrsnp) {
+	if (flytec->snp)
+	    return;
+	snp_t *snp = snp_new(flytec->hooks, machine->line);
+	if (!snp && errno == ENOMEM) {
+	    machine_fail(machine, ENOMEM, "out of memory");
+	} else if (!snp) {
+	    machine_fail(machine, EPROTO, "invalid response");
+	} else if (flytec_set_snp(flytec, snp) == -1) {
+	    snp_delete(snp);
+	    machine_fail(machine, ENOMEM, "out of memory");
+	} else {
+	    machine_event(machine, MACHINE_SNP, 0);
+	}
+    } else {
+	int rc = flytec_add_track(flytec, machine->line);
+	if (rc == -1 && errno == ENOMEM)
+	    machine_fail(machine, ENOMEM, "out of memory");
+	else if (rc == -1)
+	    machine_fail(machine, EPROTO, "invalid response");
+	else if (rc == 0)
+	    machine_fail(machine, EPROTO, "inconsistent data");
+	else
+	    machine_event(machine, MACHINE_TRACK, flytec->trackv[flytec->trackc_received - 1]);
+    }
+}
+
+/* passes on a run of complete lines of a PBRTR or PBRIGC response where it
+ * lies in the caller's buffer */
+static void machine_lines(machine_t *machine, const char *p, int len)
+{
+    flytec_t *flytec = machine->flytec;
+    const char *line, *next;
+    for (line = p; line != p + len; line = next) {
+	next = (const char *) memchr(line, '\n', p + len - line) + 1;
+	++flytec->lines;
+	if (flytec->logfile)
+	    fprintf(flytec->logfile, "< %.*s", (int) (next - line), line);
+    }
+    machine_event_t event;
+    event.type = MACHINE_LINE;
+    event.line = p;
+    event.len = len;
+    event.track = 0;
+    machine->callback(machine->data, &event);
+}
+
+static const char *last_eol(const char *p, const char *end)
+{
+    while (end != p)
+	if (*--end == '\n')
+	    return end;
+    return 0;
+}
+
+static void machine_complete(machine_t *machine)
+{
+    flytec_t *flytec = machine->flytec;
+    if (machine->command == machine_command_pbrsnp && !flytec->snp) {
+	machine_fail(machine, EPROTO, "empty response");
+	return;
+    }
+    if (machine->command == machine_command_pbrtl && flytec->trackc_received != flytec->trackc) {
+	machine_fail(machine, EPROTO, "inconsistent data");
+	return;
+    }
+    flytec_command_end(flytec);
+    machine->state = machine_state_idle;
+    machine->deadline = 0;
+    machine_event(machine, MACHINE_COMPLETE, 0);
+}
+
+/* consumes len bytes read from the FR.  Runs of complete lines in responses
+ * that are not parsed are delivered without copying, everything else a
+ * byte at a time. */
+void machine_input(machine_t *machine, const char *p, unsigned int len)
+{
+    if (len)
+	machine->deadline = now_nsec() + 1000000L * flytec_timeout_ms(machine->flytec);
+    const char *end = p + len;
+    for (; p != end; ++p) {
+	if (machine->state == machine_state_response && machine->command == machine_command_other && machine->line_len == 0 && *p != XON) {
+	    const char *xon = memchr(p, XON, end - p);
+	    const char *eol = last_eol(p, xon ? xon : end);
+	    if (eol) {
+		machine_lines(machine, p, eol + 1 - p);
+		p = eol;
+		continue;
+	    }
+	}
+	switch (machine->state) {
+	    case machine_state_idle:
+		machine_fail(machine, EPROTO, "unexpected character");
+		break;
+	    case machine_state_xoff:
+		if (*p == XOFF) {
+		    machine->state = machine_state_response;
+		    machine_event(machine, MACHINE_XOFF, 0);
+		} else {
+		    machine_fail(machine, EPROTO, "unexpected character");
+		}
+		break;
+	    case machine_state_response:
+		if (machine->line_len == 0 && *p == XON) {
+		    machine_complete(machine);
+		} else if (machine->line_len == sizeof machine->line - 1) {
+		    machine_fail(machine, EPROTO, "line too long");
+		} else {
+		    machine->line[machine->line_len++] = *p;
+		    if (*p == '\n') {
+			machine->line[machine->line_len] = '\0';
+			machine_line(machine);
+			machine->line_len = 0;
+		    }
+		}
+		break;
+	    case machine_state_drain:
+		if (*p == XON) {
+		    machine->state = machine_state_idle;
+		    machine->deadline = 0;
+		}
+		break;
+	}
+    }
+}
+
+/* returns when, on the now_nsec clock, machine_expire should be called, or
+ * 0 if nothing is expected from the FR */
+long machine_deadline(const machine_t *machine)
+{
+    return machine->deadline;
+}
+
+/* fails the current command if the deadline has passed by now, and ends
+ * the discarding of input after an error */
+void machine_expire(machine_t *machine, long now)
+{
+    if (!machine->deadline || now < machine->deadline)
+	return;
+    if (machine->state == machine_state_drain) {
+	machine->state = machine_state_idle;
+	machine->deadline = 0;
+    } else {
+	flytec_timed_out(machine->flytec);
+	/* the drain only waits out a gap between reads */
+	__atomic_store_n(&machine->flytec->awaiting_first_byte, 0, __ATOMIC_RELAXED);
+	machine->deadline = now + 1000000L * flytec_timeout_ms(machine->flytec);
+	machine_fail(machine, ETIMEDOUT, "timeout waiting for data");
+    }
+}
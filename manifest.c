@@ -0,0 +1,375 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "tini.h"
+
+/* The manifest is a text file with one line per downloaded tracklog:
+ *	SERIAL_NUMBER TIME DURATION FILENAME
+ * where TIME is the start time in seconds since the epoch and DURATION is
+ * in seconds.  Entries are kept sorted by fingerprint and filenames are
+ * kept in a separate sorted index so both lookups are binary searches. */
+
+static int manifest_entry_compare(const void *a, const void *b)
+{
+    const manifest_entry_t *ea = a, *eb = b;
+    if (ea->serial_number != eb->serial_number)
+	return ea->serial_number < eb->serial_number ? -1 : 1;
+    if (ea->time != eb->time)
+	return ea->time < eb->time ? -1 : 1;
+    if (ea->duration != eb->duration)
+	return ea->duration < eb->duration ? -1 : 1;
+    return 0;
+}
+
+static int filename_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void manifest_insert_filename(manifest_t *manifest, char *filename)
+{
+    int lo = 0, hi = manifest->filenamec;
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (strcmp(manifest->filenamev[mid], filename) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (manifest->filenamec == manifest->filename_capacity) {
+	manifest->filename_capacity = manifest->filename_capacity ? 2 * manifest->filename_capacity : 64;
+	manifest->filenamev = realloc(manifest->filenamev, manifest->filename_capacity * sizeof(char *));
+	if (!manifest->filenamev)
+	    DIE("realloc", errno);
+    }
+    memmove(manifest->filenamev + lo + 1, manifest->filenamev + lo, (manifest->filenamec - lo) * sizeof(char *));
+    manifest->filenamev[lo] = filename;
+    ++manifest->filenamec;
+}
+
+static void manifest_insert(manifest_t *manifest, const manifest_entry_t *entry)
+{
+    int lo = 0, hi = manifest->entryc;
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (manifest_entry_compare(manifest->entryv + mid, entry) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (manifest->entryc == manifest->entry_capacity) {
+	manifest->entry_capacity = manifest->entry_capacity ? 2 * manifest->entry_capacity : 64;
+	manifest->entryv = realloc(manifest->entryv, manifest->entry_capacity * sizeof(manifest_entry_t));
+	if (!manifest->entryv)
+	    DIE("realloc", errno);
+    }
+    memmove(manifest->entryv + lo + 1, manifest->entryv + lo, (manifest->entryc - lo) * sizeof(manifest_entry_t));
+    manifest->entryv[lo] = *entry;
+    ++manifest->entryc;
+}
+
+/* returns 0 with errno set if the manifest cannot be read, EINVAL if it is
+ * corrupt */
+manifest_t *manifest_load(const char *directory)
+{
+    manifest_t *manifest = alloc(sizeof(manifest_t));
+    manifest->directory = directory;
+    manifest->path = alloc(strlen(directory) + strlen(MANIFEST_FILENAME) + 2);
+    sprintf(manifest->path, "%s/%s", directory, MANIFEST_FILENAME);
+    FILE *file = fopen(manifest->path, "r");
+    if (!file) {
+	if (errno != ENOENT) {
+	    int _errno = errno;
+	    manifest_delete(manifest);
+	    errno = _errno;
+	    return 0;
+	}
+	manifest->legacy = 1;
+	return manifest;
+    }
+    manifest->exists = 1;
+    char line[1024];
+    while (fgets(line, sizeof line, file)) {
+	if (line[0] == '#')
+	    continue;
+	manifest_entry_t entry;
+	long time;
+	int n = 0;
+	if (sscanf(line, "%d %ld %d %n", &entry.serial_number, &time, &entry.duration, &n) != 3 || n == 0) {
+	    fclose(file);
+	    manifest_delete(manifest);
+	    errno = EINVAL;
+	    return 0;
+	}
+	char *eol = strchr(line + n, '\n');
+	if (eol)
+	    *eol = '\0';
+	entry.time = time;
+	entry.filename = alloc(strlen(line + n) + 1);
+	strcpy(entry.filename, line + n);
+	if (manifest->entryc == manifest->entry_capacity) {
+	    manifest->entry_capacity = manifest->entry_capacity ? 2 * manifest->entry_capacity : 64;
+	    manifest->entryv = realloc(manifest->entryv, manifest->entry_capacity * sizeof(manifest_entry_t));
+	    if (!manifest->entryv)
+		DIE("realloc", errno);
+	}
+	manifest->entryv[manifest->entryc++] = entry;
+    }
+    if (ferror(file)) {
+	int _errno = errno;
+	fclose(file);
+	manifest_delete(manifest);
+	errno = _errno;
+	return 0;
+    }
+    fclose(file);
+    qsort(manifest->entryv, manifest->entryc, sizeof(manifest_entry_t), manifest_entry_compare);
+    manifest->filename_capacity = manifest->entryc;
+    manifest->filenamev = alloc((manifest->filename_capacity + 1) * sizeof(char *));
+    int i;
+    for (i = 0; i < manifest->entryc; ++i)
+	manifest->filenamev[i] = manifest->entryv[i].filename;
+    manifest->filenamec = manifest->entryc;
+    qsort(manifest->filenamev, manifest->filenamec, sizeof(char *), filename_compare);
+    return manifest;
+}
+
+void manifest_delete(manifest_t *manifest)
+{
+    if (manifest) {
+	int i;
+	for (i = 0; i < manifest->entryc; ++i)
+	    free(manifest->entryv[i].filename);
+	free(manifest->entryv);
+	for (i = 0; i < manifest->reservedc; ++i)
+	    free(manifest->reservedv[i]);
+	free(manifest->reservedv);
+	free(manifest->filenamev);
+	free(manifest->path);
+	free(manifest);
+    }
+}
+
+const char *manifest_find(const manifest_t *manifest, int serial_number, const track_t *track)
+{
+    manifest_entry_t key;
+    key.serial_number = serial_number;
+    key.time = track->time;
+    key.duration = track->duration;
+    const manifest_entry_t *entry = bsearch(&key, manifest->entryv, manifest->entryc, sizeof(manifest_entry_t), manifest_entry_compare);
+    return entry ? entry->filename : 0;
+}
+
+int manifest_filename_used(const manifest_t *manifest, const char *filename)
+{
+    return bsearch(&filename, manifest->filenamev, manifest->filenamec, sizeof(char *), filename_compare) != 0;
+}
+
+static void manifest_reserve(manifest_t *manifest, const char *filename)
+{
+    char *copy = alloc(strlen(filename) + 1);
+    strcpy(copy, filename);
+    manifest->reservedv = realloc(manifest->reservedv, (manifest->reservedc + 1) * sizeof(char *));
+    if (!manifest->reservedv)
+	DIE("realloc", errno);
+    manifest->reservedv[manifest->reservedc++] = copy;
+    manifest_insert_filename(manifest, copy);
+}
+
+/* returns 1 if track is already in the manifest, otherwise assigns it a
+ * filename and returns 0, or -1 with errno set */
+int manifest_resolve(manifest_t *manifest, int serial_number, track_t *track, const char *manufacturer, igc_filename_format_t filename_format)
+{
+    const char *filename = manifest_find(manifest, serial_number, track);
+    if (filename) {
+	free(track->igc_filename);
+	track->igc_filename = alloc(strlen(filename) + 1);
+	strcpy(track->igc_filename, filename);
+	return 1;
+    }
+    if (manifest->legacy) {
+	/* first use in an existing archive, adopt files downloaded before
+	 * the manifest was introduced */
+	char *path = alloc(strlen(manifest->directory) + strlen(track->igc_filename) + 2);
+	sprintf(path, "%s/%s", manifest->directory, track->igc_filename);
+	struct stat buf;
+	int rc = stat(path, &buf);
+	int _errno = errno;
+	free(path);
+	if (rc == -1 && _errno != ENOENT) {
+	    errno = _errno;
+	    return -1;
+	}
+	if (rc == 0 && !manifest_filename_used(manifest, track->igc_filename))
+	    return manifest_add(manifest, serial_number, track, track->igc_filename) == -1 ? -1 : 1;
+    }
+    return manifest_assign(manifest, serial_number, track, manufacturer, filename_format);
+}
+
+/* moves track on to the next free day index, returns -1 with errno set to
+ * EEXIST if there is none */
+int manifest_assign(manifest_t *manifest, int serial_number, track_t *track, const char *manufacturer, igc_filename_format_t filename_format)
+{
+    /* the short filename format cannot represent more than 35 flights a day */
+    int day_index_max = filename_format == igc_filename_format_short ? 35 : 99;
+    while (manifest_filename_used(manifest, track->igc_filename)) {
+	if (track->day_index == day_index_max) {
+	    errno = EEXIST;
+	    return -1;
+	}
+	++track->day_index;
+	if (track_set_igc_filename(track, manufacturer, serial_number, filename_format) == -1)
+	    DIE("malloc", errno);
+    }
+    manifest_reserve(manifest, track->igc_filename);
+    return 0;
+}
+
+/* records filename as the download of track, returns -1 with errno set if
+ * the manifest file cannot be written */
+int manifest_add(manifest_t *manifest, int serial_number, const track_t *track, const char *filename)
+{
+    manifest_entry_t entry;
+    entry.serial_number = serial_number;
+    entry.time = track->time;
+    entry.duration = track->duration;
+    if (bsearch(&entry, manifest->entryv, manifest->entryc, sizeof(manifest_entry_t), manifest_entry_compare))
+	return 0;
+    entry.filename = alloc(strlen(filename) + 1);
+    strcpy(entry.filename, filename);
+    manifest_insert(manifest, &entry);
+    if (!manifest_filename_used(manifest, entry.filename))
+	manifest_insert_filename(manifest, entry.filename);
+    FILE *file = fopen(manifest->path, "a");
+    if (!file)
+	return -1;
+    int rc = 0;
+    if (!manifest->exists && fprintf(file, "# tini manifest: serial_number time duration filename\n") < 0)
+	rc = -1;
+    else if (fprintf(file, "%d %ld %d %s\n", entry.serial_number, (long) entry.time, entry.duration, entry.filename) < 0)
+	rc = -1;
+    int _errno = errno;
+    if (fclose(file) == EOF && rc == 0)
+	return -1;
+    if (rc == 0)
+	manifest->exists = 1;
+    errno = _errno;
+    return rc;
+}
+
+/* picks claim->filename for claim->track, under claim->directory if it is
+ * not null: its name in the manifest or else the first day index that is
+ * free.  The other fields must be set.  Returns -1 with errno set. */
+int manifest_claim(manifest_claim_t *claim)
+{
+    track_t *track = claim->track;
+    claim->ours = manifest_find(claim->manifest, claim->serial_number, track) != 0;
+    while (1) {
+	free(claim->filename);
+	claim->filename = track_filename(track, claim->directory, claim->track_format);
+	struct stat st;
+	if (claim->ours || lstat(claim->filename, &st) == -1)
+	    break;
+	if (manifest_assign(claim->manifest, claim->serial_number, track, claim->manufacturer, claim->igc_filename_format) == -1)
+	    return -1;
+    }
+    if (!claim->ours && errno != ENOENT)
+	return -1;
+    free(claim->temp);
+    claim->temp = temp_filename(claim->filename);
+    return 0;
+}
+
+/* renames from to to unless to exists, with a hard link where the file
+ * system cannot rename without replacing */
+static int rename_noreplace(const char *from, const char *to)
+{
+    if (renameat2(AT_FDCWD, from, AT_FDCWD, to, RENAME_NOREPLACE) == 0)
+	return 0;
+    if (errno != EINVAL && errno != ENOSYS)
+	return -1;
+    if (link(from, to) == -1)
+	return -1;
+    unlink(from);
+    return 0;
+}
+
+/* moves the completed claim->temp to claim->filename.  Only a name that the
+ * manifest already gives the tracklog is replaced: any other name can have
+ * been taken since manifest_claim, by another tini writing to the same
+ * directory, so the tracklog moves on to the next free day index instead.
+ * Returns -1 with errno set. */
+int manifest_publish(manifest_claim_t *claim)
+{
+    if (claim->ours)
+	return rename(claim->temp, claim->filename);
+    while (rename_noreplace(claim->temp, claim->filename) == -1) {
+	if (errno != EEXIST)
+	    return -1;
+	if (manifest_assign(claim->manifest, claim->serial_number, claim->track, claim->manufacturer, claim->igc_filename_format) == -1)
+	    return -1;
+	free(claim->filename);
+	claim->filename = track_filename(claim->track, claim->directory, claim->track_format);
+    }
+    return 0;
+}
+
+void manifest_claim_free(manifest_claim_t *claim)
+{
+    free(claim->filename);
+    claim->filename = 0;
+    free(claim->temp);
+    claim->temp = 0;
+}
+
+/* returns the path a tracklog is stored at, the manifest always records the
+ * IGC filename */
+char *track_filename(const track_t *track, const char *directory, track_format_t track_format)
+{
+    const char *suffix = "";
+    switch (track_format) {
+	case track_format_tnb:
+	    suffix = TNB_SUFFIX;
+	    break;
+	case track_format_gpx:
+	    suffix = GPX_SUFFIX;
+	    break;
+	case track_format_kml:
+	    suffix = KML_SUFFIX;
+	    break;
+	default:
+	    break;
+    }
+    char *filename = alloc((directory ? strlen(directory) + 1 : 0) + strlen(track->igc_filename) + strlen(suffix) + 1);
+    if (directory)
+	sprintf(filename, "%s/%s%s", directory, track->igc_filename, suffix);
+    else
+	sprintf(filename, "%s%s", track->igc_filename, suffix);
+    return filename;
+}
@@ -0,0 +1,648 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "tini.h"
+
+typedef enum {
+    device_state_pbrsnp,
+    device_state_pbrtl,
+    device_state_pbrtr,
+    device_state_drain,
+    device_state_done,
+    device_state_failed,
+} device_state_t;
+
+typedef struct {
+    multi_t *multi;
+    char *name;
+    flytec_t *flytec;
+    machine_t *machine;
+    device_state_t state;
+    int index;
+    char *directory;
+    manifest_t *manifest;
+    int *downloaded;
+    manifest_claim_t claim;
+    FILE *file;
+    tnb_encoder_t *tnb;
+    export_encoder_t *export;
+    archive_object_t *object;
+    progress_t progress;
+    int count;
+    int failed;
+    device_state_t resume;
+    int attempt;
+    long resume_nsec;
+} device_t;
+
+/* manifests outlive the devices that load them so that an FR that comes
+ * back to a long running watch does not read its manifest again */
+struct _multi_t {
+    const download_options_t *options;
+    device_t **devicev;
+    int devicec;
+    struct pollfd *pollfds;
+    int pollfd_capacity;
+    char **directoryv;
+    manifest_t **manifestv;
+    int manifestc;
+    int failures;
+};
+
+/* throws away the tracklog being downloaded */
+static void device_discard(device_t *device)
+{
+    if (device->file) {
+	fclose(device->file);
+	device->file = 0;
+	unlink(device->claim.temp);
+    }
+    archive_object_delete(device->object);
+    device->object = 0;
+    tnb_encoder_delete(device->tnb);
+    device->tnb = 0;
+    export_encoder_delete(device->export);
+    device->export = 0;
+}
+
+static void device_fail(device_t *device, const char *message, ...) __attribute__ ((format(printf, 2, 3)));
+
+static void device_fail(device_t *device, const char *message, ...)
+{
+    char buf[256];
+    va_list ap;
+    va_start(ap, message);
+    vsnprintf(buf, sizeof buf, message, ap);
+    va_end(ap);
+    fprintf(stderr, "%s: %s: %s\n", program_name, device->flytec->device, buf);
+    if (device->progress.track)
+	progress_error(&device->progress, buf, 1);
+    device_discard(device);
+    device->state = device_state_failed;
+}
+
+/* writes as much of the machine's output as the device takes now, the rest
+ * once poll says that it can take more */
+static void device_flush(device_t *device)
+{
+    flytec_t *flytec = device->flytec;
+    unsigned int len;
+    const char *output = machine_output(device->machine, &len);
+    if (!output)
+	return;
+    int n = flytec->transport->write(flytec, output, len);
+    if (n == -1) {
+	if (errno != EAGAIN)
+	    device_fail(device, "write: %s", strerror(errno));
+	return;
+    }
+    machine_written(device->machine, n);
+}
+
+static void device_send(device_t *device, const char *command, device_state_t state)
+{
+    if (machine_command(device->machine, command) == -1) {
+	device_fail(device, "%s: %s", command, strerror(errno));
+	return;
+    }
+    device->state = state;
+    device_flush(device);
+}
+
+static void device_next_track(device_t *device, const download_options_t *options)
+{
+    flytec_t *flytec = device->flytec;
+    for (; device->index < flytec->trackc; ++device->index) {
+	track_t *track = flytec->trackv[device->index];
+	if (device->downloaded[device->index])
+	    continue;
+	manifest_claim_t *claim = &device->claim;
+	manifest_claim_free(claim);
+	claim->manifest = device->manifest;
+	claim->serial_number = flytec->serial_number;
+	claim->track = track;
+	claim->manufacturer = options->manufacturer ? options->manufacturer : flytec->manufacturer;
+	claim->igc_filename_format = options->igc_filename_format;
+	claim->directory = device->directory;
+	claim->track_format = options->track_format;
+	if (manifest_claim(claim) == -1) {
+	    device_fail(device, "%s: %s", claim->filename ? claim->filename : track->igc_filename, strerror(errno));
+	    return;
+	}
+	if (options->archive) {
+	    device->object = archive_object_new();
+	} else {
+	    int fd = open(device->claim.temp, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+	    if (fd == -1) {
+		device_fail(device, "open: %s: %s", device->claim.temp, strerror(errno));
+		return;
+	    }
+	    device->file = fdopen(fd, "w");
+	    if (!device->file)
+		DIE("fdopen", errno);
+	    if (setvbuf(device->file, 0, _IOFBF, options->write_buffer))
+		DIE("setvbuf", errno);
+	}
+	if (options->track_format == track_format_tnb)
+	    device->tnb = tnb_encoder_new();
+	else if (options->track_format == track_format_gpx || options->track_format == track_format_kml)
+	    device->export = export_encoder_new(options->track_format);
+	if (!options->quiet)
+	    fprintf(stderr, "%s: %s: downloading %s\n", program_name, flytec->device, device->claim.filename);
+	progress_start(&device->progress, options->progress_fd, 0, flytec->device, track, device->claim.filename);
+	char command[9];
+	if (snprintf(command, sizeof command, "PBRTR,%02d", track->index) != 8)
+	    DIE("snprintf", 0);
+	++device->index;
+	device_send(device, command, device_state_pbrtr);
+	return;
+    }
+    device->state = device_state_done;
+    if (device->count && sync_session(options->archive ? options->archive : device->directory, options->sync_policy) == -1)
+	fprintf(stderr, "%s: %s: sync: %s\n", program_name, flytec->device, strerror(errno));
+    if (!options->quiet)
+	download_report(flytec, 1, device->count, device->failed);
+}
+
+/* returns 0 if the write failed */
+static int device_write(device_t *device, const char *buf, int len)
+{
+    if (device->object) {
+	archive_object_write(device->object, buf, len);
+    } else if (fwrite(buf, 1, len, device->file) != (size_t) len) {
+	device_fail(device, "fwrite: %s: %s", device->claim.filename, strerror(errno));
+	return 0;
+    }
+    return 1;
+}
+
+/* returns 0 if the write failed */
+static int device_flush_export(device_t *device)
+{
+    export_encoder_t *export = device->export;
+    if (!device_write(device, export->buf, export->len))
+	return 0;
+    export->len = 0;
+    return 1;
+}
+
+static void device_line(device_t *device, const char *line, int len)
+{
+    flytec_t *flytec = device->flytec;
+    long write_nsec = now_nsec();
+    if (device->tnb) {
+	tnb_encode(device->tnb, line, len);
+	if (device_write(device, device->tnb->buf, device->tnb->len))
+	    device->tnb->len = 0;
+    } else if (device->export) {
+	export_encode(device->export, line, len);
+	if (device->export->len >= EXPORT_BLOCK)
+	    device_flush_export(device);
+    } else {
+	device_write(device, line, len);
+    }
+    progress_bytes(&device->progress, line, len);
+    flytec->write_nsec += now_nsec() - write_nsec;
+}
+
+static manifest_t *multi_manifest(multi_t *multi, const char *directory)
+{
+    int i;
+    for (i = 0; i < multi->manifestc; ++i)
+	if (!strcmp(multi->directoryv[i], directory))
+	    return multi->manifestv[i];
+    if (multi->manifestc % 16 == 0) {
+	multi->directoryv = realloc(multi->directoryv, (multi->manifestc + 16) * sizeof(char *));
+	multi->manifestv = realloc(multi->manifestv, (multi->manifestc + 16) * sizeof(manifest_t *));
+	if (!multi->directoryv || !multi->manifestv)
+	    DIE("realloc", errno);
+    }
+    char *copy = alloc(strlen(directory) + 1);
+    strcpy(copy, directory);
+    manifest_t *manifest = manifest_load(copy);
+    if (!manifest) {
+	int _errno = errno;
+	free(copy);
+	errno = _errno;
+	return 0;
+    }
+    multi->directoryv[multi->manifestc] = copy;
+    return multi->manifestv[multi->manifestc++] = manifest;
+}
+
+static void device_complete(device_t *device, const download_options_t *options)
+{
+    flytec_t *flytec = device->flytec;
+    switch (device->state) {
+	case device_state_pbrsnp:
+	    {
+		const char *manufacturer = options->manufacturer ? options->manufacturer : flytec->manufacturer;
+		free(device->directory);
+		device->directory = alloc(strlen(manufacturer) + 16);
+		sprintf(device->directory, "%s-%d", manufacturer, flytec->serial_number);
+	    }
+	    if (mkdir(device->directory, 0777) == -1 && errno != EEXIST) {
+		device_fail(device, "mkdir: %s: %s", device->directory, strerror(errno));
+		break;
+	    }
+	    device->manifest = multi_manifest(device->multi, device->directory);
+	    if (!device->manifest) {
+		device_fail(device, "%s/%s: %s", device->directory, MANIFEST_FILENAME, strerror(errno));
+		break;
+	    }
+	    device_send(device, "PBRTL,", device_state_pbrtl);
+	    break;
+	case device_state_pbrtl:
+	    if (flytec_set_igc_filenames(flytec, options->manufacturer, options->igc_filename_format) == -1)
+		DIE("malloc", errno);
+	    device->downloaded = alloc((flytec->trackc + 1) * sizeof(int));
+	    /* resolve oldest first, as tini_download does */
+	    int i;
+	    for (i = flytec->trackc - 1; i >= 0; --i) {
+		track_t *track = flytec->trackv[i];
+		if (options->indexes && !set_include(options->indexes, track->index + 1))
+		    device->downloaded[i] = 1;
+		else if (!filter_match(options->filter, flytec->serial_number, track->time, track->duration))
+		    device->downloaded[i] = 1;
+		else {
+		    int rc = manifest_resolve(device->manifest, flytec->serial_number, track, options->manufacturer ? options->manufacturer : flytec->manufacturer, options->igc_filename_format);
+		    if (rc == -1) {
+			device_fail(device, "%s: %s", track->igc_filename, strerror(errno));
+			return;
+		    }
+		    if (rc)
+			device->downloaded[i] = !options->overwrite;
+		}
+	    }
+	    device_next_track(device, options);
+	    break;
+	case device_state_pbrtr:
+	    if (device->tnb) {
+		if (!device_write(device, device->tnb->buf, device->tnb->len))
+		    break;
+		tnb_encoder_delete(device->tnb);
+		device->tnb = 0;
+	    }
+	    if (device->export) {
+		export_finish(device->export);
+		if (!device_flush_export(device))
+		    break;
+		export_encoder_delete(device->export);
+		device->export = 0;
+	    }
+	    long close_nsec = now_nsec();
+	    if (device->object) {
+		int rc = archive_object_link(device->object, options->archive, device->claim.temp, options->sync_policy);
+		if (rc == -1) {
+		    device_fail(device, "archive: %s: %s", device->claim.filename, strerror(errno));
+		    break;
+		}
+		if (manifest_publish(&device->claim) == -1) {
+		    unlink(device->claim.temp);
+		    device_fail(device, "rename: %s: %s", device->claim.temp, strerror(errno));
+		    break;
+		}
+		flytec->close_nsec += now_nsec() - close_nsec;
+		if (flytec->logfile)
+		    fprintf(flytec->logfile, "# archive: %s: %s\n", device->claim.filename, rc ? "stored" : "duplicate");
+		archive_object_delete(device->object);
+		device->object = 0;
+	    } else {
+		int rc = fflush(device->file);
+		if (rc == 0 && options->sync_policy == sync_policy_file)
+		    rc = fdatasync(fileno(device->file));
+		if (rc) {
+		    device_fail(device, "write: %s: %s", device->claim.temp, strerror(errno));
+		    break;
+		}
+		rc = fclose(device->file);
+		device->file = 0;
+		if (rc == 0)
+		    rc = manifest_publish(&device->claim);
+		flytec->close_nsec += now_nsec() - close_nsec;
+		if (rc) {
+		    unlink(device->claim.temp);
+		    device_fail(device, "close: %s: %s", device->claim.filename, strerror(errno));
+		    break;
+		}
+	    }
+	    progress_done(&device->progress, device->claim.filename);
+	    device->progress.track = 0;
+	    ++device->count;
+	    if (manifest_add(device->manifest, flytec->serial_number, flytec->trackv[device->index - 1], flytec->trackv[device->index - 1]->igc_filename) == -1) {
+		device_fail(device, "%s/%s: %s", device->directory, MANIFEST_FILENAME, strerror(errno));
+		break;
+	    }
+	    device_next_track(device, options);
+	    break;
+	default:
+	    break;
+    }
+}
+
+/* after a timeout or a garbled response the machine drains the rest of it
+ * and the command is sent again, backing off as flytec_retry does.  A
+ * tracklog that still cannot be downloaded is given up on and the next one
+ * started. */
+static void device_error(device_t *device)
+{
+    flytec_t *flytec = device->flytec;
+    if (flytec->error != ETIMEDOUT && flytec->error != EPROTO) {
+	device_fail(device, "%s", flytec->error_message);
+	return;
+    }
+    if (device->attempt == FLYTEC_RETRIES) {
+	if (device->state != device_state_pbrtr) {
+	    device_fail(device, "%s", flytec->error_message);
+	    return;
+	}
+	fprintf(stderr, "%s: %s: %s, giving up on %s\n", program_name, flytec->device, flytec->error_message, device->claim.filename);
+	progress_error(&device->progress, flytec->error_message, 1);
+	device->progress.track = 0;
+	device_discard(device);
+	++flytec->abandoned;
+	++device->failed;
+	device->attempt = 0;
+	/* go on with the next tracklog */
+	device->resume = device_state_done;
+	device->resume_nsec = 0;
+    } else {
+	tini_log(flytec->hooks, flytec->device, "%s, retrying", flytec->error_message);
+	if (device->state == device_state_pbrtr) {
+	    progress_error(&device->progress, flytec->error_message, 0);
+	    device_discard(device);
+	}
+	device->resume = device->state;
+	device->resume_nsec = now_nsec() + 1000000L * (FLYTEC_BACKOFF_MS << device->attempt);
+	++device->attempt;
+	++flytec->retries;
+    }
+    device->state = device_state_drain;
+}
+
+/* sends the failed command again, or starts the next tracklog, once the
+ * machine has drained and the backoff has passed */
+static void device_resume(device_t *device, long now)
+{
+    if (device->state != device_state_drain || !machine_ready(device->machine) || now < device->resume_nsec)
+	return;
+    const download_options_t *options = device->multi->options;
+    switch (device->resume) {
+	case device_state_pbrsnp:
+	    device_send(device, "PBRSNP,", device_state_pbrsnp);
+	    break;
+	case device_state_pbrtl:
+	    device_send(device, "PBRTL,", device_state_pbrtl);
+	    break;
+	case device_state_pbrtr:
+	    --device->index;
+	    device_next_track(device, options);
+	    break;
+	default:
+	    device_next_track(device, options);
+	    break;
+    }
+}
+
+static void device_event(void *data, const machine_event_t *event)
+{
+    device_t *device = data;
+    if (device->state == device_state_done || device->state == device_state_failed)
+	return;
+    switch (event->type) {
+	case MACHINE_LINE:
+	    if (device->state == device_state_pbrtr)
+		device_line(device, event->line, event->len);
+	    break;
+	case MACHINE_COMPLETE:
+	    if (device->attempt) {
+		++device->flytec->recoveries;
+		device->attempt = 0;
+	    }
+	    device_complete(device, device->multi->options);
+	    break;
+	case MACHINE_ERROR:
+	    device_error(device);
+	    break;
+	default:
+	    break;
+    }
+}
+
+multi_t *multi_new(const download_options_t *options)
+{
+    multi_t *multi = alloc(sizeof(multi_t));
+    multi->options = options;
+    return multi;
+}
+
+/* opens the device and starts talking to it, returns -1 with errno set if
+ * the device cannot be opened */
+int multi_add(multi_t *multi, const char *name)
+{
+    device_t *device = alloc(sizeof(device_t));
+    device->multi = multi;
+    device->name = alloc(strlen(name) + 1);
+    strcpy(device->name, name);
+    device->flytec = flytec_open(device->name, multi->options->logfile, &tini_hooks);
+    if (!device->flytec) {
+	int _errno = errno;
+	free(device->name);
+	free(device);
+	errno = _errno;
+	return -1;
+    }
+    device->machine = machine_new(device->flytec, device_event, device);
+    if (!device->machine)
+	DIE("malloc", errno);
+    device->flytec->statsfile = multi->options->statsfile;
+    flytec_set_timing(device->flytec, multi->options->first_byte_ms, multi->options->inter_byte_ms);
+    flytec_set_capture(device->flytec, multi->options->capture);
+    /* reads are driven by poll, so VMIN batching does not apply */
+    int flags = fcntl(device->flytec->fd, F_GETFL);
+    if (flags == -1 || fcntl(device->flytec->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	DIE("fcntl", errno);
+    if (multi->devicec % 16 == 0) {
+	multi->devicev = realloc(multi->devicev, (multi->devicec + 16) * sizeof(device_t *));
+	if (!multi->devicev)
+	    DIE("realloc", errno);
+    }
+    multi->devicev[multi->devicec++] = device;
+    device_send(device, "PBRSNP,", device_state_pbrsnp);
+    return 0;
+}
+
+/* returns 1 if a device called name is being downloaded */
+int multi_busy(const multi_t *multi, const char *name)
+{
+    int i;
+    for (i = 0; i < multi->devicec; ++i)
+	if (!strcmp(multi->devicev[i]->name, name))
+	    return 1;
+    return 0;
+}
+
+int multi_devicec(const multi_t *multi)
+{
+    return multi->devicec;
+}
+
+static void device_delete(device_t *device)
+{
+    manifest_claim_free(&device->claim);
+    free(device->downloaded);
+    free(device->directory);
+    machine_delete(device->machine);
+    flytec_delete(device->flytec);
+    free(device->name);
+    free(device);
+}
+
+/* waits for input from the devices and, if fd is not -1, for fd to become
+ * readable, returns 1 if it did.  Finished devices are closed. */
+int multi_poll(multi_t *multi, int fd)
+{
+    if (multi->pollfd_capacity < multi->devicec + 1) {
+	multi->pollfd_capacity = multi->devicec + 16;
+	free(multi->pollfds);
+	multi->pollfds = alloc(multi->pollfd_capacity * sizeof(struct pollfd));
+    }
+    struct pollfd *pollfds = multi->pollfds;
+    long now = now_nsec();
+    int timeout = -1;
+    int i;
+    for (i = 0; i < multi->devicec; ++i) {
+	device_t *device = multi->devicev[i];
+	unsigned int pending;
+	machine_output(device->machine, &pending);
+	pollfds[i].fd = device->flytec->fd;
+	pollfds[i].events = pending ? POLLIN | POLLOUT : POLLIN;
+	pollfds[i].revents = 0;
+	long deadline = machine_deadline(device->machine);
+	if (!deadline && device->state == device_state_drain)
+	    deadline = device->resume_nsec;
+	if (!deadline)
+	    continue;
+	/* round up so that poll does not return just before the deadline */
+	int remaining = deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+	if (timeout == -1 || remaining < timeout)
+	    timeout = remaining;
+    }
+    pollfds[i].fd = fd;
+    pollfds[i].events = POLLIN;
+    pollfds[i].revents = 0;
+    int rc = poll(pollfds, multi->devicec + (fd != -1), timeout);
+    if (rc == -1) {
+	if (errno == EINTR)
+	    return 0;
+	DIE("poll", errno);
+    }
+    for (i = 0; i < multi->devicec; ++i) {
+	device_t *device = multi->devicev[i];
+	flytec_t *flytec = device->flytec;
+	if (pollfds[i].revents & POLLOUT) {
+	    device_flush(device);
+	    if (device->state == device_state_failed)
+		continue;
+	}
+	if (pollfds[i].revents & ~POLLOUT) {
+	    int n = flytec->transport->read(flytec);
+	    if (n <= 0)
+		++flytec->reads;
+	    if (n == -1 && errno == EAGAIN)
+		continue;
+	    if (n == -1) {
+		device_fail(device, "read: %s", strerror(errno));
+	    } else if (n == 0) {
+		device_fail(device, "device disconnected");
+	    } else {
+		flytec_count_read(flytec, n);
+		while (!RING_EMPTY(flytec->ring)) {
+		    unsigned int len;
+		    const char *p = ring_peek(flytec->ring, &len);
+		    machine_input(device->machine, p, len);
+		    ring_consume(flytec->ring, len);
+		}
+	    }
+	} else {
+	    machine_expire(device->machine, now_nsec());
+	}
+	device_resume(device, now_nsec());
+    }
+    int readable = fd != -1 && pollfds[multi->devicec].revents;
+    /* close finished devices, keeping the others in order */
+    int j = 0;
+    for (i = 0; i < multi->devicec; ++i) {
+	device_t *device = multi->devicev[i];
+	if (device->state == device_state_done || device->state == device_state_failed) {
+	    if (device->state == device_state_failed)
+		++multi->failures;
+	    multi->failures += device->failed;
+	    device_delete(device);
+	} else {
+	    multi->devicev[j++] = device;
+	}
+    }
+    multi->devicec = j;
+    return readable;
+}
+
+/* returns the number of devices and tracklogs that failed */
+int multi_delete(multi_t *multi)
+{
+    int i;
+    for (i = 0; i < multi->devicec; ++i)
+	device_delete(multi->devicev[i]);
+    int failures = multi->failures;
+    for (i = 0; i < multi->manifestc; ++i) {
+	free(multi->directoryv[i]);
+	manifest_delete(multi->manifestv[i]);
+    }
+    free(multi->directoryv);
+    free(multi->manifestv);
+    free(multi->pollfds);
+    free(multi->devicev);
+    free(multi);
+    return failures;
+}
+
+int multi_download(const char **devices, int devicec, const download_options_t *options)
+{
+    multi_t *multi = multi_new(options);
+    int failures = 0;
+    int i;
+    for (i = 0; i < devicec; ++i) {
+	if (multi_add(multi, devices[i]) == -1) {
+	    fprintf(stderr, "%s: %s: %s\n", program_name, devices[i], strerror(errno));
+	    ++failures;
+	}
+    }
+    while (multi_devicec(multi))
+	multi_poll(multi, -1);
+    return failures + multi_delete(multi);
+}
@@ -0,0 +1,496 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* The download pipeline has three stages.  A reader thread does nothing but
+ * drain the serial port into the flytec_t ring, the calling thread runs the
+ * protocol and line framing, and a writer thread copies lines from a second
+ * ring to disk.  Both rings are single-producer single-consumer, so a
+ * stalled disk fills the writer ring instead of stopping reads from the
+ * device.  The reader only takes its lock to wake the calling thread when
+ * that thread has said it is about to sleep.  The writer ring still takes
+ * its lock each time lines are queued and each time a write completes.
+ *
+ * Where io_uring is available both threads can use it instead.  The reader
+ * then keeps a read posted on the device at all times and each refill
+ * costs one io_uring_enter instead of a poll and a read, and the writer
+ * writes both pieces of a wrapped ring with one request. */
+
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libtini.h"
+
+#ifndef WRITER_BUFSIZE
+#define WRITER_BUFSIZE (1 << 20)
+#endif
+
+#define READER_POLL_MS 100
+#define READER_FULL_MS 1
+
+#define URING_ENTRIES 4
+
+enum {
+    URING_READ = 1,
+    URING_CANCEL,
+    URING_WRITE
+};
+
+struct _reader_t {
+    flytec_t *flytec;
+    uring_t *uring;
+    struct iovec iov[2];
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+    int waiting;
+    int error;
+    int eof;
+    long stalls;
+};
+
+struct _writer_t {
+    const tini_hooks_t *hooks;
+    ring_t *ring;
+    uring_t *uring;
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t data;
+    pthread_cond_t space;
+    int stop;
+    int error;
+    long writes;
+    long stalls;
+};
+
+static int cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    int rc = pthread_cond_init(cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+    return rc;
+}
+
+static void deadline_ms(struct timespec *ts, int ms)
+{
+    if (clock_gettime(CLOCK_MONOTONIC, ts) == -1)
+	TINI_ABORT("clock_gettime", errno);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+	ts->tv_nsec -= 1000000000L;
+	++ts->tv_sec;
+    }
+}
+
+/* hands the result of a read to flytec_reader_wait, returns 0 if the
+ * reader should stop.  Data that has already been produced into the ring
+ * only needs a wakeup if the calling thread is waiting: it sets waiting
+ * before it checks the ring for the last time, and the fences order that
+ * against the reader's store of the ring's head. */
+static int reader_deliver(reader_t *reader, int n)
+{
+    if (n > 0) {
+	flytec_count_read(reader->flytec, n);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&reader->waiting, __ATOMIC_RELAXED))
+	    return 1;
+    }
+    pthread_mutex_lock(&reader->mutex);
+    if (n == -1)
+	reader->error = errno;
+    else if (n == 0)
+	reader->eof = 1;
+    pthread_cond_signal(&reader->cond);
+    pthread_mutex_unlock(&reader->mutex);
+    return n > 0;
+}
+
+static void reader_stall(reader_t *reader)
+{
+    /* back-pressure: leave the data in the tty buffer for now */
+    ++reader->stalls;
+    struct timespec ts = { 0, READER_FULL_MS * 1000000L };
+    nanosleep(&ts, 0);
+}
+
+static void *reader_main(void *data)
+{
+    reader_t *reader = data;
+    flytec_t *flytec = reader->flytec;
+    while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+	if (RING_FULL(flytec->ring)) {
+	    reader_stall(reader);
+	    continue;
+	}
+	struct pollfd pollfd;
+	pollfd.fd = flytec->fd;
+	pollfd.events = POLLIN;
+	int rc = poll(&pollfd, 1, READER_POLL_MS);
+	if (rc == -1 && errno == EINTR)
+	    continue;
+	int n = rc == -1 ? -1 : rc == 0 ? -2 : flytec->transport->read(flytec);
+	if (n == -2)
+	    continue;
+	if (!reader_deliver(reader, n))
+	    break;
+    }
+    return 0;
+}
+
+/* reads straight into the ring, every transport reads its descriptor with
+ * ring_read so nothing is lost by bypassing transport->read */
+static void *reader_uring_main(void *data)
+{
+    reader_t *reader = data;
+    flytec_t *flytec = reader->flytec;
+    int posted = 0;
+    while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)) {
+	if (!posted) {
+	    if (RING_FULL(flytec->ring)) {
+		reader_stall(reader);
+		continue;
+	    }
+	    int iovcnt = ring_space(flytec->ring, reader->iov);
+	    if (uring_readv(reader->uring, flytec->fd, reader->iov, iovcnt, URING_READ) == -1) {
+		reader_deliver(reader, -1);
+		break;
+	    }
+	    posted = 1;
+	}
+	uint64_t user_data;
+	int res;
+	int rc = uring_wait(reader->uring, READER_POLL_MS, &user_data, &res);
+	if (rc == 0)
+	    continue;
+	int n;
+	if (rc == -1) {
+	    n = -1;
+	} else {
+	    posted = 0;
+	    if (res == -EINTR || res == -EAGAIN)
+		continue;
+	    if (res < 0)
+		errno = -res;
+	    n = res < 0 ? -1 : res;
+	    if (n > 0)
+		ring_produce(flytec->ring, n);
+	}
+	if (!reader_deliver(reader, n))
+	    break;
+    }
+    if (posted) {
+	/* The kernel must be done with the ring before it is freed, so the
+	 * wait is retried while the kernel is short of resources.  With at
+	 * most one read posted the queue always has room for the
+	 * cancellation, and any other failure means a bad descriptor or
+	 * argument, which is a bug in libtini. */
+	if (uring_cancel(reader->uring, URING_READ, URING_CANCEL) == -1)
+	    TINI_ABORT("uring_cancel", errno);
+	uint64_t user_data = 0;
+	int res = 0;
+	while (user_data != URING_READ) {
+	    if (uring_wait(reader->uring, -1, &user_data, &res) == -1) {
+		if (errno != EAGAIN && errno != EBUSY)
+		    TINI_ABORT("uring_wait", errno);
+		reader_stall(reader);
+	    }
+	}
+	if (res > 0)
+	    ring_produce(flytec->ring, res);
+    }
+    return 0;
+}
+
+/* starts the reader thread, using io_uring if uring is set and it is
+ * available.  Returns -1 with errno set on failure. */
+int flytec_reader_start(flytec_t *flytec, int uring)
+{
+    reader_t *reader = tini_alloc(flytec->hooks, sizeof(reader_t));
+    if (!reader)
+	return -1;
+    reader->flytec = flytec;
+    if (uring)
+	reader->uring = uring_new(flytec->hooks, URING_ENTRIES);
+    pthread_mutex_init(&reader->mutex, 0);
+    int rc = cond_init(&reader->cond);
+    if (rc) {
+	pthread_mutex_destroy(&reader->mutex);
+	uring_delete(reader->uring);
+	tini_free(flytec->hooks, reader);
+	errno = rc;
+	return -1;
+    }
+    flytec->ring->shared = 1;
+    rc = pthread_create(&reader->thread, 0, reader->uring ? reader_uring_main : reader_main, reader);
+    if (rc) {
+	flytec->ring->shared = 0;
+	pthread_cond_destroy(&reader->cond);
+	pthread_mutex_destroy(&reader->mutex);
+	uring_delete(reader->uring);
+	tini_free(flytec->hooks, reader);
+	errno = rc;
+	return -1;
+    }
+    flytec->reader = reader;
+    flytec->reader_uring = reader->uring != 0;
+    return 0;
+}
+
+void flytec_reader_stop(flytec_t *flytec)
+{
+    reader_t *reader = flytec->reader;
+    if (!reader)
+	return;
+    __atomic_store_n(&reader->stop, 1, __ATOMIC_RELEASE);
+    int rc = pthread_join(reader->thread, 0);
+    if (rc)
+	TINI_ABORT("pthread_join", rc);
+    flytec->reader_stalls += reader->stalls;
+    pthread_cond_destroy(&reader->cond);
+    pthread_mutex_destroy(&reader->mutex);
+    uring_delete(reader->uring);
+    tini_free(flytec->hooks, reader);
+    flytec->reader = 0;
+    flytec->ring->shared = 0;
+}
+
+/* wait for the reader thread to deliver more than the used bytes already in
+ * the ring, returns 0 on timeout and -1 with errno set if the read failed,
+ * ENODEV if the device went away */
+int flytec_reader_wait(flytec_t *flytec, unsigned int used, int timeout_ms)
+{
+    reader_t *reader = flytec->reader;
+    if (RING_USED(flytec->ring) > used)
+	return 1;
+    struct timespec deadline;
+    deadline_ms(&deadline, timeout_ms);
+    pthread_mutex_lock(&reader->mutex);
+    __atomic_store_n(&reader->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int rc = 0;
+    while (RING_USED(flytec->ring) <= used && !reader->error && !reader->eof && rc != ETIMEDOUT)
+	rc = pthread_cond_timedwait(&reader->cond, &reader->mutex, &deadline);
+    __atomic_store_n(&reader->waiting, 0, __ATOMIC_RELAXED);
+    int error = reader->error, eof = reader->eof;
+    pthread_mutex_unlock(&reader->mutex);
+    if (RING_USED(flytec->ring) > used)
+	return 1;
+    if (error || eof) {
+	errno = error ? error : ENODEV;
+	return -1;
+    }
+    return 0;
+}
+
+/* writes the data in the ring, including any that has wrapped around to
+ * the start, with one request.  Returns the number of bytes written, or 0
+ * with errno set if the write failed. */
+static unsigned int writer_uring_write(writer_t *writer, int fd, const char *p)
+{
+    ring_t *ring = writer->ring;
+    unsigned int used = RING_USED(ring);
+    unsigned int end = ring->size - (p - ring->buf);
+    struct iovec iov[2];
+    iov[0].iov_base = (char *) p;
+    iov[0].iov_len = used < end ? used : end;
+    iov[1].iov_base = ring->buf;
+    iov[1].iov_len = used - iov[0].iov_len;
+    while (1) {
+	if (uring_writev(writer->uring, fd, iov, iov[1].iov_len ? 2 : 1, URING_WRITE) == -1)
+	    return 0;
+	uint64_t user_data;
+	int res;
+	if (uring_wait(writer->uring, -1, &user_data, &res) == -1)
+	    return 0;
+	if (res == -EINTR || res == -EAGAIN)
+	    continue;
+	if (res < 0) {
+	    errno = -res;
+	    return 0;
+	}
+	if (res == 0) {
+	    errno = EIO;
+	    return 0;
+	}
+	return res;
+    }
+}
+
+static void *writer_main(void *data)
+{
+    writer_t *writer = data;
+    pthread_mutex_lock(&writer->mutex);
+    while (1) {
+	while (RING_EMPTY(writer->ring) && !writer->stop)
+	    pthread_cond_wait(&writer->data, &writer->mutex);
+	if (RING_EMPTY(writer->ring))
+	    break;
+	int fd = writer->fd;
+	int error = writer->error;
+	pthread_mutex_unlock(&writer->mutex);
+	unsigned int len;
+	const char *p = ring_peek(writer->ring, &len);
+	if (!error && writer->uring) {
+	    len = writer_uring_write(writer, fd, p);
+	    if (len == 0)
+		error = errno;
+	} else if (!error) {
+	    int n;
+	    do {
+		n = write(fd, p, len);
+	    } while (n == -1 && errno == EINTR);
+	    if (n == -1)
+		error = errno;
+	    else
+		len = n;
+	}
+	/* after an error the data is discarded until the file is closed */
+	ring_consume(writer->ring, len);
+	pthread_mutex_lock(&writer->mutex);
+	++writer->writes;
+	if (error)
+	    writer->error = error;
+	pthread_cond_signal(&writer->space);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return 0;
+}
+
+/* buffers up to size bytes, or WRITER_BUFSIZE if it is 0, and uses io_uring
+ * if uring is set and it is available.  Returns 0 with errno set on
+ * failure. */
+writer_t *writer_new(const tini_hooks_t *hooks, unsigned int size, int uring)
+{
+    writer_t *writer = tini_alloc(hooks, sizeof(writer_t));
+    if (!writer)
+	return 0;
+    writer->hooks = hooks;
+    writer->ring = ring_new(hooks, size ? size : WRITER_BUFSIZE);
+    if (!writer->ring) {
+	tini_free(hooks, writer);
+	return 0;
+    }
+    writer->ring->shared = 1;
+    if (uring)
+	writer->uring = uring_new(hooks, URING_ENTRIES);
+    writer->fd = -1;
+    pthread_mutex_init(&writer->mutex, 0);
+    int rc = cond_init(&writer->data);
+    if (!rc) {
+	rc = cond_init(&writer->space);
+	if (rc)
+	    pthread_cond_destroy(&writer->data);
+    }
+    if (!rc) {
+	rc = pthread_create(&writer->thread, 0, writer_main, writer);
+	if (rc) {
+	    pthread_cond_destroy(&writer->space);
+	    pthread_cond_destroy(&writer->data);
+	}
+    }
+    if (rc) {
+	pthread_mutex_destroy(&writer->mutex);
+	uring_delete(writer->uring);
+	ring_delete(writer->ring);
+	tini_free(hooks, writer);
+	errno = rc;
+	return 0;
+    }
+    return writer;
+}
+
+void writer_delete(writer_t *writer)
+{
+    if (writer) {
+	pthread_mutex_lock(&writer->mutex);
+	writer->stop = 1;
+	pthread_cond_signal(&writer->data);
+	pthread_mutex_unlock(&writer->mutex);
+	int rc = pthread_join(writer->thread, 0);
+	if (rc)
+	    TINI_ABORT("pthread_join", rc);
+	pthread_cond_destroy(&writer->space);
+	pthread_cond_destroy(&writer->data);
+	pthread_mutex_destroy(&writer->mutex);
+	uring_delete(writer->uring);
+	ring_delete(writer->ring);
+	tini_free(writer->hooks, writer);
+    }
+}
+
+void writer_open(writer_t *writer, int fd)
+{
+    pthread_mutex_lock(&writer->mutex);
+    writer->fd = fd;
+    writer->error = 0;
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+void writer_write(writer_t *writer, const char *buf, int len)
+{
+    while (len > 0) {
+	unsigned int n = ring_write(writer->ring, buf, len);
+	buf += n;
+	len -= n;
+	pthread_mutex_lock(&writer->mutex);
+	if (n)
+	    pthread_cond_signal(&writer->data);
+	if (len > 0) {
+	    /* back-pressure: the disk has fallen a whole buffer behind */
+	    ++writer->stalls;
+	    while (RING_FULL(writer->ring))
+		pthread_cond_wait(&writer->space, &writer->mutex);
+	}
+	pthread_mutex_unlock(&writer->mutex);
+    }
+}
+
+/* wait for all queued data to be written, and to reach the disk if sync is
+ * set, then close the file.  Returns 0 or the errno of the first failed
+ * write, fdatasync or close. */
+int writer_close(writer_t *writer, int sync)
+{
+    pthread_mutex_lock(&writer->mutex);
+    while (!RING_EMPTY(writer->ring))
+	pthread_cond_wait(&writer->space, &writer->mutex);
+    int error = writer->error;
+    int fd = writer->fd;
+    writer->fd = -1;
+    pthread_mutex_unlock(&writer->mutex);
+    if (sync && !error && fdatasync(fd) == -1)
+	error = errno;
+    if (close(fd) == -1 && !error)
+	error = errno;
+    return error;
+}
+
+void writer_stats(const writer_t *writer, unsigned int *high, long *writes, long *stalls, int *uring)
+{
+    *uring = writer->uring != 0;
+    *high = writer->ring->high;
+    *writes = writer->writes;
+    *stalls = writer->stalls;
+}
@@ -0,0 +1,174 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* Progress is counted in bytes and only looked at every
+ * PROGRESS_INTERVAL_NSEC.  The fraction done is then taken from the time
+ * of the last B record received against the duration the FR listed, the
+ * total size is extrapolated from it and the time left is the remaining
+ * bytes over a moving average of the throughput. */
+
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "tini.h"
+
+#define PROGRESS_INTERVAL_NSEC 250000000L
+/* weight of the newest throughput sample */
+#define PROGRESS_ALPHA 0.25
+
+static void progress_event(const progress_t *progress, const char *event, const char *format, ...) __attribute__ ((format(printf, 3, 4)));
+
+/* escapes as much of s as fits in size, without splitting a UTF-8
+ * sequence */
+static int json_escape(char *p, int size, const char *s)
+{
+    int n = 0;
+    for (; *s && n < size - 7; ++s) {
+	if ((*s & 0xc0) == 0xc0) {
+	    int seq = (*s & 0xe0) == 0xc0 ? 2 : (*s & 0xf0) == 0xe0 ? 3 : 4;
+	    if (n + seq > size - 7)
+		break;
+	}
+	unsigned char c = *s;
+	if (c == '"' || c == '\\')
+	    n += sprintf(p + n, "\\%c", c);
+	else if (c < 0x20)
+	    n += sprintf(p + n, "\\u%04x", c);
+	else
+	    p[n++] = c;
+    }
+    p[n] = '\0';
+    return n;
+}
+
+/* writes one JSON object per line with a single write, so that events from
+ * several devices never interleave */
+static void progress_event(const progress_t *progress, const char *event, const char *format, ...)
+{
+    char buf[1024];
+    int len = snprintf(buf, sizeof buf, "{\"event\":\"%s\",\"device\":\"", event);
+    len += json_escape(buf + len, sizeof buf / 4, progress->device);
+    len += snprintf(buf + len, sizeof buf - len, "\",\"index\":%d", progress->track->index + 1);
+    if (format) {
+	buf[len++] = ',';
+	va_list ap;
+	va_start(ap, format);
+	len += vsnprintf(buf + len, sizeof buf - len - 2, format, ap);
+	va_end(ap);
+	if (len > (int) sizeof buf - 2)
+	    len = sizeof buf - 2;
+    }
+    buf[len++] = '}';
+    buf[len++] = '\n';
+    while (write(progress->fd, buf, len) == -1 && errno == EINTR)
+	;
+}
+
+void progress_start(progress_t *progress, int fd, int bar, const char *device, const track_t *track, const char *filename)
+{
+    memset(progress, 0, sizeof(progress_t));
+    progress->fd = fd;
+    progress->bar = bar;
+    progress->device = device;
+    progress->track = track;
+    progress->start_nsec = progress->last_nsec = now_nsec();
+    progress->eta_sec = -1;
+    if (bar)
+	fprintf(stderr, "%s: downloading %s    0%%           ", program_name, filename);
+    if (fd != -1) {
+	char escaped[512];
+	json_escape(escaped, sizeof escaped, filename);
+	char time[32];
+	if (!strftime(time, sizeof time, "%Y-%m-%dT%H:%M:%SZ", gmtime(&track->time)))
+	    DIE("strftime", 0);
+	progress_event(progress, "start", "\"filename\":\"%s\",\"time\":\"%s\",\"duration\":%d", escaped, time, track->duration);
+    }
+}
+
+/* the hot path: everything but the count waits for the next interval */
+void progress_bytes(progress_t *progress, const char *buf, int len)
+{
+    progress->bytes += len;
+    if (progress->fd == -1 && !progress->bar)
+	return;
+    long nsec = now_nsec();
+    if (nsec - progress->last_nsec < PROGRESS_INTERVAL_NSEC)
+	return;
+    double rate = 1e9 * (progress->bytes - progress->last_bytes) / (nsec - progress->last_nsec);
+    progress->rate = progress->rate ? PROGRESS_ALPHA * rate + (1 - PROGRESS_ALPHA) * progress->rate : rate;
+    progress->last_nsec = nsec;
+    progress->last_bytes = progress->bytes;
+    /* find the last B record in this batch of complete lines */
+    const char *line;
+    for (line = buf + len - 1; line != buf; --line)
+	if (line[-1] == '\n' && line[0] == 'B')
+	    break;
+    if (line[0] == 'B' && line + 7 <= buf + len) {
+	int i, hhmmss = 0;
+	for (i = 1; i < 7 && '0' <= line[i] && line[i] <= '9'; ++i)
+	    hhmmss = 10 * hhmmss + line[i] - '0';
+	if (i == 7) {
+	    int elapsed = 3600 * (hhmmss / 10000) + 60 * (hhmmss / 100 % 100) + hhmmss % 100 - progress->track->time % 86400;
+	    if (elapsed < 0)
+		elapsed += 86400;
+	    int duration = progress->track->duration ? progress->track->duration : 1;
+	    progress->percent = elapsed >= duration ? 99 : 100 * elapsed / duration;
+	    if (elapsed > 0 && progress->rate > 0) {
+		double total = (double) progress->bytes * duration / elapsed;
+		progress->eta_sec = total > progress->bytes ? (total - progress->bytes) / progress->rate + 0.5 : 0;
+	    }
+	}
+    }
+    if (progress->bar) {
+	int eta = progress->eta_sec < 0 ? 0 : progress->eta_sec > 99 * 60 + 59 ? 99 * 60 + 59 : progress->eta_sec;
+	fprintf(stderr, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b%3d%%  %02d:%02d ETA", progress->percent, eta / 60, eta % 60);
+    }
+    if (progress->fd != -1)
+	progress_event(progress, "progress", "\"bytes\":%ld,\"percent\":%d,\"eta_sec\":%d,\"bytes_per_sec\":%.0f", progress->bytes, progress->percent, progress->eta_sec, progress->rate);
+}
+
+void progress_done(progress_t *progress, const char *filename)
+{
+    long nsec = now_nsec() - progress->start_nsec;
+    if (progress->bar) {
+	int sec = (nsec + 500000000L) / 1000000000L;
+	if (sec > 99 * 60 + 59)
+	    sec = 99 * 60 + 59;
+	fprintf(stderr, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b100%%  %02d:%02d    \n", sec / 60, sec % 60);
+    }
+    if (progress->fd != -1) {
+	char escaped[512];
+	json_escape(escaped, sizeof escaped, filename);
+	progress_event(progress, "done", "\"filename\":\"%s\",\"bytes\":%ld,\"elapsed_sec\":%.3f", escaped, progress->bytes, nsec / 1e9);
+    }
+}
+
+/* final is 0 if the tracklog will be tried again */
+void progress_error(progress_t *progress, const char *message, int final)
+{
+    if (progress->bar && !final)
+	fprintf(stderr, "\n");
+    if (progress->fd != -1) {
+	char escaped[512];
+	json_escape(escaped, sizeof escaped, message);
+	progress_event(progress, "error", "\"message\":\"%s\",\"final\":%s", escaped, final ? "true" : "false");
+    }
+}
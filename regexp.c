@@ -19,7 +19,7 @@
 */
 
 #include <ctype.h>
-#include "tini.h"
+#include "libtini.h"
 
     static inline const char *
 match_char(const char *p, char c)
@@ -82,16 +82,15 @@ match_one_of(const char *p, const char *s, char *result)
 }
 
     static inline const char *
-match_string_until(const char *p, char c, int consume, char **result)
+match_string_until(const tini_hooks_t *hooks, const char *p, char c, int consume, char **result)
 {
     if (!p) return 0;
     const char *start = p;
     while (*p && *p != c)
 	++p;
     if (!p) return 0;
-    *result = alloc(p - start + 1);
-    memcpy(*result, start, p - start);
-    (*result)[p - start] = '\0';
+    *result = tini_strndup(hooks, start, p - start);
+    if (!*result) return 0;
     return consume ? ++p : p;
 }
 
@@ -131,6 +130,288 @@ match_b_record(const char *p, struct tm *tm)
     return p;
 }
 
+    static inline const char *
+match_altitude(const char *p, int *result)
+{
+    if (!p) return 0;
+    if (*p != '-')
+	return match_n_digits(p, 5, result);
+    p = match_n_digits(++p, 4, result);
+    *result = -*result;
+    return p;
+}
+
+/* parses a complete B record including the trailing CRLF, the extension
+ * points into the line */
+int b_record_parse(b_record_t *b, const char *p)
+{
+    int hour = 0, min = 0, sec = 0;
+    int lat_deg = 0, lat_min = 0, lon_deg = 0, lon_min = 0;
+    char ns = 0, ew = 0;
+    p = match_char(p, 'B');
+    p = match_n_digits(p, 2, &hour);
+    p = match_n_digits(p, 2, &min);
+    p = match_n_digits(p, 2, &sec);
+    p = match_n_digits(p, 2, &lat_deg);
+    p = match_n_digits(p, 5, &lat_min);
+    p = match_one_of(p, "NS", &ns);
+    p = match_n_digits(p, 3, &lon_deg);
+    p = match_n_digits(p, 5, &lon_min);
+    p = match_one_of(p, "EW", &ew);
+    p = match_one_of(p, "AV", &b->validity);
+    p = match_altitude(p, &b->pressure_altitude);
+    p = match_altitude(p, &b->gnss_altitude);
+    if (!p) return 0;
+    b->extension = p;
+    p = match_until_eol(p);
+    if (!p) return 0;
+    b->extension_len = p - b->extension - 2;
+    b->time = 3600 * hour + 60 * min + sec;
+    b->lat = 60000 * lat_deg + lat_min;
+    if (ns == 'S')
+	b->lat = -b->lat;
+    b->lon = 60000 * lon_deg + lon_min;
+    if (ew == 'W')
+	b->lon = -b->lon;
+    return 1;
+}
+
+    static inline int
+fixed_digits(const char *p, int n, int *result)
+{
+    int value = 0;
+    for (; n > 0; --n, ++p) {
+	if ((unsigned) (*p - '0') > 9)
+	    return 0;
+	value = 10 * value + *p - '0';
+    }
+    *result = value;
+    return 1;
+}
+
+    static inline int
+fixed_altitude(const char *p, int *result)
+{
+    if (*p != '-')
+	return fixed_digits(p, 5, result);
+    if (!fixed_digits(p + 1, 4, result))
+	return 0;
+    *result = -*result;
+    return 1;
+}
+
+/* decodes a B record at fixed offsets without needing a NUL terminator, len
+ * includes the line ending */
+int b_record_decode(b_record_t *b, const char *p, int len)
+{
+    int hour, min, sec, lat_deg, lat_min, lon_deg, lon_min;
+    if (len < 35 || p[0] != 'B')
+	return 0;
+    if (!fixed_digits(p + 1, 2, &hour) || !fixed_digits(p + 3, 2, &min) || !fixed_digits(p + 5, 2, &sec)
+	    || !fixed_digits(p + 7, 2, &lat_deg) || !fixed_digits(p + 9, 5, &lat_min)
+	    || !fixed_digits(p + 15, 3, &lon_deg) || !fixed_digits(p + 18, 5, &lon_min)
+	    || !fixed_altitude(p + 25, &b->pressure_altitude) || !fixed_altitude(p + 30, &b->gnss_altitude))
+	return 0;
+    if ((p[14] != 'N' && p[14] != 'S') || (p[23] != 'E' && p[23] != 'W') || (p[24] != 'A' && p[24] != 'V'))
+	return 0;
+    b->time = 3600 * hour + 60 * min + sec;
+    b->lat = 60000 * lat_deg + lat_min;
+    if (p[14] == 'S')
+	b->lat = -b->lat;
+    b->lon = 60000 * lon_deg + lon_min;
+    if (p[23] == 'W')
+	b->lon = -b->lon;
+    b->validity = p[24];
+    b->extension = p + 35;
+    while (len > 35 && (p[len - 1] == '\n' || p[len - 1] == '\r'))
+	--len;
+    b->extension_len = len - 35;
+    return 1;
+}
+
+/* returns the GNSS altitude, which is only trustworthy with a 3D fix, or
+ * else the pressure altitude */
+int b_record_altitude(const b_record_t *b)
+{
+    return b->validity == 'A' && b->gnss_altitude ? b->gnss_altitude : b->pressure_altitude;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWAR 1
+
+#define SWAR_ONES 0x0101010101010101ULL
+
+    static inline uint64_t
+swar_load(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+/* true if all eight bytes are ASCII digits */
+    static inline int
+swar_digits(uint64_t v)
+{
+    return ((v & (0xf0 * SWAR_ONES)) | (((v + 0x06 * SWAR_ONES) & (0xf0 * SWAR_ONES)) >> 4)) == 0x33 * SWAR_ONES;
+}
+
+/* converts eight digits into four two digit values, one per 16 bit lane */
+    static inline uint64_t
+swar_pairs(uint64_t v)
+{
+    v &= 0x0f * SWAR_ONES;
+    return ((v * 10) + (v >> 8)) & 0x00ff00ff00ff00ffULL;
+}
+
+/* converts eight digits to their value */
+    static inline uint32_t
+swar_value(uint64_t v)
+{
+    v = swar_pairs(v);
+    v = ((v * 100) + (v >> 16)) & 0x0000ffff0000ffffULL;
+    return (v * 10000 + (v >> 32)) & 0xffffffff;
+}
+#endif
+
+track_columns_t *track_columns_new(const tini_hooks_t *hooks)
+{
+    track_columns_t *columns = tini_alloc(hooks, sizeof(track_columns_t));
+    if (columns)
+	columns->hooks = hooks;
+    return columns;
+}
+
+void track_columns_delete(track_columns_t *columns)
+{
+    if (columns) {
+	tini_free(columns->hooks, columns->time);
+	tini_free(columns->hooks, columns->lat);
+	tini_free(columns->hooks, columns->lon);
+	tini_free(columns->hooks, columns->pressure_altitude);
+	tini_free(columns->hooks, columns->gnss_altitude);
+	tini_free(columns->hooks, columns->validity);
+	tini_free(columns->hooks, columns);
+    }
+}
+
+/* grows one column, leaving it unchanged on failure */
+static int column_reserve(const tini_hooks_t *hooks, void *column, size_t size)
+{
+    void *p = tini_realloc(hooks, *(void **) column, size);
+    if (!p)
+	return -1;
+    *(void **) column = p;
+    return 0;
+}
+
+/* returns -1 with errno set if out of memory, the capacity only grows once
+ * every column has */
+static int track_columns_reserve(track_columns_t *columns, int n)
+{
+    if (columns->n + n <= columns->capacity)
+	return 0;
+    int capacity = columns->capacity;
+    while (columns->n + n > capacity)
+	capacity = capacity ? 2 * capacity : 4096;
+    if (column_reserve(columns->hooks, &columns->time, capacity * sizeof(int)) == -1
+	    || column_reserve(columns->hooks, &columns->lat, capacity * sizeof(int)) == -1
+	    || column_reserve(columns->hooks, &columns->lon, capacity * sizeof(int)) == -1
+	    || column_reserve(columns->hooks, &columns->pressure_altitude, capacity * sizeof(int)) == -1
+	    || column_reserve(columns->hooks, &columns->gnss_altitude, capacity * sizeof(int)) == -1
+	    || column_reserve(columns->hooks, &columns->validity, capacity) == -1)
+	return -1;
+    columns->capacity = capacity;
+    return 0;
+}
+
+/* thousandths of a minute to millionths of a degree, rounded */
+    static inline int
+microdegrees(int value)
+{
+    return value < 0 ? -((-value * 50 + 1) / 3) : (value * 50 + 1) / 3;
+}
+
+int track_columns_append(track_columns_t *columns, const b_record_t *b)
+{
+    if (track_columns_reserve(columns, 1) == -1)
+	return -1;
+    int i = columns->n++;
+    columns->time[i] = b->time;
+    columns->lat[i] = microdegrees(b->lat);
+    columns->lon[i] = microdegrees(b->lon);
+    columns->pressure_altitude[i] = b->pressure_altitude;
+    columns->gnss_altitude[i] = b->gnss_altitude;
+    columns->validity[i] = b->validity;
+    return 0;
+}
+
+#ifdef SWAR
+/* decodes the fixed width fields eight bytes at a time, returns 0 if the
+ * record needs the careful path */
+    static inline int
+b_record_decode_swar(track_columns_t *columns, const char *p)
+{
+    if ((p[14] != 'N' && p[14] != 'S') || (p[23] != 'E' && p[23] != 'W') || (p[24] != 'A' && p[24] != 'V') || p[25] == '-' || p[30] == '-')
+	return 0;
+    /* HHMMSSDD, SDDMMmmm, DDDMMmmm, then the altitudes with the bytes before
+     * them replaced by zeros */
+    uint64_t time_lat = swar_load(p + 1);
+    uint64_t lat = swar_load(p + 6);
+    uint64_t lon = swar_load(p + 15);
+    uint64_t pressure = (swar_load(p + 22) & ~0xffffffULL) | 0x303030;
+    uint64_t gnss = (swar_load(p + 27) & ~0xffffffULL) | 0x303030;
+    if (!swar_digits(time_lat) || !swar_digits(lat) || !swar_digits(lon) || !swar_digits(pressure) || !swar_digits(gnss))
+	return 0;
+    uint64_t pairs = swar_pairs(time_lat);
+    int i = columns->n++;
+    columns->time[i] = 3600 * (pairs & 0xff) + 60 * ((pairs >> 16) & 0xff) + ((pairs >> 32) & 0xff);
+    int value = 60000 * ((pairs >> 48) & 0xff) + swar_value(lat) % 100000;
+    columns->lat[i] = microdegrees(p[14] == 'S' ? -value : value);
+    uint32_t lon_value = swar_value(lon);
+    value = 60000 * (lon_value / 100000) + lon_value % 100000;
+    columns->lon[i] = microdegrees(p[23] == 'W' ? -value : value);
+    columns->pressure_altitude[i] = swar_value(pressure);
+    columns->gnss_altitude[i] = swar_value(gnss);
+    columns->validity[i] = p[24];
+    return 1;
+}
+#endif
+
+/* appends every B record in an IGC buffer to columns, returns the number
+ * appended or -1 with errno set if out of memory */
+int track_columns_decode(track_columns_t *columns, const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+    int n = columns->n;
+    /* no line can be shorter than a B record and its CRLF */
+    if (track_columns_reserve(columns, len / 35 + 1) == -1)
+	return -1;
+    while (p != end) {
+	const char *next;
+#ifdef SWAR
+	/* the common case of a B record without extensions needs no search
+	 * for the end of line */
+	if (*p == 'B' && end - p >= 37 && p[35] == '\r' && p[36] == '\n' && b_record_decode_swar(columns, p)) {
+	    p += 37;
+	    continue;
+	}
+#endif
+	const char *eol = memchr(p, '\n', end - p);
+	next = eol ? eol + 1 : end;
+	if (*p == 'B') {
+	    b_record_t b;
+#ifdef SWAR
+	    if (next - p < 35 || !b_record_decode_swar(columns, p))
+#endif
+	    if (b_record_decode(&b, p, next - p) && track_columns_append(columns, &b) == -1)
+		return -1;
+	}
+	p = next;
+    }
+    return columns->n - n;
+}
+
     static const char *
 match_hfdte_record(const char *p, struct tm *tm)
 {
@@ -164,6 +445,75 @@ int igc_tm_update(struct tm *tm, const char *p)
     return !!p;
 }
 
+/* mktime for a struct tm in UTC, whatever the TZ of the process, returns -1
+ * if a field is out of range, including a day past the end of its month.
+ * Days are counted from 1 March so that the leap day comes last in each
+ * year. */
+time_t tini_timegm(const struct tm *tm)
+{
+    static const int mdays[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if (tm->tm_mon < 0 || tm->tm_mon > 11 || tm->tm_mday < 1 || tm->tm_mday > mdays[tm->tm_mon]
+	    || tm->tm_hour < 0 || tm->tm_hour > 23 || tm->tm_min < 0 || tm->tm_min > 59 || tm->tm_sec < 0 || tm->tm_sec > 60)
+	return (time_t) -1;
+    long year = tm->tm_year + 1900L;
+    if (tm->tm_mon == 1 && tm->tm_mday == 29 && (year % 4 != 0 || (year % 100 == 0 && year % 400 != 0)))
+	return (time_t) -1;
+    year -= tm->tm_mon < 2;
+    long era = (year >= 0 ? year : year - 399) / 400;
+    long year_of_era = year - 400 * era;
+    long day_of_year = (153 * (tm->tm_mon < 2 ? tm->tm_mon + 10 : tm->tm_mon - 2) + 2) / 5 + tm->tm_mday - 1;
+    long days = 146097 * era + 365 * year_of_era + year_of_era / 4 - year_of_era / 100 + day_of_year - 719468;
+    return (time_t) days * 86400 + 3600 * tm->tm_hour + 60 * tm->tm_min + tm->tm_sec;
+}
+
+/* parses YYYY-MM-DD[THH:MM[:SS]], a space may replace the T.  If end is
+ * set then the last second of the day or minute given is returned. */
+int time_parse(const char *p, int end, time_t *result)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof tm);
+    int extra = end ? 86399 : 0;
+    p = match_n_digits(p, 4, &tm.tm_year);
+    p = match_char(p, '-');
+    p = match_n_digits(p, 2, &tm.tm_mon);
+    p = match_char(p, '-');
+    p = match_n_digits(p, 2, &tm.tm_mday);
+    if (p && (*p == 'T' || *p == ' ')) {
+	p = match_n_digits(++p, 2, &tm.tm_hour);
+	p = match_char(p, ':');
+	p = match_n_digits(p, 2, &tm.tm_min);
+	extra = end ? 59 : 0;
+	if (p && *p == ':') {
+	    p = match_n_digits(++p, 2, &tm.tm_sec);
+	    extra = 0;
+	}
+    }
+    p = match_eos(p);
+    if (!p) return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *result = tini_timegm(&tm);
+    if (*result == (time_t) -1)
+	return 0;
+    *result += extra;
+    return 1;
+}
+
+/* parses HH:MM[:SS] */
+int duration_parse(const char *p, int *result)
+{
+    int hour = 0, min = 0, sec = 0;
+    p = match_unsigned(p, &hour);
+    p = match_char(p, ':');
+    p = match_n_digits(p, 2, &min);
+    if (p && *p == ':')
+	p = match_n_digits(++p, 2, &sec);
+    p = match_eos(p);
+    if (!p) return 0;
+    *result = 3600 * hour + 60 * min + sec;
+    return 1;
+}
+
 const char *manufacturer_new(const char *instrument_id)
 {
     if (
@@ -185,81 +535,25 @@ const char *manufacturer_new(const char *instrument_id)
 	return "XXX";
 }
 
-set_t *set_merge(set_t *set, const char *p)
+/* returns 0 with errno set to EINVAL if the line does not parse or ENOMEM */
+snp_t *snp_new(const tini_hooks_t *hooks, const char *p)
 {
-    while (*p) {
-	while (*p == ',') ++p;
-	int first = -1, last = -1;
-	if (*p != '-') {
-	    p = match_unsigned(p, &first);
-	    if (!p) goto error;
-	    last = first;
-	}
-	if (*p == '-') {
-	    ++p;
-	    if (*p == '\0' || *p == ',')
-		last = -1;
-	    else {
-		p = match_unsigned(p, &last);
-		if (!p) goto error;
-	    }
-	}
-	if (*p == '\0')
-	    ;
-	else if (*p != ',')
-	    goto error;
-	set_t *node = alloc(sizeof(set_t));
-	node->first = first;
-	node->last = last;
-	node->next = set;
-	set = node;
-    }
-    return set;
-error:
-    error("invalid list");
-    return set;
-}
-
-void set_delete(set_t *set)
-{
-    while (set) {
-        set_t *next = set->next;
-        free(set);
-        set = next;
-    }
-}
-
-int set_include(set_t *set, int element)
-{
-    for (; set; set = set->next) {
-        if (set->first == -1 && set->last == -1) {
-            return 1;
-        } else if (set->first == -1 && set->last != -1) {
-            if (element <= set->last)
-                return 1;
-        } else if (set->first != -1 && set->last == -1) {
-            if (set->first <= element)
-                return 1;
-        } else {
-            if (set->first <= element && element <= set->last)
-                return 1;
-        }
-    }
-    return 0;
-}
-
-snp_t *snp_new(const char *p)
-{
-    snp_t *snp = alloc(sizeof(snp_t));
+    snp_t *snp = tini_alloc(hooks, sizeof(snp_t));
+    if (!snp)
+	return 0;
+    snp->hooks = hooks;
+    errno = 0;
     p = match_literal(p, "PBRSNP,");
-    p = match_string_until(p, ',', 1, &snp->instrument_id);
-    p = match_string_until(p, ',', 1, &snp->pilot_name);
+    p = match_string_until(hooks, p, ',', 1, &snp->instrument_id);
+    p = match_string_until(hooks, p, ',', 1, &snp->pilot_name);
     p = match_unsigned(p, &snp->serial_number);
     p = match_char(p, ',');
-    p = match_string_until(p, '\0', 0, &snp->software_version);
+    p = match_string_until(hooks, p, '\0', 0, &snp->software_version);
     p = match_eos(p);
     if (!p) {
 	snp_delete(snp);
+	if (errno != ENOMEM)
+	    errno = EINVAL;
 	return 0;
     }
     return snp;
@@ -268,16 +562,20 @@ snp_t *snp_new(const char *p)
 void snp_delete(snp_t *snp)
 {
     if (snp) {
-        free(snp->instrument_id);
-        free(snp->pilot_name);
-        free(snp->software_version);
-        free(snp);
+        tini_free(snp->hooks, snp->instrument_id);
+        tini_free(snp->hooks, snp->pilot_name);
+        tini_free(snp->hooks, snp->software_version);
+        tini_free(snp->hooks, snp);
     }
 }
 
-track_t *track_new(const char *p)
+/* returns 0 with errno set to EINVAL if the line does not parse or ENOMEM */
+track_t *track_new(const tini_hooks_t *hooks, const char *p)
 {
-    track_t *track = alloc(sizeof(track_t));
+    track_t *track = tini_alloc(hooks, sizeof(track_t));
+    if (!track)
+	return 0;
+    track->hooks = hooks;
     p = match_literal(p, "PBRTL,");
     p = match_unsigned(p, &track->count);
     p = match_char(p, ',');
@@ -306,14 +604,18 @@ track_t *track_new(const char *p)
     p = match_eos(p);
     if (!p) {
 	track_delete(track);
+	errno = EINVAL;
 	return 0;
     }
     tm.tm_mon -= 1;
     tm.tm_year += 2000 - 1900;
     track->date = DATE_NEW(tm);
-    track->time = mktime(&tm);
-    if (track->time == (time_t) -1)
-	DIE("mktime", errno);
+    track->time = tini_timegm(&tm);
+    if (track->time == (time_t) -1) {
+	track_delete(track);
+	errno = EINVAL;
+	return 0;
+    }
     track->duration = 3600 * duration_hour + 60 * duration_min + duration_sec;
     return track;
 }
@@ -321,7 +623,7 @@ track_t *track_new(const char *p)
 void track_delete(track_t *track)
 {
     if (track) {
-        free(track->igc_filename);
-        free(track);
+        tini_free(track->hooks, track->igc_filename);
+        tini_free(track->hooks, track);
     }
 }
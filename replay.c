@@ -0,0 +1,258 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* A replay device serves a communication log written by -l back to the
+ * protocol code.  The flytec_t gets one end of a socketpair and a thread on
+ * the other end answers each command with the response recorded for it,
+ * framed by XOFF and XON as the FR does.  Commands are matched in log order
+ * so repeated commands get successive responses, wrapping around to the
+ * start of the log for commands that were sent out of order. */
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libtini.h"
+
+/* the FR sends 8N1 at 57600 baud */
+#define REPLAY_BYTES_PER_SEC 5760
+#define REPLAY_CHUNK 64
+
+typedef struct {
+    char *command;
+    char *response;
+    int response_len;
+} exchange_t;
+
+struct _replay_t {
+    const tini_hooks_t *hooks;
+    const char *filename;
+    int fd;
+    int paced;
+    exchange_t *exchangev;
+    int exchangec;
+    pthread_t thread;
+};
+
+/* returns 0 with errno set on failure */
+static char *log_read(const tini_hooks_t *hooks, const char *filename, size_t *size)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+	return 0;
+    size_t capacity = 65536, len = 0;
+    char *buf = tini_alloc(hooks, capacity + 1);
+    size_t n;
+    while (buf && (n = fread(buf + len, 1, capacity - len, file)) > 0) {
+	len += n;
+	if (len == capacity) {
+	    capacity *= 2;
+	    char *p = tini_realloc(hooks, buf, capacity + 1);
+	    if (!p)
+		tini_free(hooks, buf);
+	    buf = p;
+	}
+    }
+    int _errno = errno;
+    if (buf && ferror(file)) {
+	tini_free(hooks, buf);
+	buf = 0;
+    }
+    fclose(file);
+    errno = _errno;
+    if (!buf)
+	return 0;
+    buf[len] = '\0';
+    *size = len;
+    return buf;
+}
+
+/* splits the log into exchanges, each a "> " command line followed by the
+ * "< " response lines, other lines are comments.  Returns -1 with errno set
+ * if out of memory. */
+static int replay_parse(replay_t *replay, const char *buf, size_t size)
+{
+    int capacity = 0;
+    exchange_t *exchange = 0;
+    const char *p = buf, *end = buf + size;
+    while (p != end) {
+	const char *eol = memchr(p, '\n', end - p);
+	const char *next = eol ? eol + 1 : end;
+	if (next - p >= 2 && p[0] == '>' && p[1] == ' ') {
+	    if (replay->exchangec == capacity) {
+		capacity = capacity ? 2 * capacity : 64;
+		exchange_t *exchangev = tini_realloc(replay->hooks, replay->exchangev, capacity * sizeof(exchange_t));
+		if (!exchangev)
+		    return -1;
+		replay->exchangev = exchangev;
+	    }
+	    exchange = replay->exchangev + replay->exchangec;
+	    exchange->command = tini_strndup(replay->hooks, p + 2, next - p - 2);
+	    if (!exchange->command)
+		return -1;
+	    exchange->response = 0;
+	    exchange->response_len = 0;
+	    ++replay->exchangec;
+	} else if (next - p >= 2 && p[0] == '<' && p[1] == ' ' && exchange) {
+	    int len = next - p - 2;
+	    char *response = tini_realloc(replay->hooks, exchange->response, exchange->response_len + len);
+	    if (!response)
+		return -1;
+	    exchange->response = response;
+	    memcpy(exchange->response + exchange->response_len, p + 2, len);
+	    exchange->response_len += len;
+	}
+	p = next;
+    }
+    return 0;
+}
+
+/* returns 0 once the client has gone away or cannot be written to */
+static int replay_send(replay_t *replay, const char *buf, int len, long *sent, long start_nsec)
+{
+    while (len) {
+	int n = replay->paced && len > REPLAY_CHUNK ? REPLAY_CHUNK : len;
+	if (replay->paced) {
+	    long deadline = start_nsec + 1000000000L * *sent / REPLAY_BYTES_PER_SEC;
+	    struct timespec ts;
+	    ts.tv_sec = deadline / 1000000000L;
+	    ts.tv_nsec = deadline % 1000000000L;
+	    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+		;
+	}
+	int rc = send(replay->fd, buf, n, MSG_NOSIGNAL);
+	if (rc == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	buf += rc;
+	len -= rc;
+	*sent += rc;
+    }
+    return 1;
+}
+
+static void *replay_thread(void *arg)
+{
+    replay_t *replay = arg;
+    char command[128];
+    int len = 0;
+    int next = 0;
+    long sent = 0, start_nsec = now_nsec();
+    while (1) {
+	char c;
+	int rc = read(replay->fd, &c, 1);
+	if (rc == -1 && errno == EINTR)
+	    continue;
+	if (rc <= 0)
+	    break;
+	/* flytec_puts_nmea sends the terminating NUL, which the FR ignores */
+	if (c == '\0')
+	    continue;
+	if (len < (int) sizeof command - 1)
+	    command[len++] = c;
+	if (c != '\n')
+	    continue;
+	command[len] = '\0';
+	len = 0;
+	int i;
+	for (i = 0; i < replay->exchangec; ++i) {
+	    exchange_t *exchange = replay->exchangev + (next + i) % replay->exchangec;
+	    if (strcmp(exchange->command, command))
+		continue;
+	    next = (next + i + 1) % replay->exchangec;
+	    /* the clock restarts with each response, the FR answers at once */
+	    sent = 0;
+	    start_nsec = now_nsec();
+	    static const char xoff = XOFF, xon = XON;
+	    if (!replay_send(replay, &xoff, 1, &sent, start_nsec)
+		    || !replay_send(replay, exchange->response, exchange->response_len, &sent, start_nsec)
+		    || !replay_send(replay, &xon, 1, &sent, start_nsec))
+		return 0;
+	    break;
+	}
+	if (i == replay->exchangec)
+	    tini_log(replay->hooks, replay->filename, "command not in log: %.*s", (int) strcspn(command, "\r\n"), command);
+    }
+    return 0;
+}
+
+static void replay_free(replay_t *replay)
+{
+    int i;
+    for (i = 0; i < replay->exchangec; ++i) {
+	tini_free(replay->hooks, replay->exchangev[i].command);
+	tini_free(replay->hooks, replay->exchangev[i].response);
+    }
+    tini_free(replay->hooks, replay->exchangev);
+    tini_free(replay->hooks, replay);
+}
+
+/* returns the client end of the socketpair, or -1 with errno set */
+int replay_open(const tini_hooks_t *hooks, const char *filename, int paced, replay_t **result)
+{
+    size_t size;
+    char *buf = log_read(hooks, filename, &size);
+    if (!buf)
+	return -1;
+    replay_t *replay = tini_alloc(hooks, sizeof(replay_t));
+    if (!replay) {
+	tini_free(hooks, buf);
+	return -1;
+    }
+    replay->hooks = hooks;
+    replay->filename = filename;
+    replay->paced = paced;
+    int rc = replay_parse(replay, buf, size);
+    tini_free(hooks, buf);
+    int fds[2];
+    if (rc == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+	int _errno = errno;
+	replay_free(replay);
+	errno = _errno;
+	return -1;
+    }
+    replay->fd = fds[1];
+    rc = pthread_create(&replay->thread, 0, replay_thread, replay);
+    if (rc) {
+	close(fds[0]);
+	close(fds[1]);
+	replay_free(replay);
+	errno = rc;
+	return -1;
+    }
+    *result = replay;
+    return fds[0];
+}
+
+/* call after closing the client end, which stops the thread */
+void replay_close(replay_t *replay)
+{
+    if (!replay)
+	return;
+    int rc = pthread_join(replay->thread, 0);
+    if (rc)
+	TINI_ABORT("pthread_join", rc);
+    close(replay->fd);
+    replay_free(replay);
+}
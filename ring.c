@@ -0,0 +1,126 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "libtini.h"
+
+/* head and tail count bytes ever written and read, so the size must be a
+ * power of two for the unsigned arithmetic to wrap consistently.  Only the
+ * producer advances head and only the consumer advances tail, so a ring
+ * marked shared can be filled and drained by two threads without a lock. */
+ring_t *ring_new(const tini_hooks_t *hooks, unsigned int size)
+{
+    unsigned int power = 1;
+    while (power < size)
+	power <<= 1;
+    ring_t *ring = tini_alloc(hooks, sizeof(ring_t));
+    if (!ring)
+	return 0;
+    ring->hooks = hooks;
+    /* one byte of slack lets a line at the very end be NUL terminated */
+    ring->buf = tini_alloc(hooks, power + 1);
+    if (!ring->buf) {
+	tini_free(hooks, ring);
+	errno = ENOMEM;
+	return 0;
+    }
+    ring->size = power;
+    return ring;
+}
+
+void ring_delete(ring_t *ring)
+{
+    if (ring) {
+	tini_free(ring->hooks, ring->buf);
+	tini_free(ring->hooks, ring);
+    }
+}
+
+const char *ring_peek(const ring_t *ring, unsigned int *len)
+{
+    unsigned int used = RING_USED(ring);
+    unsigned int offset = ring->tail & (ring->size - 1);
+    *len = used < ring->size - offset ? used : ring->size - offset;
+    return ring->buf + offset;
+}
+
+void ring_consume(ring_t *ring, unsigned int len)
+{
+    unsigned int tail = ring->tail + len;
+    /* restart at the beginning when empty to keep data contiguous */
+    if (!ring->shared && tail == ring->head)
+	ring->head = tail = 0;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* called by the producer after filling len bytes of the space */
+void ring_produce(ring_t *ring, unsigned int len)
+{
+    unsigned int used = ring->head + len - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (used > ring->high)
+	ring->high = used;
+    __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+}
+
+/* describes the free space in one or, if it wraps, two iovecs */
+int ring_space(ring_t *ring, struct iovec *iov)
+{
+    unsigned int space = ring->size - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    unsigned int offset = ring->head & (ring->size - 1);
+    iov[0].iov_base = ring->buf + offset;
+    iov[0].iov_len = space < ring->size - offset ? space : ring->size - offset;
+    if (iov[0].iov_len == space)
+	return 1;
+    iov[1].iov_base = ring->buf;
+    iov[1].iov_len = space - iov[0].iov_len;
+    return 2;
+}
+
+int ring_read(ring_t *ring, int fd)
+{
+    struct iovec iov[2];
+    int iovcnt = ring_space(ring, iov);
+    int n;
+    do {
+	n = iovcnt == 1 ? read(fd, iov[0].iov_base, iov[0].iov_len) : readv(fd, iov, iovcnt);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0)
+	ring_produce(ring, n);
+    return n;
+}
+
+unsigned int ring_write(ring_t *ring, const char *buf, unsigned int len)
+{
+    struct iovec iov[2];
+    int iovcnt = ring_space(ring, iov);
+    unsigned int n = 0;
+    int i;
+    for (i = 0; i < iovcnt && n < len; ++i) {
+	unsigned int m = len - n < iov[i].iov_len ? len - n : iov[i].iov_len;
+	memcpy(iov[i].iov_base, buf + n, m);
+	n += m;
+    }
+    if (n)
+	ring_produce(ring, n);
+    return n;
+}
@@ -0,0 +1,412 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* Files are dealt out to one worker per CPU in contiguous runs.  A worker
+ * that runs out steals the second half of another worker's remaining run,
+ * so a few very long flights do not leave the other CPUs idle. */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "tini.h"
+
+#define EARTH_RADIUS_KM 6371.0
+#define VARIO_WINDOW_SEC 10
+
+typedef double v4df __attribute__ ((vector_size(32)));
+
+typedef struct _pool_t pool_t;
+
+typedef struct {
+    pool_t *pool;
+    int id;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int head;
+    int tail;
+    /* per file state, reused to avoid reallocating */
+    struct tm tm;
+    int header_done;
+    int day;
+    int n;
+    int capacity;
+    int *time;
+    int *altitude;
+    int *lat;
+    int *lon;
+    double *x;
+    double *y;
+    double *z;
+} worker_t;
+
+struct _pool_t {
+    stats_t *statsv;
+    int statsc;
+    worker_t *workerv;
+    int workerc;
+};
+
+static void stats_line(void *data, const char *line, int len)
+{
+    worker_t *worker = data;
+    if (worker->header_done || line[0] != 'H' || len >= 128)
+	return;
+    char copy[128];
+    memcpy(copy, line, len);
+    copy[len] = '\0';
+    igc_tm_update(&worker->tm, copy);
+}
+
+static void stats_b_record(void *data, const b_record_t *b)
+{
+    worker_t *worker = data;
+    worker->header_done = 1;
+    if (worker->n == worker->capacity) {
+	worker->capacity = worker->capacity ? 2 * worker->capacity : 16384;
+	worker->time = realloc(worker->time, worker->capacity * sizeof(int));
+	worker->altitude = realloc(worker->altitude, worker->capacity * sizeof(int));
+	worker->lat = realloc(worker->lat, worker->capacity * sizeof(int));
+	worker->lon = realloc(worker->lon, worker->capacity * sizeof(int));
+	worker->x = realloc(worker->x, worker->capacity * sizeof(double));
+	worker->y = realloc(worker->y, worker->capacity * sizeof(double));
+	worker->z = realloc(worker->z, worker->capacity * sizeof(double));
+	if (!worker->time || !worker->altitude || !worker->lat || !worker->lon || !worker->x || !worker->y || !worker->z)
+	    DIE("realloc", errno);
+    }
+    int time = b->time + worker->day;
+    /* a flight can cross midnight UTC */
+    if (worker->n && time < worker->time[worker->n - 1] - 43200) {
+	worker->day += 86400;
+	time += 86400;
+    }
+    worker->time[worker->n] = time;
+    worker->altitude[worker->n] = b_record_altitude(b);
+    worker->lat[worker->n] = b->lat;
+    worker->lon[worker->n] = b->lon;
+    ++worker->n;
+}
+
+/* unaligned load, a macro as passing v4df by value changes the ABI */
+#define V4DF_LOAD(v, p) memcpy(&(v), (p), sizeof(v4df))
+
+/* the square roots of all four lanes in place.  Without -mavx a v4df is a
+ * pair of SSE2 registers, so sqrtpd takes two lanes at a time. */
+static inline void v4df_sqrt(v4df *v)
+{
+#if defined(__AVX__)
+    __m256d a;
+    memcpy(&a, v, sizeof a);
+    a = _mm256_sqrt_pd(a);
+    memcpy(v, &a, sizeof a);
+#elif defined(__SSE2__)
+    __m128d a[2];
+    memcpy(a, v, sizeof a);
+    a[0] = _mm_sqrt_pd(a[0]);
+    a[1] = _mm_sqrt_pd(a[1]);
+    memcpy(v, a, sizeof a);
+#else
+    int i;
+    for (i = 0; i < 4; ++i)
+	(*v)[i] = sqrt((*v)[i]);
+#endif
+}
+
+/* sums the chord lengths between consecutive points on the unit sphere,
+ * which for fixes a few metres apart equal the arc lengths */
+static double track_length(const double *x, const double *y, const double *z, int n)
+{
+    v4df sum = { 0, 0, 0, 0 };
+    int i;
+    for (i = 1; i + 4 <= n; i += 4) {
+	v4df x0, x1, y0, y1, z0, z1;
+	V4DF_LOAD(x0, x + i - 1);
+	V4DF_LOAD(x1, x + i);
+	V4DF_LOAD(y0, y + i - 1);
+	V4DF_LOAD(y1, y + i);
+	V4DF_LOAD(z0, z + i - 1);
+	V4DF_LOAD(z1, z + i);
+	v4df dx = x1 - x0, dy = y1 - y0, dz = z1 - z0;
+	v4df d = dx * dx + dy * dy + dz * dz;
+	v4df_sqrt(&d);
+	sum += d;
+    }
+    double length = sum[0] + sum[1] + sum[2] + sum[3];
+    for (; i < n; ++i) {
+	double dx = x[i] - x[i - 1], dy = y[i] - y[i - 1], dz = z[i] - z[i - 1];
+	length += sqrt(dx * dx + dy * dy + dz * dz);
+    }
+    return length;
+}
+
+static void stats_compute(worker_t *worker, stats_t *stats)
+{
+    int n = worker->n;
+    stats->b_records = n;
+    if (worker->tm.tm_mday) {
+	if (n) {
+	    worker->tm.tm_hour = worker->time[0] / 3600;
+	    worker->tm.tm_min = (worker->time[0] / 60) % 60;
+	    worker->tm.tm_sec = worker->time[0] % 60;
+	}
+	stats->time = tini_timegm(&worker->tm);
+    }
+    if (n == 0)
+	return;
+    stats->airtime = worker->time[n - 1] - worker->time[0];
+    int i, j = 0;
+    stats->max_altitude = worker->altitude[0];
+    for (i = 0; i < n; ++i) {
+	if (worker->altitude[i] > stats->max_altitude)
+	    stats->max_altitude = worker->altitude[i];
+	/* climb and sink are averaged over a window to smooth out noise */
+	while (j + 1 < i && worker->time[i] - worker->time[j + 1] >= VARIO_WINDOW_SEC)
+	    ++j;
+	if (worker->time[i] - worker->time[j] >= VARIO_WINDOW_SEC) {
+	    double rate = (double) (worker->altitude[i] - worker->altitude[j]) / (worker->time[i] - worker->time[j]);
+	    if (rate > stats->max_climb)
+		stats->max_climb = rate;
+	    if (rate < stats->max_sink)
+		stats->max_sink = rate;
+	}
+    }
+    const double radians = M_PI / (180.0 * 60000.0);
+    for (i = 0; i < n; ++i) {
+	double lat = worker->lat[i] * radians, lon = worker->lon[i] * radians;
+	double cos_lat = cos(lat);
+	worker->x[i] = cos_lat * cos(lon);
+	worker->y[i] = cos_lat * sin(lon);
+	worker->z[i] = sin(lat);
+    }
+    stats->distance = EARTH_RADIUS_KM * track_length(worker->x, worker->y, worker->z, n);
+}
+
+static void stats_file(worker_t *worker, stats_t *stats)
+{
+    int fd = open(stats->filename, O_RDONLY);
+    if (fd == -1) {
+	stats->error = errno;
+	return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+	stats->error = errno;
+	close(fd);
+	return;
+    }
+    void *buf = 0;
+    if (st.st_size) {
+	buf = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED) {
+	    stats->error = errno;
+	    close(fd);
+	    return;
+	}
+	madvise(buf, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    memset(&worker->tm, 0, sizeof worker->tm);
+    worker->header_done = 0;
+    worker->day = 0;
+    worker->n = 0;
+    if (!track_scan(buf, st.st_size, stats_line, stats_b_record, worker))
+	stats->error = EINVAL;
+    else
+	stats_compute(worker, stats);
+    if (buf)
+	munmap(buf, st.st_size);
+}
+
+/* takes the next file from this worker's own run, returns -1 if empty */
+static int worker_pop(worker_t *worker)
+{
+    int index = -1;
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->head < worker->tail)
+	index = worker->head++;
+    pthread_mutex_unlock(&worker->mutex);
+    return index;
+}
+
+/* moves the second half of another worker's run to this worker */
+static int worker_steal(worker_t *worker)
+{
+    pool_t *pool = worker->pool;
+    int i;
+    for (i = 1; i < pool->workerc; ++i) {
+	worker_t *victim = pool->workerv + (worker->id + i) % pool->workerc;
+	pthread_mutex_lock(&victim->mutex);
+	int remaining = victim->tail - victim->head;
+	int head = 0, tail = 0;
+	if (remaining > 0) {
+	    tail = victim->tail;
+	    head = tail - (remaining + 1) / 2;
+	    victim->tail = head;
+	}
+	pthread_mutex_unlock(&victim->mutex);
+	if (remaining > 0) {
+	    pthread_mutex_lock(&worker->mutex);
+	    worker->head = head;
+	    worker->tail = tail;
+	    pthread_mutex_unlock(&worker->mutex);
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+static void *worker_main(void *data)
+{
+    worker_t *worker = data;
+    do {
+	int index;
+	while ((index = worker_pop(worker)) != -1)
+	    stats_file(worker, worker->pool->statsv + index);
+    } while (worker_steal(worker));
+    return 0;
+}
+
+static void stats_add(pool_t *pool, const char *filename)
+{
+    if (pool->statsc % 1024 == 0) {
+	pool->statsv = realloc(pool->statsv, (pool->statsc + 1024) * sizeof(stats_t));
+	if (!pool->statsv)
+	    DIE("realloc", errno);
+    }
+    stats_t *stats = pool->statsv + pool->statsc++;
+    memset(stats, 0, sizeof(stats_t));
+    stats->filename = alloc(strlen(filename) + 1);
+    strcpy(stats->filename, filename);
+}
+
+static int name_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void stats_walk(pool_t *pool, const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir)
+	error("opendir: %s: %s", path, strerror(errno));
+    char **namev = 0;
+    int namec = 0;
+    struct dirent *dirent;
+    while ((errno = 0, dirent = readdir(dir))) {
+	if (dirent->d_name[0] == '.')
+	    continue;
+	namev = realloc(namev, (namec + 1) * sizeof(char *));
+	if (!namev)
+	    DIE("realloc", errno);
+	namev[namec] = alloc(strlen(path) + strlen(dirent->d_name) + 2);
+	sprintf(namev[namec++], "%s/%s", path, dirent->d_name);
+    }
+    if (errno)
+	error("readdir: %s: %s", path, strerror(errno));
+    closedir(dir);
+    /* sorted so the output does not depend on the filesystem */
+    qsort(namev, namec, sizeof(char *), name_compare);
+    int i;
+    for (i = 0; i < namec; ++i) {
+	struct stat st;
+	if (stat(namev[i], &st) == -1)
+	    error("stat: %s: %s", namev[i], strerror(errno));
+	if (S_ISDIR(st.st_mode))
+	    stats_walk(pool, namev[i]);
+	else if (S_ISREG(st.st_mode) && is_track_filename(namev[i]))
+	    stats_add(pool, namev[i]);
+	free(namev[i]);
+    }
+    free(namev);
+}
+
+/* computes statistics for the given files and every IGC and tnb file in the
+ * given directories, in that order */
+stats_t *stats_new(const char **paths, int pathc, int *statsc)
+{
+    pool_t pool;
+    memset(&pool, 0, sizeof pool);
+    int i;
+    for (i = 0; i < pathc; ++i) {
+	struct stat st;
+	if (stat(paths[i], &st) == -1)
+	    error("stat: %s: %s", paths[i], strerror(errno));
+	if (S_ISDIR(st.st_mode))
+	    stats_walk(&pool, paths[i]);
+	else
+	    stats_add(&pool, paths[i]);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.workerc = cpus < 1 ? 1 : cpus > pool.statsc ? pool.statsc : cpus;
+    pool.workerv = alloc((pool.workerc + 1) * sizeof(worker_t));
+    for (i = 0; i < pool.workerc; ++i) {
+	worker_t *worker = pool.workerv + i;
+	worker->pool = &pool;
+	worker->id = i;
+	worker->head = (long) pool.statsc * i / pool.workerc;
+	worker->tail = (long) pool.statsc * (i + 1) / pool.workerc;
+	pthread_mutex_init(&worker->mutex, 0);
+    }
+    /* the calling thread is worker 0 */
+    for (i = 1; i < pool.workerc; ++i) {
+	int rc = pthread_create(&pool.workerv[i].thread, 0, worker_main, pool.workerv + i);
+	if (rc)
+	    DIE("pthread_create", rc);
+    }
+    if (pool.workerc)
+	worker_main(pool.workerv);
+    for (i = 0; i < pool.workerc; ++i) {
+	worker_t *worker = pool.workerv + i;
+	if (i) {
+	    int rc = pthread_join(worker->thread, 0);
+	    if (rc)
+		DIE("pthread_join", rc);
+	}
+	pthread_mutex_destroy(&worker->mutex);
+	free(worker->time);
+	free(worker->altitude);
+	free(worker->lat);
+	free(worker->lon);
+	free(worker->x);
+	free(worker->y);
+	free(worker->z);
+    }
+    free(pool.workerv);
+    *statsc = pool.statsc;
+    return pool.statsv;
+}
+
+void stats_delete(stats_t *statsv, int statsc)
+{
+    int i;
+    for (i = 0; i < statsc; ++i)
+	free(statsv[i].filename);
+    free(statsv);
+}
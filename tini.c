@@ -19,12 +19,17 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <glob.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
-#include <sys/times.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -34,12 +39,48 @@
 #define DEVICE "/dev/ttyS0"
 #endif
 
+#define WATCH_DIRECTORY "/dev"
+/* USB serial adapters, not the virtual consoles */
+#define WATCH_PATTERN "tty[A-Z]*"
+
 const char *program_name = 0;
-const char *device = 0;
+const char **devices = 0;
+int devicec = 0;
 igc_filename_format_t igc_filename_format = igc_filename_format_long;
 FILE *logfile = 0;
 int overwrite = 0;
+int pipeline = 0;
+int uring = 0;
 int quiet = 0;
+track_format_t track_format = track_format_igc;
+filter_t filter;
+int csv = 0;
+FILE *statsfile = 0;
+capture_t *capture = 0;
+char *archive = 0;
+sync_policy_t sync_policy = sync_policy_session;
+int write_buffer = WRITE_BUFFER;
+int progress_fd = -1;
+int first_byte_ms = 0;
+int inter_byte_ms = 0;
+
+/* long options without a short equivalent */
+enum {
+    OPTION_SINCE = 256,
+    OPTION_UNTIL,
+    OPTION_SERIAL,
+    OPTION_MIN_DURATION,
+    OPTION_CSV,
+    OPTION_STATS,
+    OPTION_CAPTURE,
+    OPTION_IO_URING,
+    OPTION_ARCHIVE,
+    OPTION_SYNC,
+    OPTION_WRITE_BUFFER,
+    OPTION_PROGRESS,
+    OPTION_FIRST_BYTE_TIMEOUT,
+    OPTION_INTER_BYTE_TIMEOUT,
+};
 
 void error(const char *message, ...)
 {
@@ -69,24 +110,228 @@ void *alloc(int size)
     return p;
 }
 
+static void log_hook(void *data, const char *source, const char *message)
+{
+    if (!quiet)
+	fprintf(stderr, "%s: %s: %s\n", program_name, source, message);
+}
+
+const tini_hooks_t tini_hooks = { 0, log_hook, 0 };
+
+flytec_t *flytec_new(const char *device, FILE *logfile)
+{
+    flytec_t *flytec = flytec_open(device, logfile, &tini_hooks);
+    if (!flytec)
+	error("%s: %s", device, strerror(errno));
+    flytec_set_timing(flytec, first_byte_ms, inter_byte_ms);
+    return flytec;
+}
+
+/* returns the hidden name that filename is written under until it is
+ * complete.  A file left behind by a crash is simply overwritten. */
+char *temp_filename(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    char *temp = alloc(strlen(filename) + 7);
+    sprintf(temp, "%.*s.%s.part", (int) (base - filename), filename, base);
+    return temp;
+}
+
+/* makes the files renamed into directory durable, with one syncfs for the
+ * session policy or one fsync of the directory after the per file
+ * fdatasyncs of the file policy.  Returns -1 with errno set on failure. */
+int sync_session(const char *directory, sync_policy_t policy)
+{
+    if (policy == sync_policy_none)
+	return 0;
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+	return -1;
+    int rc = policy == sync_policy_session ? syncfs(fd) : fsync(fd);
+    int _errno = errno;
+    close(fd);
+    errno = _errno;
+    return rc;
+}
+
+/* prints how the download from flytec went, naming its device if several
+ * are in use */
+void download_report(const flytec_t *flytec, int several, int count, int failed)
+{
+    char prefix[256];
+    if (several)
+	snprintf(prefix, sizeof prefix, "%s: %s", program_name, flytec->device);
+    else
+	snprintf(prefix, sizeof prefix, "%s", program_name);
+    if (flytec->retries)
+	fprintf(stderr, "%s: %ld error%s, %ld retr%s, %ld recovered, %d tracklog%s failed\n", prefix, flytec->errors, flytec->errors == 1 ? "" : "s", flytec->retries, flytec->retries == 1 ? "y" : "ies", flytec->recoveries, failed, failed == 1 ? "" : "s");
+    if (count)
+	fprintf(stderr, "%s: %d tracklog%s downloaded\n", prefix, count, count == 1 ? "" : "s");
+    else if (flytec->trackc == 0)
+	fprintf(stderr, "%s: no tracklogs to download\n", prefix);
+    else
+	fprintf(stderr, "%s: no new tracklogs to download\n", prefix);
+}
+
+/* the command line gives up when libtini does */
+static void flytec_die(flytec_t *flytec)
+{
+    error("%s: %s", flytec->device, flytec->error_message);
+}
+
+static const char *list_unsigned(const char *p, int *result)
+{
+    if (*p < '0' || '9' < *p)
+	return 0;
+    for (*result = 0; '0' <= *p && *p <= '9'; ++p)
+	*result = 10 * *result + *p - '0';
+    return p;
+}
+
+static int interval_compare(const void *a, const void *b)
+{
+    const interval_t *x = a, *y = b;
+    return x->first < y->first ? -1 : x->first > y->first ? 1 : 0;
+}
+
+static void set_add(set_t *set, int first, int last)
+{
+    if (set->intervalc == set->interval_capacity) {
+	set->interval_capacity = set->interval_capacity ? 2 * set->interval_capacity : 8;
+	set->intervalv = realloc(set->intervalv, set->interval_capacity * sizeof(interval_t));
+	if (!set->intervalv)
+	    DIE("realloc", errno);
+    }
+    set->intervalv[set->intervalc].first = first;
+    set->intervalv[set->intervalc].last = last;
+    ++set->intervalc;
+}
+
+/* sorts the intervals and merges those that overlap or touch */
+static void set_normalize(set_t *set)
+{
+    qsort(set->intervalv, set->intervalc, sizeof(interval_t), interval_compare);
+    int i, j = 0;
+    for (i = 1; i < set->intervalc; ++i) {
+	interval_t *interval = set->intervalv + i;
+	if (set->intervalv[j].last == INT_MAX || interval->first <= set->intervalv[j].last + 1) {
+	    if (interval->last > set->intervalv[j].last)
+		set->intervalv[j].last = interval->last;
+	} else {
+	    set->intervalv[++j] = *interval;
+	}
+    }
+    if (set->intervalc)
+	set->intervalc = j + 1;
+}
+
+/* adds a list like 1,3-4,6- to set, which may be null */
+set_t *set_merge(set_t *set, const char *p)
+{
+    if (!*p)
+	goto error;
+    if (!set)
+	set = alloc(sizeof(set_t));
+    while (*p) {
+	while (*p == ',') ++p;
+	int first = INT_MIN, last = INT_MAX;
+	if (*p != '-') {
+	    p = list_unsigned(p, &first);
+	    if (!p) goto error;
+	    last = first;
+	}
+	if (*p == '-') {
+	    ++p;
+	    if (*p == '\0' || *p == ',')
+		last = INT_MAX;
+	    else {
+		p = list_unsigned(p, &last);
+		if (!p) goto error;
+	    }
+	}
+	if (*p == '\0')
+	    ;
+	else if (*p != ',')
+	    goto error;
+	if (first <= last)
+	    set_add(set, first, last);
+    }
+    set_normalize(set);
+    return set;
+error:
+    error("invalid list");
+}
+
+void set_delete(set_t *set)
+{
+    if (set) {
+	free(set->intervalv);
+	free(set);
+    }
+}
+
+/* bisects for the last interval starting at or before element */
+int set_include(set_t *set, int element)
+{
+    int lo = 0, hi = set->intervalc;
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+	if (set->intervalv[mid].first <= element)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo && element <= set->intervalv[lo - 1].last;
+}
+
 static void usage(void)
 {
     printf("%s - download tracklogs from Brauniger and Flytec flight recorders\n"
 	    "Usage: %s [options] [command]\n"
 	    "Options:\n"
 	    "\t-h, --help\t\tshow some help\n"
-	    "\t-d, --device=DEVICE\tselect device (default is %s)\n"
+	    "\t-d, --device=DEVICE\tselect device, repeat or use a glob to\n"
+	    "\t\t\t\tdownload from several (default is %s)\n"
 	    "\t-D, --directory=DIR\tdownload tracklogs to DIR\n"
+	    "\t-f, --format=FORMAT\tstore tracklogs as igc (default), tnb, gpx\n"
+	    "\t\t\t\tor kml\n"
 	    "\t-l, --log=FILENAME\tlog communication to FILENAME\n"
-	    "\t-m, --manufacturer=STRING override manufacturer\n"
+	    "\t-m, --manufacturer=STRING\n"
+	    "\t\t\t\toverride manufacturer\n"
 	    "\t-s, --short-filenames\tuse short filename style\n"
 	    "\t-o, --overwrite\t\toverwrite existing IGC files\n"
+	    "\t-p, --pipeline\t\tuse reader and writer threads to download\n"
 	    "\t-q, --quiet\t\tdon't output aything\n"
+	    "\t--since=DATE\t\tonly tracklogs starting on or after DATE\n"
+	    "\t--until=DATE\t\tonly tracklogs starting on or before DATE\n"
+	    "\t--serial=NUMBER\t\tonly tracklogs from this serial number\n"
+	    "\t--min-duration=HH:MM\tonly tracklogs at least this long\n"
+	    "\t--csv\t\t\toutput statistics as CSV instead of YAML\n"
+	    "\t--stats\t\t\tprint timing and I/O statistics to stderr\n"
+	    "\t--capture=FILENAME\trecord all communication in binary to FILENAME\n"
+	    "\t--io-uring\t\tlike -p, with io_uring where available\n"
+	    "\t--archive=DIR\t\tstore tracklogs once in DIR and link to them\n"
+	    "\t--sync=POLICY\t\tflush to disk once per session (default), per\n"
+	    "\t\t\t\tfile or none\n"
+	    "\t--write-buffer=SIZE\tbuffer SIZE bytes of each file (default 1M)\n"
+	    "\t--progress=text\t\tdraw a progress bar (default)\n"
+	    "\t--progress=json[:FD]\treport progress as JSON lines on FD (default 2)\n"
+	    "\t--first-byte-timeout=MS\twait MS milliseconds for each response\n"
+	    "\t--inter-byte-timeout=MS\twait MS milliseconds between reads\n"
 	    "Commands:\n"
 	    "\tid\t\t\tidentify flight recorder\n"
 	    "\tli, list\t\tlist tracklogs\n"
 	    "\tdo, download [LIST]\tdownload tracklogs (default is all)\n"
 	    "\tig, igc\t\t\twrite currently selected tracklog to stdout\n"
+	    "\texport-igc FILE\t\twrite a tnb file to stdout as IGC\n"
+	    "\texport FORMAT FILE\twrite a tracklog to stdout as igc, gpx or kml\n"
+	    "\tlog-dump FILE\t\twrite a --capture file to stdout as a -l log\n"
+	    "\tindex [DIR]\t\tcatalog the tracklogs in DIR\n"
+	    "\tquery [DIR]\t\tlist cataloged tracklogs matching the filters\n"
+	    "\twatch [DIR]\t\tdownload from each FR plugged in (default /dev)\n"
+	    "\tstats PATH...\t\tflight statistics for files and directories\n"
+	    "\tverify\t\t\tcheck every tracklog in the --archive\n"
 	    "Supported flight recorders:\n"
 	    "\tBrauniger Galileo, Compeo and Competino\n"
 	    "\tFlytec 5020 and 5030\n",
@@ -94,107 +339,242 @@ static void usage(void)
 }
 
 typedef struct {
+    flytec_t *flytec;
     track_t *track;
+    manifest_claim_t *claim;
+    int fd;
     FILE *file;
-    int percentage;
-    struct tm tm;
-    int _sc_clk_tck;
-    clock_t clock;
-    int remaining_sec;
+    writer_t *writer;
+    tnb_encoder_t *tnb;
+    export_encoder_t *export;
+    archive_object_t *object;
+    progress_t progress;
 } download_data_t;
 
-static void download_callback(void *data, const char *line)
+static void download_write(download_data_t *download_data, const char *buf, int len)
+{
+    long nsec = now_nsec();
+    if (download_data->object)
+	archive_object_write(download_data->object, buf, len);
+    else if (download_data->writer)
+	writer_write(download_data->writer, buf, len);
+    else if (fwrite(buf, 1, len, download_data->file) != (size_t) len)
+	DIE("fwrite", errno);
+    download_data->flytec->write_nsec += now_nsec() - nsec;
+}
+
+static void download_flush(download_data_t *download_data)
+{
+    if (download_data->tnb) {
+	download_write(download_data, download_data->tnb->buf, download_data->tnb->len);
+	download_data->tnb->len = 0;
+    } else {
+	download_write(download_data, download_data->export->buf, download_data->export->len);
+	download_data->export->len = 0;
+    }
+}
+
+/* receives a batch of complete lines */
+static void download_callback(void *data, const char *buf, int len)
+{
+    download_data_t *download_data = data;
+    if (download_data->tnb) {
+	tnb_encode(download_data->tnb, buf, len);
+	download_flush(download_data);
+    } else if (download_data->export) {
+	export_encode(download_data->export, buf, len);
+	if (download_data->export->len >= EXPORT_BLOCK)
+	    download_flush(download_data);
+    } else {
+	download_write(download_data, buf, len);
+    }
+    progress_bytes(&download_data->progress, buf, len);
+}
+
+/* downloads one tracklog, opening its file again after a failed attempt */
+static int download_track(flytec_t *flytec, void *data)
 {
     download_data_t *download_data = data;
-    if (fputs(line, download_data->file) == EOF)
-	DIE("fputs", errno);
-    if (!quiet && igc_tm_update(&download_data->tm, line) && line[0] == 'B') {
-	time_t time = mktime(&download_data->tm);
-	int percentage = 100 * (time - download_data->track->time) / (download_data->track->duration ? download_data->track->duration : 1);
-	if (percentage < 0)
-	    percentage = 0;
-	else if (percentage > 99)
-	    percentage = 99;
-	struct tms tms;
-	clock_t clock = times(&tms);
-	if (clock == (clock_t) -1)
-	    DIE("times", errno);
-	int divisor = download_data->_sc_clk_tck * (download_data->track->time - time);
-	if (divisor == 0)
-	    divisor = 1;
-	int remaining_sec = ((clock - download_data->clock) * (time - download_data->track->time - download_data->track->duration) + download_data->_sc_clk_tck / 2) / divisor;
-	if (remaining_sec < 1)
-	    remaining_sec = 1;
-	else if (remaining_sec > 99 * 60 + 59)
-	    remaining_sec = 99 * 60 + 59;
-	if (percentage != download_data->percentage || remaining_sec < download_data->remaining_sec) {
-	    fprintf(stderr, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b%3d%%  %02d:%02d ETA", percentage, remaining_sec / 60, remaining_sec % 60);
-	    download_data->percentage = percentage;
-	    download_data->remaining_sec = remaining_sec;
+    track_t *track = download_data->track;
+    if (!archive) {
+	download_data->fd = open(download_data->claim->temp, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+	if (download_data->fd == -1)
+	    error("open: %s: %s", download_data->claim->temp, strerror(errno));
+    }
+    if (track_format == track_format_tnb)
+	download_data->tnb = tnb_encoder_new();
+    else if (track_format == track_format_gpx || track_format == track_format_kml)
+	download_data->export = export_encoder_new(track_format);
+    if (archive) {
+	download_data->object = archive_object_new();
+    } else if (download_data->writer) {
+	writer_open(download_data->writer, download_data->fd);
+    } else {
+	download_data->file = fdopen(download_data->fd, "w");
+	if (!download_data->file)
+	    DIE("fdopen", errno);
+	if (setvbuf(download_data->file, 0, _IOFBF, write_buffer))
+	    DIE("setvbuf", errno);
+    }
+    progress_start(&download_data->progress, progress_fd, !quiet && progress_fd == -1, flytec->device, track, download_data->claim->filename);
+    if (flytec_pbrtr_lines(flytec, track, download_callback, download_data) == -1)
+	return -1;
+    if (download_data->tnb) {
+	download_flush(download_data);
+	tnb_encoder_delete(download_data->tnb);
+	download_data->tnb = 0;
+    }
+    if (download_data->export) {
+	export_finish(download_data->export);
+	download_flush(download_data);
+	export_encoder_delete(download_data->export);
+	download_data->export = 0;
+    }
+    long nsec = now_nsec();
+    if (download_data->object) {
+	int rc = archive_object_link(download_data->object, archive, download_data->claim->temp, sync_policy);
+	if (rc == -1)
+	    error("archive: %s: %s", download_data->claim->filename, strerror(errno));
+	if (manifest_publish(download_data->claim) == -1)
+	    error("rename: %s: %s", download_data->claim->temp, strerror(errno));
+	if (flytec->logfile)
+	    fprintf(flytec->logfile, "# archive: %s: %s\n", download_data->claim->filename, rc ? "stored" : "duplicate");
+	archive_object_delete(download_data->object);
+	download_data->object = 0;
+    } else {
+	if (download_data->writer) {
+	    int rc = writer_close(download_data->writer, sync_policy == sync_policy_file);
+	    if (rc)
+		error("write: %s: %s", download_data->claim->temp, strerror(rc));
+	} else {
+	    if (fflush(download_data->file) == EOF)
+		error("write: %s: %s", download_data->claim->temp, strerror(errno));
+	    if (sync_policy == sync_policy_file && fdatasync(download_data->fd) == -1)
+		error("fdatasync: %s: %s", download_data->claim->temp, strerror(errno));
+	    if (fclose(download_data->file) == EOF)
+		DIE("fclose", errno);
 	}
+	if (manifest_publish(download_data->claim) == -1)
+	    error("rename: %s: %s", download_data->claim->temp, strerror(errno));
     }
+    download_data->file = 0;
+    download_data->fd = -1;
+    flytec->close_nsec += now_nsec() - nsec;
+    progress_done(&download_data->progress, download_data->claim->filename);
+    return 0;
 }
 
-static void tini_download(flytec_t *flytec, set_t *indexes, const char *manufacturer, igc_filename_format_t igc_filename_format)
+/* throws away the partial file of a failed attempt */
+static void download_reset(flytec_t *flytec, void *data)
+{
+    download_data_t *download_data = data;
+    progress_error(&download_data->progress, flytec->error_message, 0);
+    tnb_encoder_delete(download_data->tnb);
+    download_data->tnb = 0;
+    export_encoder_delete(download_data->export);
+    download_data->export = 0;
+    archive_object_delete(download_data->object);
+    download_data->object = 0;
+    if (download_data->writer && download_data->fd != -1)
+	writer_close(download_data->writer, 0);
+    else if (download_data->file)
+	fclose(download_data->file);
+    else if (download_data->fd != -1)
+	close(download_data->fd);
+    download_data->file = 0;
+    download_data->fd = -1;
+    if (unlink(download_data->claim->temp) == -1 && errno != ENOENT)
+	error("unlink: %s: %s", download_data->claim->temp, strerror(errno));
+}
+
+/* returns the number of tracklogs that could not be downloaded */
+static int tini_download(flytec_t *flytec, set_t *indexes, const char *manufacturer, igc_filename_format_t igc_filename_format)
 {
     int count = 0;
-    track_t **ptrack;
-    for (ptrack = flytec_pbrtl(flytec, manufacturer, igc_filename_format); *ptrack; ++ptrack) {
-	track_t *track = *ptrack;
+    track_t **trackv = flytec_pbrtl(flytec, manufacturer, igc_filename_format);
+    if (!trackv)
+	flytec_die(flytec);
+    manifest_t *manifest = manifest_load(".");
+    if (!manifest)
+	error("%s: %s", MANIFEST_FILENAME, strerror(errno));
+    writer_t *writer = 0;
+    if (pipeline) {
+	if (flytec_reader_start(flytec, uring) == -1)
+	    DIE("flytec_reader_start", errno);
+	if (!archive) {
+	    writer = writer_new(&tini_hooks, write_buffer, uring);
+	    if (!writer)
+		DIE("writer_new", errno);
+	}
+    }
+    int *downloaded = alloc((flytec->trackc + 1) * sizeof(int));
+    /* resolve oldest first so that new daily flight indexes follow the
+     * flights already archived */
+    int i;
+    for (i = flytec->trackc - 1; i >= 0; --i) {
+	track_t *track = trackv[i];
 	if (indexes && !set_include(indexes, track->index + 1))
-	    continue;
-	if (!overwrite) {
-	    struct stat buf;
-	    if (stat(track->igc_filename, &buf) == 0)
-		continue;
-	    if (errno != ENOENT)
-		DIE("stat", errno);
+	    downloaded[i] = 1;
+	else if (!filter_match(&filter, flytec->serial_number, track->time, track->duration))
+	    downloaded[i] = 1;
+	else {
+	    int rc = manifest_resolve(manifest, flytec->serial_number, track, manufacturer, igc_filename_format);
+	    if (rc == -1)
+		error("%s: %s", track->igc_filename, strerror(errno));
+	    if (rc)
+		downloaded[i] = !overwrite;
 	}
-	if (!quiet)
-	    fprintf(stderr, "%s: downloading %s  ", program_name, track->igc_filename);
+    }
+    int failed = 0;
+    for (i = 0; i < flytec->trackc; ++i) {
+	track_t *track = trackv[i];
+	if (downloaded[i])
+	    continue;
+	manifest_claim_t claim = { manifest, flytec->serial_number, track, manufacturer, igc_filename_format, 0, track_format };
+	if (manifest_claim(&claim) == -1)
+	    error("%s: %s", claim.filename ? claim.filename : track->igc_filename, strerror(errno));
 	download_data_t download_data;
 	memset(&download_data, 0, sizeof download_data);
+	download_data.flytec = flytec;
 	download_data.track = track;
-	download_data.file = fopen(track->igc_filename, "w");
-	if (!download_data.file)
-	    error("fopen: %s: %s", track->igc_filename, strerror(errno));
-	download_data._sc_clk_tck = sysconf(_SC_CLK_TCK);
-	if (download_data._sc_clk_tck == -1)
-	    DIE("sysconf", errno);
-	struct tms tms;
-	download_data.clock = times(&tms);
-	if (download_data.clock == (clock_t) -1)
-	    DIE("times", errno);
-	if (!quiet)
-	    fprintf(stderr, "  0%%           ");
-	flytec_pbrtr(flytec, track, download_callback, &download_data);
-	if (fclose(download_data.file) == EOF)
-	    DIE("fclose", errno);
-	if (!quiet) {
-	    struct tms tms;
-	    clock_t clock = times(&tms);
-	    if (clock == (clock_t) -1)
-		DIE("times", errno);
-	    int sec = (clock - download_data.clock + download_data._sc_clk_tck / 2) / download_data._sc_clk_tck;
-	    if (sec > 99 * 60 + 59)
-		sec = 99 * 60 + 59;
-	    fprintf(stderr, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b100%%  %02d:%02d    \n", sec / 60, sec % 60);
+	download_data.claim = &claim;
+	download_data.fd = -1;
+	download_data.writer = writer;
+	if (flytec_retry(flytec, download_track, download_reset, &download_data) == 0) {
+	    if (manifest_add(manifest, flytec->serial_number, track, track->igc_filename) == -1)
+		error("%s: %s", MANIFEST_FILENAME, strerror(errno));
+	    ++count;
+	} else {
+	    progress_error(&download_data.progress, flytec->error_message, 1);
+	    fprintf(stderr, "%s: %s: %s, giving up on %s\n", program_name, flytec->device, flytec->error_message, claim.filename);
+	    ++failed;
 	}
-	++count;
+	manifest_claim_free(&claim);
     }
-    if (!quiet) {
-	if (count)
-	    fprintf(stderr, "%s: %d tracklog%s downloaded\n", program_name, count, count == 1 ? "" : "s");
-	else if (*flytec_pbrtl(flytec, manufacturer, igc_filename_format) == 0)
-	    fprintf(stderr, "%s: no tracklogs to download\n", program_name);
-	else
-	    fprintf(stderr, "%s: no new tracklogs to download\n", program_name);
+    if (count && sync_session(archive ? archive : ".", sync_policy) == -1)
+	error("sync: %s", strerror(errno));
+    if (!quiet)
+	download_report(flytec, 0, count, failed);
+    if (writer) {
+	flytec_reader_stop(flytec);
+	if (flytec->logfile) {
+	    unsigned int high;
+	    long writes, stalls;
+	    int writer_uring;
+	    writer_stats(writer, &high, &writes, &stalls, &writer_uring);
+	    fprintf(flytec->logfile, "# writer: %u bytes high water, %ld writes, %ld stalls%s\n", high, writes, stalls, writer_uring ? ", io_uring" : "");
+	}
+	writer_delete(writer);
     }
+    free(downloaded);
+    manifest_delete(manifest);
+    return failed;
 }
 
 static void tini_id(flytec_t *flytec)
 {
-    flytec_pbrsnp(flytec);
+    if (!flytec_pbrsnp(flytec))
+	flytec_die(flytec);
     printf("--- \n");
     printf("instrument_id: \"%s\"\n", flytec->snp->instrument_id);
     printf("pilot_name: \"%s\"\n", flytec->pilot_name);
@@ -202,23 +582,118 @@ static void tini_id(flytec_t *flytec)
     printf("software_version: \"%s\"\n", flytec->snp->software_version);
 }
 
-static void igc_callback(void *data, const char *line)
+static void igc_callback(void *data, const char *buf, int len)
 {
     FILE *file = data;
-    if (!fputs(line, file))
-	DIE("fputs", errno);
+    if (fwrite(buf, 1, len, file) != (size_t) len)
+	DIE("fwrite", errno);
 }
 
 static void tini_igc(flytec_t *flytec)
 {
-    flytec_pbrigc(flytec, igc_callback, stdout);
+    if (flytec_pbrigc_lines(flytec, igc_callback, stdout) == -1)
+	flytec_die(flytec);
+}
+
+/* writes a tnb file as IGC, or an IGC or tnb file as GPX or KML */
+static void tini_export(const char *filename, track_format_t format)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+	error("open: %s: %s", filename, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+	error("fstat: %s: %s", filename, strerror(errno));
+    void *buf = 0;
+    if (st.st_size) {
+	buf = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+	    error("mmap: %s: %s", filename, strerror(errno));
+    }
+    /* write errors end in DIE with their errno, so failure means bad input */
+    if (st.st_size >= 4 && !memcmp(buf, TNB_MAGIC, 4)) {
+	if (format == track_format_igc ? !tnb_export_igc(buf, st.st_size, stdout) : !export_track(buf, st.st_size, format, stdout))
+	    error("%s: invalid tnb file", filename);
+    } else if (!st.st_size || *(const char *) buf != 'A') {
+	/* every IGC file starts with the A record */
+	error("%s: invalid IGC file", filename);
+    } else if (format == track_format_igc) {
+	if (fwrite(buf, 1, st.st_size, stdout) != (size_t) st.st_size)
+	    DIE("fwrite", errno);
+    } else {
+	export_track(buf, st.st_size, format, stdout);
+    }
+    if (buf)
+	munmap(buf, st.st_size);
+    close(fd);
+}
+
+static void query_callback(void *data, const index_entry_t *entry)
+{
+    time_t time = entry->time;
+    char buf[128];
+    if (!strftime(buf, sizeof buf, "%Y-%m-%d %H:%M:%S +00:00", gmtime(&time)))
+	DIE("strftime", errno);
+    int duration = entry->duration;
+    printf("- filename: %s\n", entry->filename);
+    printf("  manufacturer: %.3s\n", entry->manufacturer);
+    printf("  serial_number: %d\n", entry->serial_number);
+    printf("  time: %s\n", buf);
+    printf("  duration: \"%02d:%02d:%02d\"\n", duration / 3600, (duration / 60) % 60, duration % 60);
+    printf("  size: %lld\n", (long long) entry->size);
+    printf("  b_records: %d\n", entry->b_records);
+}
+
+static void tini_query(const char *directory)
+{
+    printf("--- \n");
+    if (index_query(directory, &filter, query_callback, 0) == 0 && !quiet)
+	fprintf(stderr, "%s: no matching tracklogs\n", program_name);
+}
+
+static void tini_stats(const char **paths, int pathc)
+{
+    int statsc = 0;
+    stats_t *statsv = stats_new(paths, pathc, &statsc);
+    if (csv)
+	printf("filename,time,airtime,b_records,max_altitude,max_climb,max_sink,distance\n");
+    else
+	printf("--- \n");
+    int i;
+    for (i = 0; i < statsc; ++i) {
+	const stats_t *stats = statsv + i;
+	if (stats->error) {
+	    fprintf(stderr, "%s: %s: %s\n", program_name, stats->filename, stats->error == EINVAL ? "invalid tracklog" : strerror(stats->error));
+	    continue;
+	}
+	char time[128];
+	if (!strftime(time, sizeof time, "%Y-%m-%d %H:%M:%S +00:00", gmtime(&stats->time)))
+	    DIE("strftime", errno);
+	int airtime = stats->airtime;
+	if (csv) {
+	    printf("\"%s\",%s,%02d:%02d:%02d,%d,%d,%.1f,%.1f,%.3f\n", stats->filename, time, airtime / 3600, (airtime / 60) % 60, airtime % 60, stats->b_records, stats->max_altitude, stats->max_climb, stats->max_sink, stats->distance);
+	} else {
+	    printf("- filename: %s\n", stats->filename);
+	    printf("  time: %s\n", time);
+	    printf("  airtime: \"%02d:%02d:%02d\"\n", airtime / 3600, (airtime / 60) % 60, airtime % 60);
+	    printf("  b_records: %d\n", stats->b_records);
+	    printf("  max_altitude: %d\n", stats->max_altitude);
+	    printf("  max_climb: %.1f\n", stats->max_climb);
+	    printf("  max_sink: %.1f\n", stats->max_sink);
+	    printf("  distance: %.3f\n", stats->distance);
+	}
+    }
+    stats_delete(statsv, statsc);
 }
 
 static void tini_list(flytec_t *flytec, const char *manufacturer, igc_filename_format_t igc_filename_format)
 {
+    track_t **trackv = flytec_pbrtl(flytec, manufacturer, igc_filename_format);
+    if (!trackv)
+	flytec_die(flytec);
     track_t **ptrack;
     printf("--- \n");
-    for (ptrack = flytec_pbrtl(flytec, manufacturer, igc_filename_format); *ptrack; ++ptrack) {
+    for (ptrack = trackv; *ptrack; ++ptrack) {
 	track_t *track = *ptrack;
 	char time[128];
 	if (!strftime(time, sizeof time, "%Y-%m-%d %H:%M:%S +00:00", gmtime(&track->time)))
@@ -229,38 +704,110 @@ static void tini_list(flytec_t *flytec, const char *manufacturer, igc_filename_f
 	printf("  duration: \"%02d:%02d:%02d\"\n", duration / 3600, (duration / 60) % 60, duration % 60);
 	printf("  igc_filename: %s\n", track->igc_filename);
     }
-    if (!quiet && *flytec_pbrtl(flytec, manufacturer, igc_filename_format) == 0)
+    if (!quiet && *trackv == 0)
 	fprintf(stderr, "%s: no tracklogs\n", program_name);
 }
 
+static void add_device(const char *device)
+{
+    devices = realloc(devices, (devicec + 1) * sizeof(const char *));
+    if (!devices)
+	DIE("realloc", errno);
+    devices[devicec++] = device;
+}
+
+static void add_devices(const char *pattern)
+{
+    if (!strpbrk(pattern, "*?[")) {
+	add_device(pattern);
+	return;
+    }
+    glob_t glob_result;
+    int rc = glob(pattern, 0, 0, &glob_result);
+    if (rc == GLOB_NOMATCH)
+	error("%s: no matching devices", pattern);
+    else if (rc != 0)
+	DIE("glob", rc == GLOB_NOSPACE ? ENOMEM : 0);
+    size_t i;
+    for (i = 0; i < glob_result.gl_pathc; ++i) {
+	char *device = alloc(strlen(glob_result.gl_pathv[i]) + 1);
+	strcpy(device, glob_result.gl_pathv[i]);
+	add_device(device);
+    }
+    globfree(&glob_result);
+}
+
+/* flushes the capture however tini exits */
+static void capture_exit(void)
+{
+    if (capture_delete(capture) == -1)
+	fprintf(stderr, "%s: capture: %s\n", program_name, strerror(errno));
+    capture = 0;
+}
+
+static void download_options_init(download_options_t *options, const char *manufacturer)
+{
+    memset(options, 0, sizeof(download_options_t));
+    options->logfile = logfile;
+    options->manufacturer = manufacturer;
+    options->igc_filename_format = igc_filename_format;
+    options->track_format = track_format;
+    options->statsfile = statsfile;
+    options->capture = capture;
+    options->overwrite = overwrite;
+    options->quiet = quiet;
+    options->filter = &filter;
+    options->archive = archive;
+    options->sync_policy = sync_policy;
+    options->write_buffer = write_buffer;
+    options->progress_fd = progress_fd;
+    options->first_byte_ms = first_byte_ms;
+    options->inter_byte_ms = inter_byte_ms;
+}
+
 int main(int argc, char *argv[])
 {
     program_name = strrchr(argv[0], '/');
     program_name = program_name ? program_name + 1 : argv[0];
 
     const char *manufacturer = 0;
-
-    device = getenv("TINI_DEVICE");
-    if (!device)
-	device = DEVICE;
+    const char *device_pattern = 0;
 
     setenv("TZ", "UTC", 1);
     tzset();
 
+    filter_init(&filter);
+
     opterr = 0;
     while (1) {
 	static struct option options[] = {
 	    { "device",          required_argument, 0, 'd' },
 	    { "directory",       required_argument, 0, 'D' },
+	    { "format",          required_argument, 0, 'f' },
 	    { "help",            no_argument,       0, 'h' },
 	    { "overwrite",       no_argument,       0, 'o' },
+	    { "pipeline",        no_argument,       0, 'p' },
 	    { "quiet",           no_argument,       0, 'q' },
 	    { "manufacturer",    required_argument, 0, 'm' },
 	    { "short-filenames", no_argument,       0, 's' },
 	    { "log",             required_argument, 0, 'l' },
+	    { "since",           required_argument, 0, OPTION_SINCE },
+	    { "until",           required_argument, 0, OPTION_UNTIL },
+	    { "serial",          required_argument, 0, OPTION_SERIAL },
+	    { "min-duration",    required_argument, 0, OPTION_MIN_DURATION },
+	    { "csv",             no_argument,       0, OPTION_CSV },
+	    { "stats",           no_argument,       0, OPTION_STATS },
+	    { "capture",         required_argument, 0, OPTION_CAPTURE },
+	    { "io-uring",        no_argument,       0, OPTION_IO_URING },
+	    { "archive",         required_argument, 0, OPTION_ARCHIVE },
+	    { "sync",            required_argument, 0, OPTION_SYNC },
+	    { "write-buffer",    required_argument, 0, OPTION_WRITE_BUFFER },
+	    { "progress",        required_argument, 0, OPTION_PROGRESS },
+	    { "first-byte-timeout", required_argument, 0, OPTION_FIRST_BYTE_TIMEOUT },
+	    { "inter-byte-timeout", required_argument, 0, OPTION_INTER_BYTE_TIMEOUT },
 	    { 0,                 0,                 0, 0 },
 	};
-	int c = getopt_long(argc, argv, ":D:d:hl:m:oqs", options, 0);
+	int c = getopt_long(argc, argv, ":D:d:f:hl:m:opqs", options, 0);
 	if (c == -1)
 	    break;
 	switch (c) {
@@ -269,7 +816,20 @@ int main(int argc, char *argv[])
 		    error("chdir: %s: %s", optarg, strerror(errno));
 		break;
 	    case 'd':
-		device = optarg;
+		device_pattern = optarg;
+		add_devices(optarg);
+		break;
+	    case 'f':
+		if (strcmp(optarg, "igc") == 0)
+		    track_format = track_format_igc;
+		else if (strcmp(optarg, "tnb") == 0)
+		    track_format = track_format_tnb;
+		else if (strcmp(optarg, "gpx") == 0)
+		    track_format = track_format_gpx;
+		else if (strcmp(optarg, "kml") == 0)
+		    track_format = track_format_kml;
+		else
+		    error("invalid format '%s'", optarg);
 		break;
 	    case 'h':
 		usage();
@@ -289,12 +849,96 @@ int main(int argc, char *argv[])
 	    case 'o':
 		overwrite = 1;
 		break;
+	    case 'p':
+		pipeline = 1;
+		break;
 	    case 'q':
 		quiet = 1;
 		break;
 	    case 's':
 		igc_filename_format = igc_filename_format_short;
 		break;
+	    case OPTION_SINCE:
+		if (!time_parse(optarg, 0, &filter.since))
+		    error("invalid time '%s'", optarg);
+		break;
+	    case OPTION_UNTIL:
+		if (!time_parse(optarg, 1, &filter.until))
+		    error("invalid time '%s'", optarg);
+		break;
+	    case OPTION_SERIAL:
+		if (sscanf(optarg, "%d", &filter.serial_number) != 1 || filter.serial_number < 0)
+		    error("invalid serial number '%s'", optarg);
+		break;
+	    case OPTION_CSV:
+		csv = 1;
+		break;
+	    case OPTION_STATS:
+		statsfile = stderr;
+		break;
+	    case OPTION_IO_URING:
+		pipeline = 1;
+		uring = 1;
+		break;
+	    case OPTION_ARCHIVE:
+		free(archive);
+		archive = archive_open(optarg);
+		if (!archive)
+		    error("%s: %s", optarg, strerror(errno));
+		break;
+	    case OPTION_CAPTURE:
+		if (!capture) {
+		    capture = capture_new(&tini_hooks, optarg);
+		    if (!capture)
+			error("%s: %s", optarg, strerror(errno));
+		    atexit(capture_exit);
+		}
+		break;
+	    case OPTION_SYNC:
+		if (strcmp(optarg, "none") == 0)
+		    sync_policy = sync_policy_none;
+		else if (strcmp(optarg, "file") == 0)
+		    sync_policy = sync_policy_file;
+		else if (strcmp(optarg, "session") == 0)
+		    sync_policy = sync_policy_session;
+		else
+		    error("invalid sync policy '%s'", optarg);
+		break;
+	    case OPTION_WRITE_BUFFER:
+		{
+		    char unit = 0;
+		    if (sscanf(optarg, "%d%c", &write_buffer, &unit) < 1 || write_buffer <= 0)
+			error("invalid size '%s'", optarg);
+		    if (unit == 'k' || unit == 'K')
+			write_buffer <<= 10;
+		    else if (unit == 'm' || unit == 'M')
+			write_buffer <<= 20;
+		    else if (unit)
+			error("invalid size '%s'", optarg);
+		}
+		break;
+	    case OPTION_PROGRESS:
+		if (strcmp(optarg, "text") == 0)
+		    progress_fd = -1;
+		else if (strcmp(optarg, "json") == 0)
+		    progress_fd = STDERR_FILENO;
+		else if (sscanf(optarg, "json:%d", &progress_fd) != 1 || progress_fd < 0)
+		    error("invalid progress '%s'", optarg);
+		else if (fcntl(progress_fd, F_GETFD) == -1)
+		    error("--progress: %d: %s", progress_fd, strerror(errno));
+		break;
+	    case OPTION_FIRST_BYTE_TIMEOUT:
+		if (sscanf(optarg, "%d", &first_byte_ms) != 1 || first_byte_ms <= 0)
+		    error("invalid timeout '%s'", optarg);
+		break;
+	    case OPTION_INTER_BYTE_TIMEOUT:
+		if (sscanf(optarg, "%d", &inter_byte_ms) != 1 || inter_byte_ms <= 0)
+		    error("invalid timeout '%s'", optarg);
+		break;
+	    case OPTION_MIN_DURATION:
+		if (!duration_parse(optarg, &filter.min_duration))
+		    error("invalid duration '%s'", optarg);
+		break;
 	    case ':':
 		error("option '%c' requires an argument", optopt);
 	    case '?':
@@ -302,9 +946,98 @@ int main(int argc, char *argv[])
 	}
     }
 
-    flytec_t *flytec = flytec_new(device, logfile);
+    /* commands that do not talk to a device */
+    if (optind != argc && strcmp(argv[optind], "log-dump") == 0) {
+	if (optind + 2 != argc)
+	    error("log-dump requires a single filename");
+	int rc = capture_dump(&tini_hooks, argv[optind + 1], stdout);
+	if (rc == -1)
+	    error("%s: %s", argv[optind + 1], strerror(errno));
+	else if (rc == 0)
+	    error("%s: not a capture", argv[optind + 1]);
+	if (fflush(stdout) == EOF)
+	    DIE("fflush", errno);
+	return EXIT_SUCCESS;
+    } else if (optind != argc && strcmp(argv[optind], "export-igc") == 0) {
+	if (optind + 2 != argc)
+	    error("export-igc requires a single filename");
+	tini_export(argv[optind + 1], track_format_igc);
+	if (fflush(stdout) == EOF)
+	    DIE("fflush", errno);
+	return EXIT_SUCCESS;
+    } else if (optind != argc && strcmp(argv[optind], "export") == 0) {
+	if (optind + 3 != argc)
+	    error("export requires a format and a single filename");
+	track_format_t format;
+	if (strcmp(argv[optind + 1], "igc") == 0)
+	    format = track_format_igc;
+	else if (strcmp(argv[optind + 1], "gpx") == 0)
+	    format = track_format_gpx;
+	else if (strcmp(argv[optind + 1], "kml") == 0)
+	    format = track_format_kml;
+	else
+	    error("invalid export format '%s'", argv[optind + 1]);
+	tini_export(argv[optind + 2], format);
+	if (fflush(stdout) == EOF)
+	    DIE("fflush", errno);
+	return EXIT_SUCCESS;
+    } else if (optind != argc && (strcmp(argv[optind], "index") == 0 || strcmp(argv[optind], "query") == 0)) {
+	if (optind + 2 < argc)
+	    error("excess arguments on command line");
+	const char *directory = optind + 1 < argc ? argv[optind + 1] : ".";
+	if (strcmp(argv[optind], "index") == 0)
+	    index_update(directory, quiet);
+	else
+	    tini_query(directory);
+	return EXIT_SUCCESS;
+    } else if (optind != argc && strcmp(argv[optind], "stats") == 0) {
+	if (optind + 1 == argc)
+	    error("stats requires at least one file or directory");
+	tini_stats((const char **) argv + optind + 1, argc - optind - 1);
+	return EXIT_SUCCESS;
+    } else if (optind != argc && strcmp(argv[optind], "verify") == 0) {
+	if (optind + 1 != argc)
+	    error("excess arguments on command line");
+	if (!archive)
+	    error("verify requires --archive");
+	return archive_verify(archive) ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else if (optind != argc && strcmp(argv[optind], "watch") == 0) {
+	if (optind + 2 < argc)
+	    error("excess arguments on command line");
+	download_options_t options;
+	download_options_init(&options, manufacturer);
+	int failures = watch(optind + 1 < argc ? argv[optind + 1] : WATCH_DIRECTORY, WATCH_PATTERN, &options);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (devicec == 0) {
+	device_pattern = getenv("TINI_DEVICE");
+	add_devices(device_pattern ? device_pattern : DEVICE);
+    }
+
+    if (devicec > 1 || (device_pattern && strpbrk(device_pattern, "*?["))) {
+	if (optind != argc && strcmp(argv[optind], "do") != 0 && strcmp(argv[optind], "download") != 0)
+	    error("only the download command supports several devices");
+	if (optind != argc)
+	    ++optind;
+	download_options_t options;
+	download_options_init(&options, manufacturer);
+	for (; optind < argc; ++optind)
+	    options.indexes = set_merge(options.indexes, argv[optind]);
+	int failures = multi_download(devices, devicec, &options);
+	set_delete(options.indexes);
+	if (logfile && logfile != stdout)
+	    fclose(logfile);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    int failures = 0;
+    flytec_t *flytec = flytec_new(devices[0], logfile);
+    flytec->statsfile = statsfile;
+    flytec_set_capture(flytec, capture);
     if (!manufacturer) {
-	flytec_pbrsnp(flytec);
+	if (!flytec_pbrsnp(flytec))
+	    flytec_die(flytec);
 	manufacturer = flytec->manufacturer;
     }
     if (optind == argc || strcmp(argv[optind], "do") == 0 || strcmp(argv[optind], "download") == 0) {
@@ -312,7 +1045,7 @@ int main(int argc, char *argv[])
 	set_t *indexes = 0;
 	for (; optind < argc; ++optind)
 	    indexes = set_merge(indexes, argv[optind]);
-	tini_download(flytec, indexes, manufacturer, igc_filename_format);
+	failures = tini_download(flytec, indexes, manufacturer, igc_filename_format);
 	set_delete(indexes);
     } else {
 	if (optind + 1 != argc)
@@ -332,5 +1065,5 @@ int main(int argc, char *argv[])
     if (logfile && logfile != stdout)
 	fclose(logfile);
 
-    return EXIT_SUCCESS;
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
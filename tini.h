@@ -22,97 +22,306 @@
 #ifndef TINI_H
 #define TINI_H
 
-#include <errno.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
+#include "libtini.h"
 
 #define DIE(syscall, _errno) die(__FILE__, __LINE__, __FUNCTION__, (syscall), (_errno))
 
-#define DATE_NEW(tm) (((tm).tm_year << 9) + ((tm).tm_mon << 5) + (tm).tm_mday)
-#define DATE_YEAR(date) ((date) >> 9)
-#define DATE_MON(date) (((date) >> 5) & 0xf)
-#define DATE_MDAY(date) ((date) & 0x1f)
-
-enum {
-    XON = '\x11',
-    XOFF = '\x13',
-};
+extern const char *program_name;
+extern const tini_hooks_t tini_hooks;
 
 void error(const char *, ...) __attribute__ ((noreturn, format(printf, 1, 2)));
 void die(const char *, int, const char *, const char *, int) __attribute__ ((noreturn));
 void *alloc(int);
 
-typedef struct _set_t {
+typedef struct {
     int first;
     int last;
-    struct _set_t *next;
+} interval_t;
+
+/* sorted intervals, none overlapping or adjacent, open ends are INT_MIN
+ * and INT_MAX */
+typedef struct {
+    int intervalc;
+    int interval_capacity;
+    interval_t *intervalv;
 } set_t;
 
+typedef enum {
+    sync_policy_none,
+    sync_policy_file,
+    sync_policy_session
+} sync_policy_t;
+
+#define WRITE_BUFFER (1 << 20)
+
+char *temp_filename(const char *);
+int sync_session(const char *, sync_policy_t);
+
 set_t *set_merge(set_t *, const char *);
 void set_delete(set_t *);
 int set_include(set_t *, int);
 
 typedef struct {
-    char *instrument_id;
-    char *pilot_name;
+    time_t since;
+    time_t until;
     int serial_number;
-    char *software_version;
-} snp_t;
+    int min_duration;
+} filter_t;
 
-snp_t *snp_new(const char *);
-void snp_delete(snp_t *);
+void filter_init(filter_t *);
+int filter_match(const filter_t *, int, time_t, int);
 
-const char *manufacturer_new(const char *);
+typedef enum {
+    track_format_igc,
+    track_format_tnb,
+    track_format_gpx,
+    track_format_kml
+} track_format_t;
+
+flytec_t *flytec_new(const char *, FILE *);
+void download_report(const flytec_t *, int, int, int);
+char *track_filename(const track_t *, const char *, track_format_t);
+
+#define MANIFEST_FILENAME ".tini-manifest"
 
 typedef struct {
-    int count;
-    int index;
-    int date;
-    int day_index;
+    int serial_number;
     time_t time;
     int duration;
-    char *igc_filename;
-} track_t;
+    char *filename;
+} manifest_entry_t;
+
+typedef struct {
+    const char *directory;
+    char *path;
+    int exists;
+    int legacy;
+    int entryc;
+    int entry_capacity;
+    manifest_entry_t *entryv;
+    int filenamec;
+    int filename_capacity;
+    char **filenamev;
+    int reservedc;
+    char **reservedv;
+} manifest_t;
 
-track_t *track_new(const char *);
-void track_delete(track_t *);
+manifest_t *manifest_load(const char *);
+void manifest_delete(manifest_t *);
+const char *manifest_find(const manifest_t *, int, const track_t *);
+int manifest_filename_used(const manifest_t *, const char *);
+int manifest_resolve(manifest_t *, int, track_t *, const char *, igc_filename_format_t);
+int manifest_assign(manifest_t *, int, track_t *, const char *, igc_filename_format_t);
+int manifest_add(manifest_t *, int, const track_t *, const char *);
+
+/* the file a tracklog is downloaded to, and the hidden name it is written
+ * under until it is complete */
+typedef struct {
+    manifest_t *manifest;
+    int serial_number;
+    track_t *track;
+    const char *manufacturer;
+    igc_filename_format_t igc_filename_format;
+    const char *directory;
+    track_format_t track_format;
+    int ours;
+    char *filename;
+    char *temp;
+} manifest_claim_t;
+
+int manifest_claim(manifest_claim_t *);
+int manifest_publish(manifest_claim_t *);
+void manifest_claim_free(manifest_claim_t *);
+
+#define SHA256_HEX_LEN 64
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char block[64];
+} sha256_t;
+
+void sha256_init(sha256_t *);
+void sha256_update(sha256_t *, const void *, size_t);
+void sha256_final(sha256_t *, char *);
+
+typedef struct {
+    sha256_t sha256;
+    char *buf;
+    size_t len;
+    size_t capacity;
+} archive_object_t;
+
+archive_object_t *archive_object_new(void);
+void archive_object_delete(archive_object_t *);
+void archive_object_write(archive_object_t *, const char *, size_t);
+int archive_object_link(archive_object_t *, const char *, const char *, sync_policy_t);
+char *archive_open(const char *);
+int archive_verify(const char *);
 
 typedef struct {
-    const char *device;
     int fd;
+    int bar;
+    const char *device;
+    const track_t *track;
+    long start_nsec;
+    long last_nsec;
+    long bytes;
+    long last_bytes;
+    double rate;
+    int percent;
+    int eta_sec;
+} progress_t;
+
+void progress_start(progress_t *, int, int, const char *, const track_t *, const char *);
+void progress_bytes(progress_t *, const char *, int);
+void progress_done(progress_t *, const char *);
+void progress_error(progress_t *, const char *, int);
+
+typedef struct {
     FILE *logfile;
-    snp_t *snp;
+    set_t *indexes;
+    const filter_t *filter;
+    const char *archive;
+    sync_policy_t sync_policy;
+    int write_buffer;
+    int progress_fd;
+    int first_byte_ms;
+    int inter_byte_ms;
     const char *manufacturer;
-    char *pilot_name;
-    int serial_number;
-    int trackc;
-    track_t **trackv;
-    char *next;
-    char *end;
-    char buf[128];
-} flytec_t;
+    igc_filename_format_t igc_filename_format;
+    track_format_t track_format;
+    FILE *statsfile;
+    capture_t *capture;
+    int overwrite;
+    int quiet;
+} download_options_t;
+
+typedef struct _multi_t multi_t;
+
+multi_t *multi_new(const download_options_t *);
+int multi_add(multi_t *, const char *);
+int multi_busy(const multi_t *, const char *);
+int multi_devicec(const multi_t *);
+int multi_poll(multi_t *, int);
+int multi_delete(multi_t *);
+int multi_download(const char **, int, const download_options_t *);
+
+int watch(const char *, const char *, const download_options_t *);
+
+/* writes value as n zero-padded digits, returns the end */
+    static inline char *
+put_digits(char *p, int n, int value)
+{
+    int i;
+    for (i = n - 1; i >= 0; --i) {
+	p[i] = '0' + value % 10;
+	value /= 10;
+    }
+    return p + n;
+}
+
+int b_record_format(const b_record_t *, char *);
+
+#define TNB_MAGIC "TNB1"
+#define TNB_SUFFIX ".tnb"
+
+typedef struct {
+    b_record_t b;
+    char *buf;
+    int len;
+    int capacity;
+} tnb_encoder_t;
+
+tnb_encoder_t *tnb_encoder_new(void);
+void tnb_encoder_delete(tnb_encoder_t *);
+void tnb_encode(tnb_encoder_t *, const char *, int);
 
 typedef enum {
-    igc_filename_format_long,
-    igc_filename_format_short
-} igc_filename_format_t;
+    tnb_record_end,
+    tnb_record_b,
+    tnb_record_verbatim,
+    tnb_record_invalid,
+} tnb_record_t;
 
-void flytec_error(flytec_t *, const char *message, ...);
-flytec_t *flytec_new(const char *, FILE *);
-void flytec_delete(flytec_t *);
-int flytec_getc(flytec_t *);
-void flytec_expectc(flytec_t *, char);
-void flytec_puts_nmea(flytec_t *, char *);
-char *flytec_gets(flytec_t *, char *, int);
-char *flytec_gets_nmea(flytec_t *, char *, int);
-int flytec_ping(flytec_t *);
-void flytec_pbrigc(flytec_t *, void (*)(void *, const char *), void *);
-snp_t *flytec_pbrsnp(flytec_t *);
-track_t **flytec_pbrtl(flytec_t *, const char *, igc_filename_format_t);
-void flytec_pbrtr(flytec_t *, track_t *, void (*)(void *, const char *), void *);
-
-int igc_tm_update(struct tm *, const char *);
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    b_record_t b;
+    const char *verbatim;
+    int verbatim_len;
+} tnb_decoder_t;
+
+int tnb_decoder_init(tnb_decoder_t *, const char *, int);
+tnb_record_t tnb_decode(tnb_decoder_t *);
+int tnb_export_igc(const char *, int, FILE *);
+int track_scan(const char *, size_t, void (*)(void *, const char *, int), void (*)(void *, const b_record_t *), void *);
+
+#define GPX_SUFFIX ".gpx"
+#define KML_SUFFIX ".kml"
+#define EXPORT_BLOCK 65536
+
+typedef struct {
+    track_format_t format;
+    char *buf;
+    int len;
+    int capacity;
+    time_t midnight;
+    int time;
+    char date[10];
+} export_encoder_t;
+
+export_encoder_t *export_encoder_new(track_format_t);
+void export_encoder_delete(export_encoder_t *);
+void export_line(export_encoder_t *, const char *, int);
+void export_b(export_encoder_t *, const b_record_t *);
+void export_encode(export_encoder_t *, const char *, int);
+void export_finish(export_encoder_t *);
+int export_track(const char *, size_t, track_format_t, FILE *);
+
+#define INDEX_FILENAME ".tini-index"
+#define INDEX_MAGIC "TINIIDX1"
+
+/* one fixed size record per tracklog, the catalog file is a header, the
+ * records sorted by serial number and start time, and then the record
+ * numbers sorted by start time */
+typedef struct {
+    int64_t time;
+    int64_t end;
+    int64_t size;
+    int64_t mtime;
+    int32_t serial_number;
+    int32_t duration;
+    int32_t b_records;
+    int32_t date;
+    char manufacturer[4];
+    char filename[108];
+} index_entry_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t entry_size;
+    uint32_t entryc;
+    char reserved[16];
+} index_header_t;
+
+int is_track_filename(const char *);
+void index_update(const char *, int);
+int index_query(const char *, const filter_t *, void (*)(void *, const index_entry_t *), void *);
+
+typedef struct {
+    char *filename;
+    int error;
+    time_t time;
+    int airtime;
+    int b_records;
+    int max_altitude;
+    double max_climb;
+    double max_sink;
+    double distance;
+} stats_t;
+
+stats_t *stats_new(const char **, int, int *);
+void stats_delete(stats_t *, int);
 
 #endif
@@ -0,0 +1,325 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* A TNB file is the magic string "TNB1" followed by one record per IGC
+ * line.  Each record starts with a tag byte:
+ *	0		verbatim line: varint length, then the bytes
+ *	1 | flags	B record: deltas from the previous B record
+ * The B record flags are 2 for validity V (otherwise A), 4 if an extension
+ * follows and 8 if the time delta is exactly one second and omitted.  The
+ * deltas of time, latitude, longitude, pressure altitude and GNSS altitude
+ * follow as zigzag varints, then the extension as a varint length and
+ * bytes.  The first B record is a delta from all zeros.  A B record is only
+ * delta encoded if it formats back to exactly the same bytes, anything
+ * else is stored verbatim, so decoding always reproduces the input. */
+
+#include "tini.h"
+
+enum {
+    TNB_VERBATIM = 0,
+    TNB_B = 1,
+    TNB_B_INVALID = 2,
+    TNB_B_EXTENSION = 4,
+    TNB_B_ONE_SECOND = 8,
+};
+
+#define TNB_B_MAX (1 + 5 * 5 + 5)
+#define TNB_LINE_MAX 1024
+
+    static inline char *
+put_altitude(char *p, int value)
+{
+    if (value >= 0)
+	return put_digits(p, 5, value);
+    *p++ = '-';
+    return put_digits(p, 4, -value);
+}
+
+/* formats a B record with its CRLF, returns the length */
+int b_record_format(const b_record_t *b, char *buf)
+{
+    char *p = buf;
+    *p++ = 'B';
+    p = put_digits(p, 2, b->time / 3600);
+    p = put_digits(p, 2, (b->time / 60) % 60);
+    p = put_digits(p, 2, b->time % 60);
+    int lat = b->lat < 0 ? -b->lat : b->lat;
+    p = put_digits(p, 2, lat / 60000);
+    p = put_digits(p, 5, lat % 60000);
+    *p++ = b->lat < 0 ? 'S' : 'N';
+    int lon = b->lon < 0 ? -b->lon : b->lon;
+    p = put_digits(p, 3, lon / 60000);
+    p = put_digits(p, 5, lon % 60000);
+    *p++ = b->lon < 0 ? 'W' : 'E';
+    *p++ = b->validity;
+    p = put_altitude(p, b->pressure_altitude);
+    p = put_altitude(p, b->gnss_altitude);
+    memcpy(p, b->extension, b->extension_len);
+    p += b->extension_len;
+    *p++ = '\r';
+    *p++ = '\n';
+    return p - buf;
+}
+
+static void tnb_reserve(tnb_encoder_t *tnb, int len)
+{
+    if (tnb->len + len <= tnb->capacity)
+	return;
+    while (tnb->len + len > tnb->capacity)
+	tnb->capacity = tnb->capacity ? 2 * tnb->capacity : 4096;
+    tnb->buf = realloc(tnb->buf, tnb->capacity);
+    if (!tnb->buf)
+	DIE("realloc", errno);
+}
+
+    static inline void
+put_varint(tnb_encoder_t *tnb, unsigned int value)
+{
+    while (value >= 0x80) {
+	tnb->buf[tnb->len++] = value | 0x80;
+	value >>= 7;
+    }
+    tnb->buf[tnb->len++] = value;
+}
+
+    static inline void
+put_delta(tnb_encoder_t *tnb, int value, int prev)
+{
+    int delta = value - prev;
+    put_varint(tnb, ((unsigned int) delta << 1) ^ (unsigned int) (delta >> 31));
+}
+
+tnb_encoder_t *tnb_encoder_new(void)
+{
+    tnb_encoder_t *tnb = alloc(sizeof(tnb_encoder_t));
+    tnb_reserve(tnb, 4);
+    memcpy(tnb->buf, TNB_MAGIC, 4);
+    tnb->len = 4;
+    return tnb;
+}
+
+void tnb_encoder_delete(tnb_encoder_t *tnb)
+{
+    if (tnb) {
+	free(tnb->buf);
+	free(tnb);
+    }
+}
+
+static void tnb_encode_verbatim(tnb_encoder_t *tnb, const char *line, int len)
+{
+    tnb_reserve(tnb, 6 + len);
+    tnb->buf[tnb->len++] = TNB_VERBATIM;
+    put_varint(tnb, len);
+    memcpy(tnb->buf + tnb->len, line, len);
+    tnb->len += len;
+}
+
+static void tnb_encode_line(tnb_encoder_t *tnb, const char *line, int len)
+{
+    char copy[TNB_LINE_MAX + 1];
+    char check[TNB_LINE_MAX + 1];
+    b_record_t b;
+    if (line[0] != 'B' || len > TNB_LINE_MAX) {
+	tnb_encode_verbatim(tnb, line, len);
+	return;
+    }
+    memcpy(copy, line, len);
+    copy[len] = '\0';
+    if (!b_record_parse(&b, copy) || b.extension + b.extension_len + 2 != copy + len || b_record_format(&b, check) != len || memcmp(check, copy, len)) {
+	tnb_encode_verbatim(tnb, line, len);
+	return;
+    }
+    tnb_reserve(tnb, TNB_B_MAX + b.extension_len);
+    int tag = TNB_B;
+    if (b.validity == 'V')
+	tag |= TNB_B_INVALID;
+    if (b.extension_len)
+	tag |= TNB_B_EXTENSION;
+    if (b.time == tnb->b.time + 1)
+	tag |= TNB_B_ONE_SECOND;
+    tnb->buf[tnb->len++] = tag;
+    if (!(tag & TNB_B_ONE_SECOND))
+	put_delta(tnb, b.time, tnb->b.time);
+    put_delta(tnb, b.lat, tnb->b.lat);
+    put_delta(tnb, b.lon, tnb->b.lon);
+    put_delta(tnb, b.pressure_altitude, tnb->b.pressure_altitude);
+    put_delta(tnb, b.gnss_altitude, tnb->b.gnss_altitude);
+    if (tag & TNB_B_EXTENSION) {
+	put_varint(tnb, b.extension_len);
+	memcpy(tnb->buf + tnb->len, b.extension, b.extension_len);
+	tnb->len += b.extension_len;
+    }
+    tnb->b = b;
+    tnb->b.extension = 0;
+}
+
+/* appends the encoding of one or more complete lines to tnb->buf, the
+ * caller writes out and resets tnb->len */
+void tnb_encode(tnb_encoder_t *tnb, const char *buf, int len)
+{
+    const char *end = buf + len;
+    while (buf != end) {
+	const char *eol = memchr(buf, '\n', end - buf);
+	const char *next = eol ? eol + 1 : end;
+	tnb_encode_line(tnb, buf, next - buf);
+	buf = next;
+    }
+}
+
+/* returns 0 if buf does not start with the TNB magic */
+int tnb_decoder_init(tnb_decoder_t *tnb, const char *buf, int len)
+{
+    memset(tnb, 0, sizeof(tnb_decoder_t));
+    if (len < 4 || memcmp(buf, TNB_MAGIC, 4))
+	return 0;
+    tnb->p = (const unsigned char *) buf + 4;
+    tnb->end = (const unsigned char *) buf + len;
+    return 1;
+}
+
+    static inline int
+get_varint(tnb_decoder_t *tnb, unsigned int *value)
+{
+    int shift;
+    *value = 0;
+    for (shift = 0; tnb->p != tnb->end && shift < 32; shift += 7) {
+	unsigned int byte = *tnb->p++;
+	*value |= (byte & 0x7f) << shift;
+	if (!(byte & 0x80))
+	    return 1;
+    }
+    return 0;
+}
+
+    static inline int
+get_delta(tnb_decoder_t *tnb, int *value)
+{
+    unsigned int zigzag;
+    if (!get_varint(tnb, &zigzag))
+	return 0;
+    *value = (unsigned int) *value + ((zigzag >> 1) ^ -(zigzag & 1));
+    return 1;
+}
+
+/* decodes the next record into tnb->b or tnb->verbatim */
+tnb_record_t tnb_decode(tnb_decoder_t *tnb)
+{
+    if (tnb->p == tnb->end)
+	return tnb_record_end;
+    int tag = *tnb->p++;
+    unsigned int len;
+    if (tag == TNB_VERBATIM) {
+	if (!get_varint(tnb, &len) || len > (unsigned int) (tnb->end - tnb->p))
+	    return tnb_record_invalid;
+	tnb->verbatim = (const char *) tnb->p;
+	tnb->verbatim_len = len;
+	tnb->p += len;
+	return tnb_record_verbatim;
+    }
+    if (!(tag & TNB_B) || tag > (TNB_B | TNB_B_INVALID | TNB_B_EXTENSION | TNB_B_ONE_SECOND))
+	return tnb_record_invalid;
+    b_record_t *b = &tnb->b;
+    if (tag & TNB_B_ONE_SECOND)
+	++b->time;
+    else if (!get_delta(tnb, &b->time))
+	return tnb_record_invalid;
+    if (!get_delta(tnb, &b->lat) || !get_delta(tnb, &b->lon) || !get_delta(tnb, &b->pressure_altitude) || !get_delta(tnb, &b->gnss_altitude))
+	return tnb_record_invalid;
+    b->validity = tag & TNB_B_INVALID ? 'V' : 'A';
+    b->extension = 0;
+    b->extension_len = 0;
+    if (tag & TNB_B_EXTENSION) {
+	if (!get_varint(tnb, &len) || len > (unsigned int) (tnb->end - tnb->p) || len > TNB_LINE_MAX)
+	    return tnb_record_invalid;
+	b->extension = (const char *) tnb->p;
+	b->extension_len = len;
+	tnb->p += len;
+    }
+    return tnb_record_b;
+}
+
+/* writes the IGC file encoded in buf, returns 0 if buf is not a valid TNB
+ * file */
+int tnb_export_igc(const char *buf, int len, FILE *file)
+{
+    tnb_decoder_t tnb;
+    if (!tnb_decoder_init(&tnb, buf, len))
+	return 0;
+    char line[TNB_LINE_MAX + 64];
+    while (1) {
+	switch (tnb_decode(&tnb)) {
+	    case tnb_record_end:
+		return 1;
+	    case tnb_record_b:
+		len = b_record_format(&tnb.b, line);
+		if (fwrite(line, 1, len, file) != (size_t) len)
+		    DIE("fwrite", errno);
+		break;
+	    case tnb_record_verbatim:
+		if (fwrite(tnb.verbatim, 1, tnb.verbatim_len, file) != (size_t) tnb.verbatim_len)
+		    DIE("fwrite", errno);
+		break;
+	    default:
+		return 0;
+	}
+    }
+}
+
+static void track_scan_line(const char *p, int len, void (*line)(void *, const char *, int), void (*b)(void *, const b_record_t *), void *data)
+{
+    b_record_t record;
+    if (*p == 'B' && b_record_decode(&record, p, len))
+	b(data, &record);
+    else
+	line(data, p, len);
+}
+
+/* calls b for every B record and line for every other line of an IGC or
+ * tnb file, returns 0 if a tnb file is corrupt */
+int track_scan(const char *buf, size_t size, void (*line)(void *, const char *, int), void (*b)(void *, const b_record_t *), void *data)
+{
+    tnb_decoder_t tnb;
+    if (tnb_decoder_init(&tnb, buf, size)) {
+	while (1) {
+	    switch (tnb_decode(&tnb)) {
+		case tnb_record_end:
+		    return 1;
+		case tnb_record_b:
+		    b(data, &tnb.b);
+		    break;
+		case tnb_record_verbatim:
+		    track_scan_line(tnb.verbatim, tnb.verbatim_len, line, b, data);
+		    break;
+		default:
+		    return 0;
+	    }
+	}
+    }
+    const char *p = buf, *end = buf + size;
+    while (p != end) {
+	const char *eol = memchr(p, '\n', end - p);
+	const char *next = eol ? eol + 1 : end;
+	track_scan_line(p, next - p, line, b, data);
+	p = next;
+    }
+    return 1;
+}
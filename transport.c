@@ -0,0 +1,243 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* A transport connects a flytec_t to its FR.  The device name selects one
+ * by its scheme, for example tcp:bridge:2000, and names without a known
+ * scheme are serial ports.  Every transport yields a file descriptor that
+ * poll and select can wait on, so the single device, pipeline and multi
+ * device loops work unchanged over all of them. */
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "libtini.h"
+
+/* a blocking read returns once VMIN bytes have arrived or the line has been
+ * idle for VTIME tenths of a second, batching many bytes per wakeup.  Linux
+ * splits tty reads into 64 byte chunks and a larger VMIN caps every read at
+ * 64 bytes, whereas VMIN 64 lets a read drain everything available. */
+#define FLYTEC_VMIN 64
+#define FLYTEC_VTIME 1
+
+/* serial to network bridges buffer characters before sending them on */
+#define SOCKET_TIMEOUT_MS 1000
+
+/* large enough to hold a whole tracklog while tini is busy writing */
+#define SOCKET_BUFSIZE (256 * 1024)
+
+static int fd_error(int fd)
+{
+    int _errno = errno;
+    close(fd);
+    errno = _errno;
+    return -1;
+}
+
+static int tty_open(flytec_t *flytec, const char *device)
+{
+    int fd = open(device, O_NOCTTY | O_NONBLOCK | O_RDWR);
+    if (fd == -1)
+	return -1;
+    if (tcflush(fd, TCIOFLUSH) == -1)
+	return fd_error(fd);
+    struct termios termios;
+    memset(&termios, 0, sizeof termios);
+    termios.c_iflag = IGNPAR;
+    termios.c_cflag = CLOCAL | CREAD | CS8;
+    termios.c_cc[VMIN] = FLYTEC_VMIN;
+    termios.c_cc[VTIME] = FLYTEC_VTIME;
+    cfsetispeed(&termios, B57600);
+    cfsetospeed(&termios, B57600);
+    if (tcsetattr(fd, TCSANOW, &termios) == -1)
+	return fd_error(fd);
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+	return fd_error(fd);
+    flytec->fd = fd;
+    return 0;
+}
+
+static int socket_options(int fd, int tcp)
+{
+    int bufsize = SOCKET_BUFSIZE;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof bufsize) == -1)
+	return -1;
+    if (tcp) {
+	/* commands are tiny and the FR waits for each one, so do not let
+	 * Nagle hold them back waiting for an ACK */
+	int one = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one) == -1)
+	    return -1;
+    }
+    return 0;
+}
+
+/* address is host:port, an IPv6 host is written in brackets */
+static int tcp_open(flytec_t *flytec, const char *address)
+{
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon == address || !colon[1]) {
+	errno = EINVAL;
+	return -1;
+    }
+    char *host;
+    if (address[0] == '[' && colon[-1] == ']')
+	host = tini_strndup(flytec->hooks, address + 1, colon - address - 2);
+    else
+	host = tini_strndup(flytec->hooks, address, colon - address);
+    if (!host)
+	return -1;
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, colon + 1, &hints, &ai);
+    tini_free(flytec->hooks, host);
+    if (rc) {
+	if (rc != EAI_SYSTEM)
+	    errno = ENXIO;
+	return -1;
+    }
+    int fd = -1;
+    struct addrinfo *p;
+    for (p = ai; p; p = p->ai_next) {
+	fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+	if (fd == -1)
+	    continue;
+	if (socket_options(fd, 1) == 0 && connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+	    break;
+	fd_error(fd);
+	fd = -1;
+    }
+    freeaddrinfo(ai);
+    if (fd == -1)
+	return -1;
+    flytec->fd = fd;
+    return 0;
+}
+
+static int unix_open(flytec_t *flytec, const char *path)
+{
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof sun.sun_path) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    strcpy(sun.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+	return -1;
+    if (socket_options(fd, 0) == -1 || connect(fd, (struct sockaddr *) &sun, sizeof sun) == -1)
+	return fd_error(fd);
+    flytec->fd = fd;
+    return 0;
+}
+
+static int replay_transport_open(flytec_t *flytec, const char *filename)
+{
+    replay_t *replay;
+    flytec->fd = replay_open(flytec->hooks, filename, 0, &replay);
+    flytec->transport_data = replay;
+    return flytec->fd == -1 ? -1 : 0;
+}
+
+static int replay_paced_transport_open(flytec_t *flytec, const char *filename)
+{
+    replay_t *replay;
+    flytec->fd = replay_open(flytec->hooks, filename, 1, &replay);
+    flytec->transport_data = replay;
+    return flytec->fd == -1 ? -1 : 0;
+}
+
+static int fd_read(flytec_t *flytec)
+{
+    return ring_read(flytec->ring, flytec->fd);
+}
+
+/* a non-blocking descriptor can take only part of buf */
+static int fd_write(flytec_t *flytec, const char *buf, int len)
+{
+    int written = 0;
+    while (written < len) {
+	int rc = write(flytec->fd, buf + written, len - written);
+	if (rc == -1) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN && written)
+		break;
+	    return -1;
+	}
+	written += rc;
+    }
+    return written;
+}
+
+/* there is nothing to be done if close fails */
+static void fd_close(flytec_t *flytec)
+{
+    close(flytec->fd);
+}
+
+static void replay_transport_close(flytec_t *flytec)
+{
+    fd_close(flytec);
+    replay_close(flytec->transport_data);
+}
+
+static const transport_t transports[] = {
+    { "tty:", FLYTEC_TIMEOUT_MS, 100 * FLYTEC_VTIME, tty_open, fd_read, fd_write, fd_close },
+    { "tcp:", SOCKET_TIMEOUT_MS, 0, tcp_open, fd_read, fd_write, fd_close },
+    { "unix:", SOCKET_TIMEOUT_MS, 0, unix_open, fd_read, fd_write, fd_close },
+    { "replay:", FLYTEC_TIMEOUT_MS, 0, replay_transport_open, fd_read, fd_write, replay_transport_close },
+    { "replay-paced:", FLYTEC_TIMEOUT_MS, 0, replay_paced_transport_open, fd_read, fd_write, replay_transport_close },
+    { 0, 0, 0, 0, 0, 0, 0 }
+};
+
+/* sets flytec->transport and opens the device, returns -1 with errno set
+ * on failure */
+int transport_open(flytec_t *flytec, const char *device)
+{
+    const transport_t *transport;
+    const char *address = device;
+    for (transport = transports; transport->scheme; ++transport) {
+	int len = strlen(transport->scheme);
+	if (!strncmp(device, transport->scheme, len)) {
+	    address = device + len;
+	    break;
+	}
+    }
+    if (!transport->scheme)
+	transport = transports;
+    /* accept tcp://host:port as well as tcp:host:port */
+    if (address != device && address[0] == '/' && address[1] == '/')
+	address += 2;
+    flytec->transport = transport;
+    return transport->open(flytec, address);
+}
@@ -0,0 +1,263 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* Just enough of io_uring for the pipeline threads, using the system calls
+ * directly so that liburing is not needed.  A uring_t belongs to the one
+ * thread that submits to it.  uring_new fails with ENOSYS wherever io_uring
+ * is missing, too old or forbidden, and the callers then fall back to poll
+ * and write. */
+
+#include <sys/uio.h>
+
+#include "libtini.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+
+struct _uring_t {
+    const tini_hooks_t *hooks;
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int queued;
+};
+
+static void uring_free(uring_t *uring)
+{
+    if (uring->sqes)
+	munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+	munmap(uring->cq_ring, uring->cq_ring_size);
+    if (uring->sq_ring)
+	munmap(uring->sq_ring, uring->sq_ring_size);
+    if (uring->fd != -1)
+	close(uring->fd);
+    tini_free(uring->hooks, uring);
+}
+
+/* returns 0 with errno set on failure */
+uring_t *uring_new(const tini_hooks_t *hooks, unsigned int entries)
+{
+    uring_t *uring = tini_alloc(hooks, sizeof(uring_t));
+    if (!uring)
+	return 0;
+    uring->hooks = hooks;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    uring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (uring->fd == -1) {
+	int _errno = errno;
+	uring_free(uring);
+	errno = _errno == EPERM || _errno == EINVAL ? ENOSYS : _errno;
+	return 0;
+    }
+    /* waiting with a timeout and writing at the file position */
+    unsigned int features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG | IORING_FEAT_RW_CUR_POS;
+    if ((params.features & features) != features) {
+	uring_free(uring);
+	errno = ENOSYS;
+	return 0;
+    }
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (uring->cq_ring_size > uring->sq_ring_size)
+	uring->sq_ring_size = uring->cq_ring_size;
+    uring->sq_ring = mmap(0, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED) {
+	int _errno = errno;
+	uring->sq_ring = 0;
+	uring_free(uring);
+	errno = _errno;
+	return 0;
+    }
+    uring->cq_ring = uring->sq_ring;
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(0, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+	int _errno = errno;
+	uring->sqes = 0;
+	uring_free(uring);
+	errno = _errno;
+	return 0;
+    }
+    char *sq = uring->sq_ring, *cq = uring->cq_ring;
+    uring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    uring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    uring->sq_mask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    uring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    uring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    uring->cq_mask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return uring;
+}
+
+void uring_delete(uring_t *uring)
+{
+    if (uring)
+	uring_free(uring);
+}
+
+static struct io_uring_sqe *uring_sqe(uring_t *uring)
+{
+    unsigned int tail = *uring->sq_tail;
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) > uring->sq_mask) {
+	errno = EBUSY;
+	return 0;
+    }
+    unsigned int index = tail & uring->sq_mask;
+    struct io_uring_sqe *sqe = uring->sqes + index;
+    memset(sqe, 0, sizeof *sqe);
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++uring->queued;
+    return sqe;
+}
+
+/* queues a readv or writev at the file position, returns -1 with errno set
+ * if the submission queue is full */
+static int uring_rw(uring_t *uring, int opcode, int fd, const struct iovec *iov, int iovcnt, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(uring);
+    if (!sqe)
+	return -1;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = (uint64_t) -1;
+    sqe->addr = (uintptr_t) iov;
+    sqe->len = iovcnt;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_readv(uring_t *uring, int fd, const struct iovec *iov, int iovcnt, uint64_t user_data)
+{
+    return uring_rw(uring, IORING_OP_READV, fd, iov, iovcnt, user_data);
+}
+
+int uring_writev(uring_t *uring, int fd, const struct iovec *iov, int iovcnt, uint64_t user_data)
+{
+    return uring_rw(uring, IORING_OP_WRITEV, fd, iov, iovcnt, user_data);
+}
+
+/* queues the cancellation of the request identified by user_data, whose
+ * completion then has res -ECANCELED */
+int uring_cancel(uring_t *uring, uint64_t user_data, uint64_t cancel_user_data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(uring);
+    if (!sqe)
+	return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = cancel_user_data;
+    return 0;
+}
+
+/* submits the queued requests in one system call and waits up to
+ * timeout_ms, or forever if it is negative, for a completion.  Returns 1
+ * with the completion's user_data and res, 0 on timeout and -1 with errno
+ * set on failure. */
+int uring_wait(uring_t *uring, int timeout_ms, uint64_t *user_data, int *res)
+{
+    while (1) {
+	unsigned int head = *uring->cq_head;
+	if (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+	    const struct io_uring_cqe *cqe = uring->cqes + (head & uring->cq_mask);
+	    *user_data = cqe->user_data;
+	    *res = cqe->res;
+	    __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+	    return 1;
+	}
+	struct __kernel_timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof arg);
+	arg.ts = timeout_ms < 0 ? 0 : (uintptr_t) &ts;
+	int rc = syscall(__NR_io_uring_enter, uring->fd, uring->queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+	if (rc >= 0) {
+	    uring->queued -= rc;
+	} else if (errno == ETIME) {
+	    /* the queued requests were submitted before the wait timed out */
+	    uring->queued = 0;
+	    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	} else if (errno != EINTR) {
+	    return -1;
+	}
+    }
+}
+
+#else
+
+uring_t *uring_new(const tini_hooks_t *hooks, unsigned int entries)
+{
+    errno = ENOSYS;
+    return 0;
+}
+
+void uring_delete(uring_t *uring)
+{
+}
+
+int uring_readv(uring_t *uring, int fd, const struct iovec *iov, int iovcnt, uint64_t user_data)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_writev(uring_t *uring, int fd, const struct iovec *iov, int iovcnt, uint64_t user_data)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_cancel(uring_t *uring, uint64_t user_data, uint64_t cancel_user_data)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_wait(uring_t *uring, int timeout_ms, uint64_t *user_data, int *res)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+
+   tini - download tracklogs from Brauniger and Flytec flight recorders
+   Copyright (C) 2007-2008  Tom Payne
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the
+   Free Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/* watch waits for device nodes to appear with inotify and hands each one
+ * straight to the multi device engine, whose poll loop also waits on the
+ * inotify descriptor.  Nothing sleeps or polls the directory, so PBRSNP is
+ * sent as soon as the node can be opened. */
+
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "tini.h"
+
+static void watch_device(multi_t *multi, const char *directory, const char *name, const char *pattern, int mask, const download_options_t *options)
+{
+    if (fnmatch(pattern, name, 0))
+	return;
+    char *path = alloc(strlen(directory) + strlen(name) + 2);
+    sprintf(path, "%s/%s", directory, name);
+    struct stat st;
+    if (multi_busy(multi, path) || stat(path, &st) == -1 || !S_ISCHR(st.st_mode)) {
+	free(path);
+	return;
+    }
+    if (multi_add(multi, path) == -1) {
+	/* udev creates the node first and sets its permissions afterwards,
+	 * which is reported as IN_ATTRIB */
+	if (!(mask & IN_CREATE) || (errno != EACCES && errno != EPERM))
+	    fprintf(stderr, "%s: %s: %s\n", program_name, path, strerror(errno));
+    } else if (!options->quiet) {
+	fprintf(stderr, "%s: %s: device connected\n", program_name, path);
+    }
+    free(path);
+}
+
+/* never returns unless the directory goes away */
+int watch(const char *directory, const char *pattern, const download_options_t *options)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1)
+	DIE("inotify_init1", errno);
+    if (inotify_add_watch(fd, directory, IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_ONLYDIR) == -1)
+	error("inotify_add_watch: %s: %s", directory, strerror(errno));
+    if (!options->quiet)
+	fprintf(stderr, "%s: watching %s/%s\n", program_name, directory, pattern);
+    multi_t *multi = multi_new(options);
+    while (1) {
+	if (!multi_poll(multi, fd))
+	    continue;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof buf)) > 0) {
+	    const char *p;
+	    for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((const struct inotify_event *) p)->len) {
+		const struct inotify_event *event = (const struct inotify_event *) p;
+		if (event->mask & (IN_IGNORED | IN_UNMOUNT)) {
+		    fprintf(stderr, "%s: %s: directory removed\n", program_name, directory);
+		    close(fd);
+		    return multi_delete(multi);
+		}
+		if (event->len)
+		    watch_device(multi, directory, event->name, pattern, event->mask, options);
+	    }
+	}
+	if (n == -1 && errno != EAGAIN && errno != EINTR)
+	    DIE("read", errno);
+    }
+}